@@ -0,0 +1,84 @@
+-- messages/sec from parent to child through proc.channel against writes to the child's stdin pipe,
+-- one message per call and batches; the child (eli_proc_extra_bench_peer, BENCH_PEER) counts what arrives
+local proc = require("eli.proc.extra")
+
+local PEER = os.getenv("BENCH_PEER")
+local MESSAGES = tonumber(os.getenv("BENCH_CHANNEL_MESSAGES") or "200000")
+local SIZE = tonumber(os.getenv("BENCH_CHANNEL_SIZE") or "64")
+local BATCH = 64
+
+if PEER == nil then
+    bench.emit("channel_throughput", { skipped = "BENCH_PEER is not set" })
+    return
+end
+
+local message = string.rep("m", SIZE)
+local batch = {}
+for i = 1, BATCH do
+    batch[i] = message
+end
+local joined = table.concat(batch)
+
+local function run(transport, send)
+    local ch = transport == "channel" and assert(proc.channel()) or nil
+    local count = transport == "channel" and MESSAGES or MESSAGES * SIZE
+    local p = assert(proc.spawn(PEER, {
+        args = { transport, tostring(count) },
+        fds = ch and ch:fds(3) or nil,
+        stdio = { stdin = transport == "pipe" and "pipe" or "ignore", stdout = "pipe", stderr = "inherit" },
+    }))
+    local sink = transport == "channel" and ch or p:get_stdin()
+    local start = bench.now()
+    send(sink)
+    local result = p:get_stdout():read("a")
+    local seconds = bench.now() - start
+    assert(p:wait() == 0, "peer failed")
+    local bytes = tonumber(result:match("^%d+ (%d+)"))
+    assert(bytes == MESSAGES * SIZE, "peer received " .. tostring(bytes) .. " bytes")
+    if ch then
+        ch:close()
+    end
+    return seconds
+end
+
+local cases = {
+    { "channel", "single", function(ch)
+        for _ = 1, MESSAGES do
+            ch:send(message)
+        end
+    end },
+    { "channel", "batch", function(ch)
+        for _ = 1, MESSAGES // BATCH do
+            ch:send(batch)
+        end
+        for _ = 1, MESSAGES % BATCH do
+            ch:send(message)
+        end
+    end },
+    { "pipe", "single", function(stdin)
+        for _ = 1, MESSAGES do
+            stdin:write(message)
+        end
+    end },
+    { "pipe", "batch", function(stdin)
+        for _ = 1, MESSAGES // BATCH do
+            stdin:write(joined)
+        end
+        for _ = 1, MESSAGES % BATCH do
+            stdin:write(message)
+        end
+    end },
+}
+for _, case in ipairs(cases) do
+    local seconds = run(case[1], case[3])
+    bench.emit("channel_throughput", {
+        transport = case[1],
+        sends = case[2],
+        batch = case[2] == "batch" and BATCH or 1,
+        messages = MESSAGES,
+        message_bytes = SIZE,
+        seconds = seconds,
+        messages_per_sec = MESSAGES / seconds,
+        mib_per_sec = MESSAGES * SIZE / seconds / (1 << 20),
+    })
+end
@@ -0,0 +1,22 @@
+-- orphans of spawned process groups are reaped by default even when they exit before any scan saw them,
+-- other children of the host are left to whoever waits for them
+local proc = require("eli.proc.extra")
+
+assert(proc.set_subreaper(true))
+local self = tonumber(io.open("/proc/self/stat"):read("a"):match("^(%d+)"))
+
+-- the shell exits at once, its background child is re-parented to us and exits before reap_orphans scans
+local p = assert(proc.spawn("sh", { args = { "-c", "sleep 0.2 &" }, stdio = "ignore", create_process_group = true }))
+assert(p:wait() == 0)
+-- same shape outside of spawn, in our process group
+assert(os.execute("sleep 0.2 &"))
+assert(os.execute("sleep 0.5"))
+
+local reaped = assert(proc.reap_orphans())
+assert(#reaped == 1, #reaped .. " orphans reaped, 1 expected")
+assert(reaped[1].exitcode == 0 and reaped[1].signal == 0)
+local zombies = assert(proc.list({ ppid = self, state = "Z" }))
+assert(zombies.n == 1, "child which was not spawned was reaped")
+
+assert(#assert(proc.reap_orphans({ all = true })) == 1)
+assert(proc.set_subreaper(false))
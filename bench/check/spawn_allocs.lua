@@ -0,0 +1,34 @@
+-- allocation counters of timed spawns: every spawn of the same shape allocates the same, so per-spawn costs
+-- cannot creep up unnoticed
+local proc = require("eli.proc.extra")
+
+local SHAPES = {
+    ignore = { stdio = "ignore" },
+    pipe = { stdio = { stdin = "ignore", stdout = "pipe", stderr = "ignore" } },
+    env = { stdio = "ignore", env_add = { SPAWN_ALLOCS_CHECK = "1" } },
+    tail = { stdio = { stdin = "ignore", stdout = { "tail", size = 1024 }, stderr = "ignore" } },
+}
+
+local previous = proc.stats_enable(true)
+for name, options in pairs(SHAPES) do
+    local first
+    for i = 1, 50 do
+        local p = assert(proc.spawn("true", options))
+        local t = assert(p:spawn_timings(), "spawn not timed")
+        assert(p:wait() == 0)
+        assert(t.allocs > 0 and t.alloc_bytes > 0, name .. ": allocations not counted")
+        if i == 2 then -- first one may build shared state (environment snapshot)
+            first = t
+        elseif i > 2 then
+            assert(t.allocs == first.allocs and t.alloc_bytes == first.alloc_bytes,
+                string.format("%s: spawn %d allocated %d/%d bytes, %d/%d expected", name, i, t.allocs, t.alloc_bytes,
+                    first.allocs, first.alloc_bytes))
+        end
+    end
+end
+
+local totals = proc.stats().allocations
+assert(totals.allocs > 0 and totals.max_allocs > 0 and totals.alloc_bytes >= totals.max_alloc_bytes)
+proc.stats_reset()
+assert(proc.stats().allocations.allocs == 0)
+proc.stats_enable(previous)
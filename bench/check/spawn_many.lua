@@ -0,0 +1,28 @@
+-- proc.spawn_many returns nil, error, {proc...}, details whichever step failed
+local proc = require("eli.proc.extra")
+
+local function check_failure(what, ok, err, procs, details, ...)
+    assert(select("#", ...) == 0, what .. ": 4 values expected")
+    assert(ok == nil, what .. ": failure expected")
+    assert(type(err) == "string", what .. ": error message expected, got " .. type(err))
+    assert(type(procs) == "table", what .. ": spawned processes expected as 3rd value, got " .. type(procs))
+    assert(type(details) == "table" and math.type(details.errno) == "integer",
+        what .. ": details with errno expected as 4th value, got " .. type(details))
+    return details
+end
+
+-- exec fails in the child
+local details = check_failure("exec", proc.spawn_many("/nonexistent/spawn-many-check", { stdio = "ignore" }, 3))
+assert(details.stage == "exec" and details.retryable == false, "exec failure details expected")
+
+-- stdio of the child cannot be set up in the parent
+check_failure("stdio", proc.spawn_many("true", {
+    stdio = { stdin = "ignore", stdout = "/nonexistent/spawn-many-check/out", stderr = "ignore" },
+}, 2))
+
+-- success is the table of processes alone
+local many = assert(proc.spawn_many("true", { stdio = "ignore" }, 2))
+assert(#many == 2 and select("#", proc.spawn_many("true", { stdio = "ignore" }, 0)) == 1)
+for _, p in ipairs(many) do
+    assert(p:wait() == 0)
+end
@@ -0,0 +1,54 @@
+-- spawn servers outlive the thread which started them and servers killed from outside are reported as lost
+local proc = require("eli.proc.extra")
+
+local function spawn_true(options)
+    local p = assert(proc.spawn("true", options or { stdio = "ignore" }))
+    assert(p:wait() == 0, "true failed")
+end
+
+local self = tonumber(io.open("/proc/self/stat"):read("a"):match("^(%d+)"))
+local function server_pids()
+    local children = assert(proc.list({ ppid = self }))
+    local comm = io.open("/proc/self/comm"):read("l")
+    local pids = {}
+    for i, pid in ipairs(children.pids) do
+        if children.comms[i] == comm and children.states[i] ~= "Z" then
+            pids[#pids + 1] = pid
+        end
+    end
+    return pids
+end
+
+-- started from a worker thread which exits once the server is up
+bench.parallel(1, [[
+    local proc = require("eli.proc.extra")
+    assert(proc.start_spawn_server(2))
+    assert(os.execute("sleep 0.2"))
+    return 0
+]])
+local deadline = bench.now() + 0.5
+while bench.now() < deadline do
+    spawn_true()
+end
+assert(proc.spawn_server_status() == "running", "spawn server died with the thread which started it")
+local servers = server_pids()
+assert(#servers == 2, #servers .. " spawn server processes found, 2 expected")
+spawn_true({ stdio = "ignore", die_with_parent = true })
+
+-- killed from outside, each spawn which finds one gone falls back to fork, the loss is visible once all are
+for _, pid in ipairs(servers) do
+    assert(os.execute("kill -9 " .. pid))
+end
+for _ = 1, #servers do
+    spawn_true()
+end
+local status, err = proc.spawn_server_status()
+assert(status == "lost" and type(err) == "string", "lost spawn server not reported, got " .. tostring(status))
+spawn_true()
+
+assert(proc.start_spawn_server())
+assert(proc.spawn_server_status() == "running")
+assert(#server_pids() > 0, "lost spawn servers not replaced")
+spawn_true()
+assert(proc.stop_spawn_server())
+assert(proc.spawn_server_status() == "stopped")
@@ -0,0 +1,12 @@
+-- process.wait_any returns once its timeout elapses even when deadline timers of the processes wake it up earlier
+local proc = require("eli.proc.extra")
+
+local SIGWINCH = 28 -- ignored by sleep, the deadline fires without ending the process
+
+local p = assert(proc.spawn("sleep", { args = { "30" }, stdio = "ignore", timeout = 0.3, kill_signal = SIGWINCH }))
+local start = bench.now()
+assert(proc.wait_any({ p }, 1000) == nil, "wait_any timeout expected")
+local elapsed = bench.now() - start
+assert(elapsed >= 0.99 and elapsed < 1.25, string.format("wait_any({p}, 1000) returned after %.3f s", elapsed))
+p:kill(9)
+p:wait()
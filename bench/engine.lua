@@ -0,0 +1,66 @@
+-- io_uring against epoll event engine: pool jobs/sec and event loop draining many children's stdout
+local proc = require("eli.proc.extra")
+
+local JOBS = tonumber(os.getenv("BENCH_ENGINE_JOBS") or "2000")
+local CHILDREN = tonumber(os.getenv("BENCH_ENGINE_CHILDREN") or "64")
+local CHILD_BYTES = tonumber(os.getenv("BENCH_ENGINE_CHILD_BYTES") or tostring(4 << 20))
+local ROUNDS = tonumber(os.getenv("BENCH_ENGINE_ROUNDS") or "5")
+local OPTIONS = { stdio = "ignore" }
+
+local function pool_run()
+    local pool = assert(proc.pool({ max = bench.cores() * 4 }))
+    for _ = 1, JOBS do
+        assert(pool:submit("true", OPTIONS, function() end))
+    end
+    pool:run()
+    return JOBS
+end
+
+local function loop_run()
+    local loop = assert(proc.event_loop())
+    local total = 0
+    for _ = 1, CHILDREN do
+        loop:spawn(function()
+            local p = assert(proc.spawn("head", {
+                args = { "-c", tostring(CHILD_BYTES), "/dev/zero" },
+                stdio = { stdin = "ignore", stdout = "pipe", stderr = "ignore" },
+            }))
+            while true do
+                local chunk = p:read_async("stdout", 65536)
+                if chunk == nil then
+                    break
+                end
+                total = total + #chunk
+            end
+            assert(p:wait_async() == 0)
+        end)
+    end
+    assert(loop:run())
+    assert(total == CHILDREN * CHILD_BYTES)
+    return total / (1 << 20)
+end
+
+local cases = {
+    { "pool", pool_run, { jobs = JOBS, unit = "jobs/s" } },
+    { "loop_read", loop_run, { children = CHILDREN, child_bytes = CHILD_BYTES, unit = "MiB/s" } },
+}
+for _, backend in ipairs({ "epoll", "io_uring" }) do
+    local selected, err = proc.event_engine(backend)
+    if selected ~= backend then
+        bench.emit("event_engine", { backend = backend, skipped = tostring(err or selected) })
+    else
+        for _, case in ipairs(cases) do
+            local rates, cpu_seconds = {}, 0
+            for round = 1, ROUNDS do
+                collectgarbage()
+                local start, cpu = bench.now(), os.clock()
+                local amount = case[2]()
+                rates[round] = amount / (bench.now() - start)
+                cpu_seconds = cpu_seconds + os.clock() - cpu
+            end
+            bench.emit("event_engine", { backend = backend, case = case[1], cpu_seconds = cpu_seconds }, case[3],
+                bench.stats(rates))
+        end
+    end
+end
+proc.event_engine("auto")
@@ -0,0 +1,39 @@
+-- /bin/true spawn latency against host heap size (0 up to BENCH_HEAP_MAX, 2 GiB), forking from the host
+-- directly and through the spawn server started while the host was small
+local proc = require("eli.proc.extra")
+
+local MAX = tonumber(os.getenv("BENCH_HEAP_MAX") or tostring(2 << 30))
+local SPAWNS = tonumber(os.getenv("BENCH_HEAP_SPAWNS") or "200")
+local PIECE = 64 << 20
+
+assert(proc.start_spawn_server())
+
+local function latency(server)
+    local options = { stdio = "ignore", spawn_server = server }
+    local samples = {}
+    for i = 1, SPAWNS do
+        local start = bench.now()
+        local p = assert(proc.spawn("/bin/true", options))
+        samples[i] = (bench.now() - start) * 1e6
+        assert(p:wait() == 0)
+    end
+    return bench.stats(samples)
+end
+
+-- long strings are not interned, each piece is its own touched allocation
+local ballast, heap = {}, 0
+local target = 0
+while target <= MAX do
+    while heap < target do
+        ballast[#ballast + 1] = string.rep("x", PIECE)
+        heap = heap + PIECE
+    end
+    local meta = { command = "/bin/true", heap_bytes = heap, rss_bytes = bench.rss(), unit = "us" }
+    bench.emit("spawn_heap", meta, { mode = "fork" }, latency(false))
+    bench.emit("spawn_heap", meta, { mode = "spawn_server" }, latency(true))
+    target = target == 0 and 256 << 20 or target * 2
+end
+
+ballast = nil
+collectgarbage()
+proc.stop_spawn_server()
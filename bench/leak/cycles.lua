@@ -0,0 +1,134 @@
+-- spawn, read, kill and gc cycles; fails when open fds or allocator in-use bytes do not return to baseline
+-- LEAK_CYCLES per window, LEAK_HEAP_SLACK bytes tolerated per window (objects kept by dead stack slots, caches);
+-- heap has to stay within slack in one of two consecutive windows, a leak grows in both
+local proc = require("eli.proc.extra")
+
+local CYCLES = tonumber(os.getenv("LEAK_CYCLES") or "2000")
+local HEAP_SLACK = tonumber(os.getenv("LEAK_HEAP_SLACK") or tostring(64 * 1024))
+local WARMUP = 50
+
+local cases = {
+    { "pipe_read_kill", function()
+        local p = assert(proc.spawn("yes", { stdio = "pipe" }))
+        local stdout = p:get_stdout()
+        assert(#stdout:read(4096) > 0)
+        p:get_stdout():close() -- dup'd stream
+        assert(p:kill(9))
+        p:wait()
+        stdout:close()
+    end },
+    { "pipe_gc_unread", function()
+        local p = assert(proc.spawn("head", { args = { "-c", "1000", "/dev/zero" }, stdio = "pipe" }))
+        p:get_stdin()
+        p:get_stderr()
+        p:wait() -- streams and process left to gc
+    end },
+    { "ignore", function() -- /dev/null opens
+        local p = assert(proc.spawn("true", { stdio = "ignore" }))
+        assert(p:wait() == 0)
+    end },
+    { "env", function()
+        local p = assert(proc.spawn("true", { stdio = "ignore", env_add = { LEAK = "1", OTHER = "2" } }))
+        assert(p:wait() == 0)
+    end },
+    { "spawn_failure", function()
+        assert(proc.spawn("/nonexistent/leak-check", { stdio = "pipe" }) == nil)
+    end },
+    { "rejected_options", function() -- options are checked before earlier entries open anything
+        local rejected = {
+            { stdin = "pipe", stdout = { "ignore", pipe_size = 65536 } },
+            { stdin = "pipe", stdout = { "pipe", size = 4096 } },
+            { stdout = "pipe", stdin = "tail" },
+            { stdin = { "pipe", timestamps = true } },
+            { stdin = "pipe", stdout = "pipe", stderr = { "tail", timestamps = true } },
+        }
+        for _, stdio in ipairs(rejected) do
+            assert(not pcall(proc.spawn, "true", { stdio = stdio }))
+        end
+    end },
+    { "tail", function()
+        local p = assert(proc.spawn("head", {
+            args = { "-c", "20000", "/dev/zero" },
+            stdio = { stdin = "ignore", stdout = { "tail", size = 4096 }, stderr = "ignore" },
+        }))
+        p:wait()
+        assert(p:get_tail("stdout"))
+    end },
+    { "timestamps", function()
+        local p = assert(proc.spawn("head", {
+            args = { "-c", "20000", "/dev/zero" },
+            stdio = { stdin = "ignore", stdout = { "pipe", timestamps = true }, stderr = "ignore" },
+        }))
+        local stdout = p:get_stdout()
+        repeat
+            local chunk = stdout:read(65536)
+        until chunk == nil or #chunk == 0
+        p:wait()
+        assert(p:get_timestamps("stdout"))
+    end },
+    { "pool", function()
+        local pool = assert(proc.pool({ max = 2 }))
+        for _ = 1, 4 do
+            assert(pool:submit("true", { stdio = "ignore" }))
+        end
+        pool:run()
+    end },
+    { "channel", function()
+        local ch = assert(proc.channel())
+        assert(ch:send("leak") == 1) -- received only by the child side
+        assert(#ch:try_recv() == 0)
+        ch:close()
+    end },
+    { "list_snapshot", function()
+        assert(proc.list())
+        assert(proc.snapshot():update())
+    end },
+}
+
+-- pump thread closes drained fds (and frees their sinks) asynchronously, give it SETTLE_S to get back to fds
+local SETTLE_S = 1
+local function settle(fds)
+    local deadline = bench.now() + SETTLE_S
+    repeat
+        collectgarbage()
+        collectgarbage()
+    until bench.fd_count() == fds or bench.now() > deadline
+end
+
+local function window(cycle, fds)
+    for i = 1, CYCLES do
+        cycle()
+        if i % 100 == 0 then
+            collectgarbage()
+        end
+    end
+    settle(fds)
+    return bench.fd_count(), bench.heap()
+end
+
+local failed = {}
+for _, case in ipairs(cases) do
+    local name, cycle = case[1], case[2]
+    local before = bench.fd_count()
+    for _ = 1, WARMUP do
+        cycle()
+    end
+    settle(before)
+    local fds, heap = bench.fd_count(), bench.heap()
+    local fds1, heap1 = window(cycle, fds)
+    local fds2, heap2 = window(cycle, fds)
+    local growth = heap and math.min(heap1 - heap, heap2 - heap1)
+    local ok = fds1 == fds and fds2 == fds and (growth == nil or growth <= HEAP_SLACK)
+    bench.emit("leak", {
+        case = name,
+        cycles = 2 * CYCLES,
+        fd_delta = fds2 - fds,
+        heap_delta_bytes = heap and heap2 - heap or false,
+        heap_growth_bytes = growth or false,
+        ok = ok,
+    })
+    if not ok then
+        failed[#failed + 1] = name
+    end
+end
+assert(#failed == 0, "resources not returned to baseline: " .. table.concat(failed, ", "))
@@ -0,0 +1,62 @@
+-- spawn latency of a command resolved through a deep PATH against the same command pinned with proc.pin;
+-- BENCH_PINNED_DIRS PATH entries nested BENCH_PINNED_DEPTH levels deep stand in for slow (overlay, network)
+-- lookups, the command lives in the last entry so every spawn walks all of them
+local proc = require("eli.proc.extra")
+
+local SPAWNS = tonumber(os.getenv("BENCH_SPAWNS") or "2000")
+local DIRS = tonumber(os.getenv("BENCH_PINNED_DIRS") or "64")
+local DEPTH = tonumber(os.getenv("BENCH_PINNED_DEPTH") or "16")
+local COMMAND = "eli-proc-extra-bench-true"
+
+local function run(cmd, args)
+    local p = assert(proc.spawn(cmd, { args = args, stdio = "ignore" }))
+    assert(p:wait() == 0, cmd .. " failed")
+end
+
+local root = os.tmpname()
+os.remove(root)
+local entries = {}
+for i = 1, DIRS do
+    local entry = root .. "/" .. i
+    for level = 1, DEPTH do
+        entry = entry .. "/" .. level
+    end
+    entries[i] = entry
+end
+run("mkdir", { "-p", table.unpack(entries) })
+run("cp", { "/bin/true", entries[DIRS] .. "/" .. COMMAND })
+
+local function measure(cmd)
+    local samples = {}
+    for i = 1, SPAWNS do
+        local t = bench.now()
+        local p = assert(proc.spawn(cmd, { stdio = "ignore" }))
+        assert(p:wait() == 0)
+        samples[i] = (bench.now() - t) * 1e6
+    end
+    return bench.stats(samples)
+end
+
+-- search runs against PATH of this process, set only while no other threads run
+local host_path = os.getenv("PATH")
+bench.setenv("PATH", table.concat(entries, ":") .. ":" .. host_path)
+
+local resolve = {}
+local pinned
+for i = 1, SPAWNS do
+    local t = bench.now()
+    pinned = assert(proc.pin(COMMAND))
+    resolve[i] = (bench.now() - t) * 1e6
+    if i < SPAWNS then
+        pinned:close()
+    end
+end
+local shape = { dirs = DIRS, depth = DEPTH, unit = "us" }
+bench.emit("pinned_resolve", shape, bench.stats(resolve))
+bench.emit("pinned_spawn", shape, { mode = "path" }, measure(COMMAND))
+bench.emit("pinned_spawn", shape, { mode = "pinned" }, measure(pinned))
+bench.emit("pinned_spawn", shape, { mode = "absolute" }, measure(entries[DIRS] .. "/" .. COMMAND))
+pinned:close()
+
+bench.setenv("PATH", host_path)
+run("rm", { "-rf", root })
@@ -0,0 +1,32 @@
+-- throughput of reading child stdout through get_stdout, 1 KiB up to BENCH_PIPE_MAX bytes (1 GiB)
+local proc = require("eli.proc.extra")
+
+local MAX = tonumber(os.getenv("BENCH_PIPE_MAX") or tostring(1 << 30))
+local CHUNK = 64 * 1024
+
+local size = 1024
+while size <= MAX do
+    local rounds = math.max(math.min((64 << 20) // size, 200), 1)
+    local samples = {}
+    for round = 1, rounds do
+        local start = bench.now()
+        local p = assert(proc.spawn("head", {
+            args = { "-c", tostring(size), "/dev/zero" },
+            stdio = { stdin = "ignore", stdout = "pipe", stderr = "ignore" },
+        }))
+        local stdout = p:get_stdout()
+        local total = 0
+        while true do
+            local chunk = stdout:read(CHUNK)
+            if chunk == nil or #chunk == 0 then
+                break
+            end
+            total = total + #chunk
+        end
+        assert(p:wait() == 0)
+        assert(total == size, "short read " .. total .. " of " .. size)
+        samples[round] = size / (bench.now() - start) / (1 << 20)
+    end
+    bench.emit("pipe_throughput", { bytes = size, read_chunk = CHUNK, unit = "MiB/s" }, bench.stats(samples))
+    size = size * 4
+end
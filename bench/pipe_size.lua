@@ -0,0 +1,43 @@
+-- stdout throughput against pipe capacity: default, then pipe_size 64 KiB up to 1 MiB; the child writes and
+-- the parent reads 1 MiB at a time so the capacity bounds how much moves per wake-up,
+-- BENCH_PIPE_SIZE_BYTES per round, BENCH_PIPE_SIZE_ROUNDS rounds per capacity
+local proc = require("eli.proc.extra")
+
+local BYTES = tonumber(os.getenv("BENCH_PIPE_SIZE_BYTES") or tostring(256 << 20))
+local ROUNDS = tonumber(os.getenv("BENCH_PIPE_SIZE_ROUNDS") or "10")
+local BLOCK = 1 << 20
+local SIZES = { false, 64 << 10, 256 << 10, 1 << 20 }
+
+for _, pipe_size in ipairs(SIZES) do
+    local stdout_option = pipe_size and { "pipe", pipe_size = pipe_size } or "pipe"
+    local effective
+    local samples = {}
+    for round = 1, ROUNDS do
+        local start = bench.now()
+        local p = assert(proc.spawn("dd", {
+            args = { "if=/dev/zero", "bs=" .. BLOCK, "count=" .. BYTES // BLOCK, "status=none" },
+            stdio = { stdin = "ignore", stdout = stdout_option, stderr = "ignore" },
+        }))
+        effective = p:get_stdio_info().pipe_size.stdout
+        local stdout = p:get_stdout()
+        local total = 0
+        while true do
+            local chunk = stdout:read(BLOCK)
+            if chunk == nil or #chunk == 0 then
+                break
+            end
+            total = total + #chunk
+        end
+        assert(p:wait() == 0)
+        local expected = BYTES // BLOCK * BLOCK
+        assert(total == expected, "short read " .. total .. " of " .. expected)
+        samples[round] = total / (bench.now() - start) / (1 << 20)
+    end
+    assert(not pipe_size or effective == nil or effective >= pipe_size, "pipe_size not applied")
+    bench.emit("pipe_size_throughput", {
+        requested = pipe_size or "default",
+        effective = effective or false,
+        bytes = BYTES,
+        unit = "MiB/s",
+    }, bench.stats(samples))
+end
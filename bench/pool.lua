@@ -0,0 +1,50 @@
+-- jobs/sec of proc.pool running `true` at max = cores, against spawn + exited() polling in Lua
+local proc = require("eli.proc.extra")
+
+local JOBS = tonumber(os.getenv("BENCH_POOL_JOBS") or "5000")
+local MAX = tonumber(os.getenv("BENCH_POOL_MAX") or tostring(bench.cores()))
+local OPTIONS = { stdio = "ignore" }
+
+local function pool_run()
+    local pool = assert(proc.pool({ max = MAX }))
+    local done = 0
+    for _ = 1, JOBS do
+        assert(pool:submit("true", OPTIONS, function()
+            done = done + 1
+        end))
+    end
+    pool:run()
+    assert(done == JOBS)
+end
+
+local function polling_run()
+    local running, submitted, done = {}, 0, 0
+    while done < JOBS do
+        while #running < MAX and submitted < JOBS do
+            running[#running + 1] = assert(proc.spawn("true", OPTIONS))
+            submitted = submitted + 1
+        end
+        for i = #running, 1, -1 do
+            if running[i]:exited() then
+                table.remove(running, i)
+                done = done + 1
+            end
+        end
+    end
+end
+
+for _, case in ipairs({ { "pool", pool_run }, { "lua_polling", polling_run } }) do
+    local start, cpu = bench.now(), os.clock()
+    case[2]()
+    local seconds = bench.now() - start
+    bench.emit("pool_throughput", {
+        runner = case[1],
+        command = "true",
+        max = MAX,
+        jobs = JOBS,
+        seconds = seconds,
+        jobs_per_sec = JOBS / seconds,
+        cpu_seconds = os.clock() - cpu,
+    })
+    collectgarbage()
+end
@@ -0,0 +1,58 @@
+-- proc.list, process:children and snapshot updates with BENCH_SNAPSHOT_PROCS (10 000) extra processes running
+local proc = require("eli.proc.extra")
+
+local PROCS = tonumber(os.getenv("BENCH_SNAPSHOT_PROCS") or "10000")
+local ROUNDS = tonumber(os.getenv("BENCH_SNAPSHOT_ROUNDS") or "50")
+local START_TIMEOUT = 300
+
+local function count()
+    return #assert(proc.list()).pids
+end
+
+local function measure(f)
+    local samples = {}
+    for i = 1, ROUNDS do
+        local start = bench.now()
+        f()
+        samples[i] = (bench.now() - start) * 1e6
+    end
+    return bench.stats(samples)
+end
+
+-- sleepers are children of one shell in its own group, a group kill ends them and we reap them as subreaper
+assert(proc.set_subreaper(true))
+local base = count()
+local shell = assert(proc.spawn("sh", {
+    args = { "-c", "i=0; while [ $i -lt " .. PROCS .. " ]; do sleep 3600 & i=$((i + 1)); done; wait" },
+    stdio = "ignore",
+    create_process_group = true,
+}))
+local deadline = bench.now() + START_TIMEOUT
+while count() < base + PROCS + 1 do
+    assert(bench.now() < deadline, "sleepers did not start in time")
+    shell:wait(100)
+end
+local processes = count()
+
+local meta = { processes = processes, unit = "us" }
+bench.emit("proc_list", meta, { filter = "none" }, measure(function()
+    assert(proc.list())
+end))
+bench.emit("proc_list", meta, { filter = "ppid" }, measure(function()
+    assert(proc.list({ ppid = shell:pid() }))
+end))
+bench.emit("process_children", meta, measure(function()
+    assert(#shell:children().pids == PROCS)
+end))
+local snapshot = assert(proc.snapshot())
+bench.emit("snapshot_update", meta, measure(function()
+    assert(snapshot:update())
+end))
+
+shell:get_group():kill(9)
+shell:wait()
+deadline = bench.now() + START_TIMEOUT
+while count() > base do
+    assert(bench.now() < deadline, "sleepers were not reaped in time")
+    proc.reap_orphans({ all = true })
+end
@@ -0,0 +1,90 @@
+-- spawn/exit latency, spawns/sec under concurrent spawners, wait wake-up latency, fd/memory growth
+-- BENCH_SPAWNS (latency samples), BENCH_MAX_SPAWNERS, BENCH_GROWTH_SPAWNS tune the run length
+local proc = require("eli.proc.extra")
+
+local SPAWNS = tonumber(os.getenv("BENCH_SPAWNS") or "2000")
+local MAX_SPAWNERS = tonumber(os.getenv("BENCH_MAX_SPAWNERS") or "64")
+local GROWTH_SPAWNS = tonumber(os.getenv("BENCH_GROWTH_SPAWNS") or "100000")
+local TRUE = "/bin/true"
+local SLEEP = "/bin/sleep"
+
+local function run_true()
+    local p = assert(proc.spawn(TRUE, { stdio = "ignore" }))
+    assert(p:wait() == 0)
+end
+
+-- spawn to reaped exit of /bin/true
+for _ = 1, 50 do
+    run_true()
+end
+local samples = {}
+for i = 1, SPAWNS do
+    local start = bench.now()
+    run_true()
+    samples[i] = (bench.now() - start) * 1e6
+end
+bench.emit("spawn_exit_latency", { command = TRUE, unit = "us" }, bench.stats(samples))
+
+-- each spawner has its own lua_State on its own thread
+local SPAWNER = [[
+    local index, count = ...
+    local proc = require("eli.proc.extra")
+    for _ = 1, count do
+        local p = assert(proc.spawn("/bin/true", { stdio = "ignore" }))
+        assert(p:wait() == 0)
+    end
+    return count
+]]
+local spawners = 1
+while spawners <= MAX_SPAWNERS do
+    local per_spawner = math.max(SPAWNS // spawners, 20)
+    local _, seconds = bench.parallel(spawners, SPAWNER, per_spawner)
+    bench.emit("spawn_concurrent", {
+        command = TRUE,
+        spawners = spawners,
+        spawns = spawners * per_spawner,
+        seconds = seconds,
+        spawns_per_sec = spawners * per_spawner / seconds,
+    })
+    spawners = spawners * 2
+end
+
+-- wake-up of a blocked wait: time past the child's own sleep, and kill to reaped exit
+local SLEEP_S = 0.02
+local overshoot, after_kill = {}, {}
+for i = 1, math.max(SPAWNS // 20, 20) do
+    local p = assert(proc.spawn(SLEEP, { args = { tostring(SLEEP_S) }, stdio = "ignore" }))
+    local start = bench.now()
+    p:wait()
+    overshoot[i] = (bench.now() - start - SLEEP_S) * 1e6
+
+    p = assert(proc.spawn(SLEEP, { args = { "10" }, stdio = "ignore" }))
+    start = bench.now()
+    assert(p:kill(9))
+    local _, signal = p:wait()
+    after_kill[i] = (bench.now() - start) * 1e6
+    assert(signal == 9)
+end
+bench.emit("wait_wakeup_exit", { command = SLEEP, sleep_s = SLEEP_S, unit = "us" }, bench.stats(overshoot))
+bench.emit("wait_wakeup_kill", { command = SLEEP, unit = "us" }, bench.stats(after_kill))
+
+-- resources left behind by many spawns with process objects collected along the way
+collectgarbage()
+local fds, rss, heap = bench.fd_count(), bench.rss(), collectgarbage("count")
+local start = bench.now()
+for i = 1, GROWTH_SPAWNS do
+    run_true()
+    if i % 1000 == 0 then
+        collectgarbage()
+    end
+end
+local seconds = bench.now() - start
+collectgarbage()
+bench.emit("spawn_growth", {
+    command = TRUE,
+    spawns = GROWTH_SPAWNS,
+    seconds = seconds,
+    fd_growth = bench.fd_count() - fds,
+    rss_growth_bytes = bench.rss() - rss,
+    lua_heap_growth_bytes = math.floor((collectgarbage("count") - heap) * 1024),
+})
@@ -0,0 +1,453 @@
+/*
+** Benchmark runner embedding Lua with eli.proc.extra. Each script runs in a fresh state with a bench table:
+**
+**     bench.now()                      -- monotonic seconds
+**     bench.emit(name, fields...)      -- one JSON line {"bench": name, ...fields} to results
+**     bench.stats(samples)             -- {n, min, mean, p50, p90, p99, max} of numbers
+**     bench.fd_count(), bench.rss()    -- open fds, resident bytes of this process
+**     bench.heap()                     -- bytes in use by the allocator, nil if unknown
+**     bench.cores()                    -- online cpus
+**     bench.setenv(name, value/nil)    -- sets or unsets environment variable of this process (no other
+**                                      -- threads may run)
+**     bench.parallel(n, source, arg)   -- runs chunk source(index, arg) in n threads with own states,
+**                                      -- returns results of chunks and wall seconds
+**
+** usage: eli_proc_extra_bench [-o results.jsonl] script.lua...
+*/
+#include <dirent.h>
+#include <malloc.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "lauxlib.h"
+#include "lproc.h"
+#include "lua.h"
+#include "lualib.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#define BENCH_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define BENCH_ASAN
+#endif
+#endif
+
+#ifdef BENCH_ASAN
+size_t __sanitizer_get_current_allocated_bytes(void);
+#endif
+
+static FILE* results = NULL;
+static pthread_mutex_t resultsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static double
+now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* -- seconds */
+static int
+bench_now(lua_State* L) {
+    lua_pushnumber(L, now_seconds());
+    return 1;
+}
+
+static void
+emit_string(luaL_Buffer* b, const char* s) {
+    luaL_addchar(b, '"');
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            luaL_addchar(b, '\\');
+            luaL_addchar(b, (char)c);
+        } else if (c < 0x20) {
+            char esc[8];
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            luaL_addstring(b, esc);
+        } else {
+            luaL_addchar(b, (char)c);
+        }
+    }
+    luaL_addchar(b, '"');
+}
+
+/* appends value at top of the stack and pops it */
+static void
+emit_value(lua_State* L, luaL_Buffer* b, const char* key) {
+    char num[64];
+    switch (lua_type(L, -1)) {
+        case LUA_TNUMBER:
+            if (lua_isinteger(L, -1)) {
+                snprintf(num, sizeof(num), LUA_INTEGER_FMT, lua_tointeger(L, -1));
+            } else if (isfinite(lua_tonumber(L, -1))) {
+                snprintf(num, sizeof(num), "%.9g", (double)lua_tonumber(L, -1));
+            } else {
+                strcpy(num, "null");
+            }
+            lua_pop(L, 1);
+            luaL_addstring(b, num);
+            break;
+        case LUA_TBOOLEAN:
+            luaL_addstring(b, lua_toboolean(L, -1) ? "true" : "false");
+            lua_pop(L, 1);
+            break;
+        case LUA_TSTRING:;
+            const char* s = lua_tostring(L, -1);
+            emit_string(b, s);
+            lua_pop(L, 1);
+            break;
+        default: luaL_error(L, "bad field %s (number, boolean or string expected, got %s)", key, luaL_typename(L, -1));
+    }
+}
+
+/* name fields... -- ; fields of later tables override earlier ones */
+static int
+bench_emit(lua_State* L) {
+    const char* name = luaL_checkstring(L, 1);
+    int top = lua_gettop(L);
+    lua_newtable(L); // merged
+    int merged = lua_gettop(L);
+    for (int i = 2; i <= top; i++) {
+        luaL_checktype(L, i, LUA_TTABLE);
+        lua_pushnil(L);
+        while (lua_next(L, i) != 0) {
+            if (lua_type(L, -2) != LUA_TSTRING) {
+                return luaL_error(L, "bad fields table %d (string keys expected)", i - 1);
+            }
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, merged);
+        }
+    }
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, "{\"bench\":");
+    lua_pushstring(L, name);
+    emit_value(L, &b, "bench");
+    lua_pushnil(L);
+    while (lua_next(L, merged) != 0) {
+        const char* key = lua_tostring(L, -2);
+        if (strcmp(key, "bench") == 0) {
+            lua_pop(L, 1);
+            continue;
+        }
+        luaL_addchar(&b, ',');
+        emit_string(&b, key);
+        luaL_addchar(&b, ':');
+        emit_value(L, &b, key);
+    }
+    luaL_addstring(&b, "}\n");
+    luaL_pushresult(&b);
+
+    size_t len;
+    const char* line = lua_tolstring(L, -1, &len);
+    pthread_mutex_lock(&resultsLock);
+    fwrite(line, 1, len, results);
+    fflush(results);
+    pthread_mutex_unlock(&resultsLock);
+    return 0;
+}
+
+static int
+compare_numbers(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double
+percentile(const double* sorted, size_t n, double p) {
+    size_t i = (size_t)ceil(p * (double)n);
+    return sorted[i > 0 ? i - 1 : 0];
+}
+
+/* samples -- stats */
+static int
+bench_stats(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    size_t n = (size_t)lua_rawlen(L, 1);
+    luaL_argcheck(L, n > 0, 1, "no samples");
+    double* sorted = lua_newuserdatauv(L, n * sizeof(double), 0);
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        lua_rawgeti(L, 1, (lua_Integer)i + 1);
+        sorted[i] = luaL_checknumber(L, -1);
+        sum += sorted[i];
+        lua_pop(L, 1);
+    }
+    qsort(sorted, n, sizeof(double), compare_numbers);
+    lua_createtable(L, 0, 7);
+    lua_pushinteger(L, (lua_Integer)n);
+    lua_setfield(L, -2, "n");
+    lua_pushnumber(L, sorted[0]);
+    lua_setfield(L, -2, "min");
+    lua_pushnumber(L, sum / (double)n);
+    lua_setfield(L, -2, "mean");
+    lua_pushnumber(L, percentile(sorted, n, 0.5));
+    lua_setfield(L, -2, "p50");
+    lua_pushnumber(L, percentile(sorted, n, 0.9));
+    lua_setfield(L, -2, "p90");
+    lua_pushnumber(L, percentile(sorted, n, 0.99));
+    lua_setfield(L, -2, "p99");
+    lua_pushnumber(L, sorted[n - 1]);
+    lua_setfield(L, -2, "max");
+    return 1;
+}
+
+/* -- count */
+static int
+bench_fd_count(lua_State* L) {
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return luaL_error(L, "cannot open /proc/self/fd");
+    }
+    lua_Integer count = -1; // fd of dir itself
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        count += entry->d_name[0] != '.';
+    }
+    closedir(dir);
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+/* -- bytes */
+static int
+bench_rss(lua_State* L) {
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == NULL || fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+        if (f != NULL) {
+            fclose(f);
+        }
+        return luaL_error(L, "cannot read /proc/self/statm");
+    }
+    fclose(f);
+    lua_pushinteger(L, (lua_Integer)resident * sysconf(_SC_PAGESIZE));
+    return 1;
+}
+
+/* -- bytes/nil; ASan allocator when sanitized, all glibc arenas otherwise */
+static int
+bench_heap(lua_State* L) {
+#if defined(BENCH_ASAN)
+    lua_pushinteger(L, (lua_Integer)__sanitizer_get_current_allocated_bytes());
+#elif defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+    lua_pushinteger(L, (lua_Integer)(info.uordblks + info.hblkhd));
+#else
+    lua_pushnil(L);
+#endif
+    return 1;
+}
+
+/* -- count */
+static int
+bench_cores(lua_State* L) {
+    lua_pushinteger(L, sysconf(_SC_NPROCESSORS_ONLN));
+    return 1;
+}
+
+/* name value/nil -- */
+static int
+bench_setenv(lua_State* L) {
+    const char* name = luaL_checkstring(L, 1);
+    const char* value = luaL_optstring(L, 2, NULL);
+    if ((value == NULL ? unsetenv(name) : setenv(name, value, 1)) == -1) {
+        return luaL_error(L, "cannot set %s", name);
+    }
+    return 0;
+}
+
+static lua_State* bench_state_new(void);
+
+/* workers set up their states, then wait for all others so the clock measures only the chunks */
+typedef struct bench_gate {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int ready;
+    int go; // 1 - run, -1 - some thread could not be started, skip
+} bench_gate;
+
+typedef struct bench_worker {
+    pthread_t thread;
+    bench_gate* gate;
+    const char* source;
+    size_t source_len;
+    int index;
+    int arg_type; // LUA_TNIL, LUA_TNUMBER, LUA_TSTRING or LUA_TBOOLEAN
+    lua_Number arg_number;
+    const char* arg_string;
+    lua_Number result;
+    char error[256];
+} bench_worker;
+
+static void*
+bench_worker_run(void* data) {
+    bench_worker* w = data;
+    lua_State* L = bench_state_new();
+    int ok = L != NULL && luaL_loadbuffer(L, w->source, w->source_len, "=parallel") == LUA_OK;
+    if (ok) {
+        lua_pushinteger(L, w->index);
+        switch (w->arg_type) {
+            case LUA_TNUMBER: lua_pushnumber(L, w->arg_number); break;
+            case LUA_TSTRING: lua_pushstring(L, w->arg_string); break;
+            case LUA_TBOOLEAN: lua_pushboolean(L, w->arg_number != 0); break;
+            default: lua_pushnil(L); break;
+        }
+    }
+    pthread_mutex_lock(&w->gate->lock);
+    w->gate->ready++;
+    pthread_cond_broadcast(&w->gate->cond);
+    while (w->gate->go == 0) {
+        pthread_cond_wait(&w->gate->cond, &w->gate->lock);
+    }
+    int go = w->gate->go;
+    pthread_mutex_unlock(&w->gate->lock);
+    if (go == -1) {
+        snprintf(w->error, sizeof(w->error), "not all threads started");
+    } else if (ok && lua_pcall(L, 2, 1, 0) == LUA_OK) {
+        w->result = lua_tonumber(L, -1);
+    } else {
+        snprintf(w->error, sizeof(w->error), "%s", L == NULL ? "cannot create state" : lua_tostring(L, -1));
+    }
+    if (L != NULL) {
+        lua_close(L);
+    }
+    return NULL;
+}
+
+/* n source [arg] -- {result...} seconds */
+static int
+bench_parallel(lua_State* L) {
+    lua_Integer n = luaL_checkinteger(L, 1);
+    luaL_argcheck(L, n > 0 && n <= 1024, 1, "thread count out of range");
+    size_t len;
+    const char* source = luaL_checklstring(L, 2, &len);
+    int arg_type = lua_type(L, 3);
+    if (arg_type != LUA_TNONE && arg_type != LUA_TNIL && arg_type != LUA_TNUMBER && arg_type != LUA_TSTRING
+        && arg_type != LUA_TBOOLEAN) {
+        return luaL_typeerror(L, 3, "number, string or boolean");
+    }
+
+    bench_worker* workers = lua_newuserdatauv(L, (size_t)n * sizeof(bench_worker), 0);
+    bench_gate gate = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0};
+    lua_Integer started = 0;
+    for (; started < n; started++) {
+        bench_worker* w = &workers[started];
+        memset(w, 0, sizeof(*w));
+        w->gate = &gate;
+        w->source = source;
+        w->source_len = len;
+        w->index = (int)started + 1;
+        w->arg_type = arg_type;
+        w->arg_number = arg_type == LUA_TBOOLEAN ? lua_toboolean(L, 3) : lua_tonumber(L, 3);
+        w->arg_string = arg_type == LUA_TSTRING ? lua_tostring(L, 3) : NULL;
+        if (pthread_create(&w->thread, NULL, bench_worker_run, w) != 0) {
+            break;
+        }
+    }
+    pthread_mutex_lock(&gate.lock);
+    while (gate.ready < started) {
+        pthread_cond_wait(&gate.cond, &gate.lock);
+    }
+    gate.go = started < n ? -1 : 1;
+    pthread_cond_broadcast(&gate.cond);
+    pthread_mutex_unlock(&gate.lock);
+    double begin = now_seconds();
+    for (lua_Integer i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = now_seconds() - begin;
+    if (started < n) {
+        return luaL_error(L, "cannot start %d threads", (int)n);
+    }
+
+    for (lua_Integer i = 0; i < n; i++) {
+        if (workers[i].error[0] != '\0') {
+            return luaL_error(L, "parallel worker %d: %s", (int)i + 1, workers[i].error);
+        }
+    }
+    lua_createtable(L, (int)n, 0);
+    for (lua_Integer i = 0; i < n; i++) {
+        lua_pushnumber(L, workers[i].result);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_pushnumber(L, elapsed);
+    return 2;
+}
+
+static const struct luaL_Reg benchFunctions[] = {
+    {"now", bench_now},
+    {"emit", bench_emit},
+    {"stats", bench_stats},
+    {"fd_count", bench_fd_count},
+    {"rss", bench_rss},
+    {"heap", bench_heap},
+    {"cores", bench_cores},
+    {"setenv", bench_setenv},
+    {"parallel", bench_parallel},
+    {NULL, NULL},
+};
+
+static void
+preload(lua_State* L, const char* name, lua_CFunction open) {
+    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+    lua_pushcfunction(L, open);
+    lua_setfield(L, -2, name);
+    lua_pop(L, 1);
+}
+
+static lua_State*
+bench_state_new(void) {
+    lua_State* L = luaL_newstate();
+    if (L == NULL) {
+        return NULL;
+    }
+    luaL_openlibs(L);
+    preload(L, "eli.proc.extra", luaopen_eli_proc_extra);
+    luaL_newlib(L, benchFunctions);
+    lua_setglobal(L, "bench");
+    return L;
+}
+
+int
+main(int argc, char* argv[]) {
+    results = stdout;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+        results = fopen(argv[2], "w");
+        if (results == NULL) {
+            perror(argv[2]);
+            return 1;
+        }
+        first = 3;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "usage: %s [-o results.jsonl] script.lua...\n", argv[0]);
+        return 1;
+    }
+
+    int failed = 0;
+    for (int i = first; i < argc; i++) {
+        lua_State* L = bench_state_new();
+        if (L == NULL) {
+            fprintf(stderr, "cannot create Lua state\n");
+            return 1;
+        }
+        if (luaL_dofile(L, argv[i]) != LUA_OK) {
+            fprintf(stderr, "%s: %s\n", argv[i], lua_tostring(L, -1));
+            failed = 1;
+        }
+        lua_close(L);
+    }
+    if (results != stdout) {
+        fclose(results);
+    }
+    return failed;
+}
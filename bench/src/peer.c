@@ -0,0 +1,82 @@
+/*
+** Child side of bench/channel.lua. Consumes count messages sent over proc.channel (attached as fds 3, 4, 5)
+** or count bytes written to stdin, then prints number of messages and bytes it received.
+**
+** usage: eli_proc_extra_bench_peer channel|pipe count
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "proc_channel.h"
+
+static int
+consume_channel(unsigned long long count) {
+    proc_channel ch;
+    if (proc_channel_attach(&ch, 3, 4, 5, PROC_CHANNEL_CHILD) == -1) {
+        perror("attach");
+        return 1;
+    }
+    char* buf = malloc(proc_channel_max_message(&ch));
+    if (buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    unsigned long long messages = 0, bytes = 0;
+    while (messages < count) {
+        int64_t len = proc_channel_next_size(&ch);
+        if (len == PROC_CHANNEL_CORRUPT) {
+            fprintf(stderr, "channel corrupted\n");
+            return 1;
+        }
+        if (len == -1) {
+            proc_channel_release(&ch);
+            if (proc_channel_wait(&ch, 0, 0, -1) != 1) {
+                break;
+            }
+            continue;
+        }
+        proc_channel_read(&ch, buf, (uint32_t)len);
+        messages++;
+        bytes += (unsigned long long)len;
+    }
+    proc_channel_release(&ch);
+    printf("%llu %llu\n", messages, bytes);
+    fflush(stdout);
+    proc_channel_close(&ch);
+    free(buf);
+    return messages == count ? 0 : 1;
+}
+
+static int
+consume_pipe(unsigned long long count) {
+    static char buf[1 << 16];
+    unsigned long long bytes = 0;
+    while (bytes < count) {
+        ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        bytes += (unsigned long long)n;
+    }
+    printf("0 %llu\n", bytes);
+    fflush(stdout);
+    return bytes == count ? 0 : 1;
+}
+
+int
+main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s channel|pipe count\n", argv[0]);
+        return 2;
+    }
+    unsigned long long count = strtoull(argv[2], NULL, 10);
+    if (strcmp(argv[1], "channel") == 0) {
+        return consume_channel(count);
+    }
+    if (strcmp(argv[1], "pipe") == 0) {
+        return consume_pipe(count);
+    }
+    fprintf(stderr, "unknown mode %s\n", argv[1]);
+    return 2;
+}
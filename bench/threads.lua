@@ -0,0 +1,79 @@
+-- spawn scaling with one lua_State per thread over the paths shared by concurrent spawns: PATH search,
+-- username lookup, env overlay and pipes; children list their open fds to catch descriptors leaked from
+-- spawns running in other threads; forking directly, then through the spawn server (one per core by default)
+local proc = require("eli.proc.extra")
+
+local SPAWNS = tonumber(os.getenv("BENCH_THREADS_SPAWNS") or "2000")
+local MAX_THREADS = tonumber(os.getenv("BENCH_THREADS_MAX") or tostring(math.max(bench.cores() * 2, 16)))
+
+-- spawning as the current user exercises the lookup without needing privileges
+local id = assert(proc.spawn("id", { args = { "-un" }, stdio = { stdin = "ignore", stdout = "pipe", stderr = "ignore" } }))
+local username = id:get_stdout():read("a"):match("^%S+")
+assert(id:wait() == 0 and username, "cannot resolve current username")
+
+-- each child prints its fd directory; anything beyond what a child spawned before the threads start sees
+-- (0, 1, 2, the directory fd of ls and fds inherited by the runner itself, e.g. a make jobserver) is a leak
+local function child_fds()
+    local baseline = assert(proc.spawn("ls", {
+        args = { "/proc/self/fd" },
+        stdio = { stdin = "ignore", stdout = "pipe", stderr = "ignore" },
+    }))
+    local _, count = baseline:get_stdout():read("a"):gsub("%d+", "")
+    assert(baseline:wait() == 0, "cannot list child fds")
+    return count
+end
+
+local WORKER = [[
+    local index, arg = ...
+    local count, expected, username = arg:match("^(%d+) (%d+) (.+)$")
+    local proc = require("eli.proc.extra")
+    local options = {
+        args = { "/proc/self/fd" },
+        username = username,
+        env_add = { BENCH_THREAD = tostring(index) },
+        stdio = { stdin = "ignore", stdout = "pipe", stderr = "ignore" },
+    }
+    local leaked = 0
+    for _ = 1, tonumber(count) do
+        local p = assert(proc.spawn("ls", options))
+        local listing = p:get_stdout():read("a")
+        assert(p:wait() == 0)
+        local fds = 0
+        for _ in listing:gmatch("%d+") do
+            fds = fds + 1
+        end
+        if fds ~= tonumber(expected) then
+            leaked = leaked + 1
+        end
+    end
+    return leaked
+]]
+
+for _, mode in ipairs({ "fork", "spawn_server" }) do
+    if mode == "spawn_server" then
+        assert(proc.start_spawn_server())
+    end
+    local expected_fds = child_fds() -- children of the server do not inherit fds of the runner
+    local threads = 1
+    while threads <= MAX_THREADS do
+        local per_thread = math.max(SPAWNS // threads, 20)
+        local leaked, seconds = bench.parallel(threads, WORKER, per_thread .. " " .. expected_fds .. " " .. username)
+        local leaks = 0
+        for _, n in ipairs(leaked) do
+            leaks = leaks + n
+        end
+        bench.emit("spawn_threads", {
+            command = "ls /proc/self/fd",
+            mode = mode,
+            threads = threads,
+            cores = bench.cores(),
+            spawns = threads * per_thread,
+            seconds = seconds,
+            spawns_per_sec = threads * per_thread / seconds,
+            children_with_extra_fds = leaks,
+        })
+        assert(leaks == 0, leaks .. " children inherited extra fds")
+        threads = threads * 2
+    end
+end
+assert(proc.stop_spawn_server())
@@ -0,0 +1,172 @@
+#ifndef _WIN32
+#include "env_snapshot.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "environ.h"
+#include "spawn_stats.h"
+
+typedef struct env_entry {
+    const char* entry;
+    size_t name_len;
+    size_t order; // position in environ, first of duplicate names is what getenv sees
+} env_entry;
+
+struct env_snapshot {
+    int refs; // guarded by envLock, the current snapshot holds one
+    size_t source_count;
+    char** source; // environ entries snapshot was built from, to detect changes
+    size_t count;
+    env_entry* sorted; // by name, points to copied strings
+};
+
+static pthread_mutex_t envLock = PTHREAD_MUTEX_INITIALIZER;
+static env_snapshot* currentEnv = NULL;
+
+static int
+compare_names(const char* a, size_t alen, const char* b, size_t blen) {
+    int res = memcmp(a, b, alen < blen ? alen : blen);
+    return res != 0 ? res : (alen > blen) - (alen < blen);
+}
+
+static int
+compare_entries(const void* a, const void* b) {
+    const env_entry* x = a;
+    const env_entry* y = b;
+    int res = compare_names(x->entry, x->name_len, y->entry, y->name_len);
+    return res != 0 ? res : (x->order > y->order) - (x->order < y->order);
+}
+
+static int
+compare_overrides(const void* a, const void* b) {
+    const env_override* x = a;
+    const env_override* y = b;
+    int res = compare_names(x->name, x->name_len, y->name, y->name_len);
+    return res != 0 ? res : (x->order > y->order) - (x->order < y->order);
+}
+
+/* expects envLock held */
+static int
+env_changed(const env_snapshot* s) {
+    size_t n = 0;
+    while (environ[n] != NULL) {
+        n++;
+    }
+    return n != s->source_count || memcmp(environ, s->source, n * sizeof(char*)) != 0;
+}
+
+/* expects envLock held; single block holding snapshot, source pointers, sorted entries and strings */
+static env_snapshot*
+env_build(void) {
+    size_t n = 0, size = 0;
+    for (; environ[n] != NULL; n++) {
+        size += strlen(environ[n]) + 1;
+    }
+    env_snapshot* s = spawn_malloc(sizeof(env_snapshot) + n * (sizeof(char*) + sizeof(env_entry)) + size);
+    if (s == NULL) {
+        return NULL;
+    }
+    s->refs = 1;
+    s->source_count = n;
+    s->source = (char**)(s + 1);
+    s->sorted = (env_entry*)(s->source + n);
+    char* strings = (char*)(s->sorted + n);
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t len = strlen(environ[i]) + 1;
+        const char* eq = strchr(environ[i], '=');
+        s->source[i] = environ[i];
+        memcpy(strings, environ[i], len);
+        if (eq != NULL) {
+            s->sorted[count].entry = strings;
+            s->sorted[count].name_len = (size_t)(eq - environ[i]);
+            s->sorted[count].order = i;
+            count++;
+        }
+        strings += len;
+    }
+    qsort(s->sorted, count, sizeof(env_entry), compare_entries);
+    s->count = 0;
+    for (size_t i = 0; i < count; i++) {
+        env_entry* last = s->count > 0 ? &s->sorted[s->count - 1] : NULL;
+        if (last == NULL || compare_names(last->entry, last->name_len, s->sorted[i].entry, s->sorted[i].name_len) != 0) {
+            s->sorted[s->count++] = s->sorted[i];
+        }
+    }
+    return s;
+}
+
+/* expects envLock held */
+static void
+env_unref(env_snapshot* s) {
+    if (--s->refs == 0) {
+        free(s);
+    }
+}
+
+/* current environment snapshot, NULL if it cannot be built (ENOMEM); release when done */
+env_snapshot*
+env_snapshot_acquire(void) {
+    pthread_mutex_lock(&envLock);
+    if (currentEnv == NULL || env_changed(currentEnv)) {
+        env_snapshot* s = env_build();
+        if (s == NULL) {
+            pthread_mutex_unlock(&envLock);
+            return NULL;
+        }
+        if (currentEnv != NULL) {
+            env_unref(currentEnv);
+        }
+        currentEnv = s;
+    }
+    env_snapshot* s = currentEnv;
+    s->refs++;
+    pthread_mutex_unlock(&envLock);
+    return s;
+}
+
+void
+env_snapshot_release(env_snapshot* snapshot) {
+    if (snapshot == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&envLock);
+    env_unref(snapshot);
+    pthread_mutex_unlock(&envLock);
+}
+
+size_t
+env_snapshot_count(const env_snapshot* snapshot) {
+    return snapshot->count;
+}
+
+size_t
+env_snapshot_merge(const env_snapshot* snapshot, env_override* overrides, size_t override_count, const char** out) {
+    qsort(overrides, override_count, sizeof(env_override), compare_overrides);
+    size_t i = 0, j = 0, n = 0;
+    while (i < snapshot->count || j < override_count) {
+        if (j < override_count && j + 1 < override_count
+            && compare_names(overrides[j].name, overrides[j].name_len, overrides[j + 1].name, overrides[j + 1].name_len)
+                   == 0) {
+            j++; // superseded by later override of the same name
+            continue;
+        }
+        int cmp = i == snapshot->count ? 1
+                : j == override_count
+                    ? -1
+                    : compare_names(snapshot->sorted[i].entry, snapshot->sorted[i].name_len, overrides[j].name,
+                                    overrides[j].name_len);
+        if (cmp < 0) {
+            out[n++] = snapshot->sorted[i++].entry;
+            continue;
+        }
+        if (overrides[j].entry != NULL) {
+            out[n++] = overrides[j].entry;
+        }
+        i += cmp == 0;
+        j++;
+    }
+    out[n] = NULL;
+    return n;
+}
+#endif
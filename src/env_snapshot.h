@@ -0,0 +1,29 @@
+#ifndef ELI_ENV_SNAPSHOT_H_
+#define ELI_ENV_SNAPSHOT_H_
+#ifndef _WIN32
+#include <stddef.h>
+
+/*
+** Sorted copy of the process environment shared by spawns which inherit it with a few changes.
+** Snapshot is rebuilt only when environ changes (set/unset variables), strings are copied so concurrent
+** setenv does not pull them from under a running spawn.
+*/
+typedef struct env_snapshot env_snapshot;
+
+typedef struct env_override {
+    const char* name;
+    size_t name_len;
+    const char* entry; // "NAME=value", NULL - remove variable
+    size_t order;      // later override of the same name wins
+} env_override;
+
+env_snapshot* env_snapshot_acquire(void);
+void env_snapshot_release(env_snapshot* snapshot);
+size_t env_snapshot_count(const env_snapshot* snapshot);
+
+/* sorts overrides, writes NULL terminated merged environment to out (count + override_count + 1 entries) */
+size_t env_snapshot_merge(const env_snapshot* snapshot, env_override* overrides, size_t override_count,
+                          const char** out);
+
+#endif
+#endif
@@ -0,0 +1,618 @@
+#ifndef _WIN32
+#include "event_engine.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/epoll.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_SINGLE_MMAP // 5.4 headers (io_uring_params.features), later additions are defined below
+#define EVENT_ENGINE_HAS_IO_URING
+#endif
+#endif
+#endif
+#else
+#include <poll.h>
+#endif
+
+#ifdef EVENT_ENGINE_HAS_IO_URING
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup 425
+#endif
+#ifndef SYS_io_uring_enter
+#define SYS_io_uring_enter 426
+#endif
+
+/* uapi values missing from 5.4/5.5 headers, opcodes are enum constants there and cannot be tested for */
+#ifndef IORING_FEAT_NODROP
+#define IORING_FEAT_NODROP (1U << 1)
+#endif
+#ifndef IORING_SETUP_CLAMP
+#define IORING_SETUP_CLAMP (1U << 4)
+#endif
+#define URING_OP_POLL_ADD       6
+#define URING_OP_POLL_REMOVE    7
+#define URING_OP_TIMEOUT        11
+#define URING_OP_TIMEOUT_REMOVE 12
+
+#define URING_ENTRIES      256
+#define URING_CONTROL      (1ULL << 63) // user_data of timeout/remove requests
+#define URING_REMOVE       (URING_CONTROL | (1ULL << 62))
+#define URING_SLOT_MASK    0xffffffffULL
+#define URING_GEN_MASK     0x3fffffffU
+
+/*
+** io_uring backend keeps a oneshot POLL_ADD armed for every registered fd. Fired polls are re-armed
+** on the next wait, so re-arming, waiting and the timeout go to the kernel in a single io_uring_enter
+** and readiness stays level triggered like with epoll.
+*/
+typedef struct uring_slot {
+    int fd;
+    uint32_t events;
+    uint64_t token;
+    uint32_t gen; // distinguishes completions of removed registrations
+    int used, armed;
+} uring_slot;
+
+typedef struct event_uring {
+    int fd;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    _Atomic unsigned *sq_head, *sq_tail, *cq_head, *cq_tail;
+    unsigned *sq_array, sq_mask, sq_entries, cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned to_submit;
+    uring_slot* slots;
+    int slot_count, slot_capacity;
+    uint64_t timeout_count;
+    uint64_t timeout_data; // user_data of timeout of running wait, 0 - none
+    struct {
+        int64_t tv_sec; // struct __kernel_timespec, <linux/time_types.h> is 5.6+ only
+        long long tv_nsec;
+    } ts;
+} event_uring;
+#endif
+
+struct event_engine {
+#ifdef __linux__
+    int epfd; // -1 with io_uring backend
+#ifdef EVENT_ENGINE_HAS_IO_URING
+    event_uring* uring;
+#endif
+#else
+    struct pollfd* fds;
+    uint64_t* tokens;
+    int count;
+    int capacity;
+#endif
+};
+
+static int defaultBackend = EVENT_ENGINE_AUTO;
+#ifdef EVENT_ENGINE_HAS_IO_URING
+static int uringSupport = 0; // probed once: 0 - unknown, 1 - usable, -1 - not (kernel, seccomp), atomic
+#endif
+
+#ifdef EVENT_ENGINE_HAS_IO_URING
+static void
+uring_free(event_uring* u) {
+    if (u->sqes != NULL) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if (u->cq_ring != NULL && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sq_ring != NULL) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if (u->fd != -1) {
+        close(u->fd);
+    }
+    free(u->slots);
+    free(u);
+}
+
+static event_uring*
+uring_new(void) {
+    event_uring* u = calloc(1, sizeof(event_uring));
+    if (u == NULL) {
+        return NULL;
+    }
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP;
+    u->fd = (int)syscall(SYS_io_uring_setup, URING_ENTRIES, &params);
+    if (u->fd == -1) {
+        free(u);
+        return NULL;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS; // pre 5.5 kernels, epoll serves them just as well
+        goto fail;
+    }
+    u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (u->cq_ring_size > u->sq_ring_size) {
+        u->sq_ring_size = u->cq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+                      IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto fail;
+    }
+    u->cq_ring = u->sq_ring;
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+    char* sq = u->sq_ring;
+    u->sq_head = (_Atomic unsigned*)(sq + params.sq_off.head);
+    u->sq_tail = (_Atomic unsigned*)(sq + params.sq_off.tail);
+    u->sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    u->sq_entries = *(unsigned*)(sq + params.sq_off.ring_entries);
+    u->sq_array = (unsigned*)(sq + params.sq_off.array);
+    char* cq = u->cq_ring;
+    u->cq_head = (_Atomic unsigned*)(cq + params.cq_off.head);
+    u->cq_tail = (_Atomic unsigned*)(cq + params.cq_off.tail);
+    u->cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return u;
+fail:
+    uring_free(u);
+    return NULL;
+}
+
+/* creates ring unless an earlier attempt found io_uring unusable, caches the outcome */
+static event_uring*
+uring_try_new(void) {
+    if (__atomic_load_n(&uringSupport, __ATOMIC_RELAXED) < 0) {
+        errno = ENOSYS;
+        return NULL;
+    }
+    event_uring* u = uring_new();
+    if (u != NULL) {
+        __atomic_store_n(&uringSupport, 1, __ATOMIC_RELAXED);
+    } else if (errno == ENOSYS || errno == EPERM || errno == EINVAL || errno == EOPNOTSUPP) {
+        __atomic_store_n(&uringSupport, -1, __ATOMIC_RELAXED); // others (EMFILE, ENOMEM) may pass later
+    }
+    return u;
+}
+
+static int
+uring_enter(event_uring* u, unsigned min_complete) {
+    int res = (int)syscall(SYS_io_uring_enter, u->fd, u->to_submit, min_complete,
+                           min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (res >= 0) {
+        u->to_submit -= (unsigned)res < u->to_submit ? (unsigned)res : u->to_submit;
+    }
+    return res;
+}
+
+/* next free sqe, submits queued ones when queue is full */
+static struct io_uring_sqe*
+uring_get_sqe(event_uring* u) {
+    unsigned tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(u->sq_head, memory_order_acquire) >= u->sq_entries) {
+        if (uring_enter(u, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe* sqe = &u->sqes[tail & u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+    return sqe;
+}
+
+static void
+uring_queue_sqe(event_uring* u) {
+    unsigned tail = atomic_load_explicit(u->sq_tail, memory_order_relaxed);
+    atomic_store_explicit(u->sq_tail, tail + 1, memory_order_release);
+    u->to_submit++;
+}
+
+static uint64_t
+uring_slot_data(event_uring* u, int idx) {
+    return ((uint64_t)(u->slots[idx].gen & URING_GEN_MASK) << 32) | (uint64_t)idx;
+}
+
+static int
+uring_add(event_uring* u, int fd, uint32_t events, uint64_t token) {
+    if (fcntl(fd, F_GETFD) == -1) { // fail early like epoll_ctl, poll would only report POLLNVAL later
+        return -1;
+    }
+    int idx = -1;
+    for (int i = 0; i < u->slot_count; i++) {
+        if (!u->slots[i].used && idx == -1) {
+            idx = i;
+        } else if (u->slots[i].used && u->slots[i].fd == fd) {
+            errno = EEXIST;
+            return -1;
+        }
+    }
+    if (idx == -1) {
+        if (u->slot_count == u->slot_capacity) {
+            int capacity = u->slot_capacity == 0 ? 16 : u->slot_capacity * 2;
+            uring_slot* slots = realloc(u->slots, capacity * sizeof(uring_slot));
+            if (slots == NULL) {
+                return -1;
+            }
+            u->slots = slots;
+            u->slot_capacity = capacity;
+        }
+        idx = u->slot_count++;
+        u->slots[idx].gen = 0;
+    }
+    uring_slot* slot = &u->slots[idx];
+    slot->fd = fd;
+    slot->events = events;
+    slot->token = token;
+    slot->used = 1;
+    slot->armed = 0; // armed by next wait
+    return 0;
+}
+
+static int
+uring_remove(event_uring* u, int fd) {
+    for (int i = 0; i < u->slot_count; i++) {
+        uring_slot* slot = &u->slots[i];
+        if (!slot->used || slot->fd != fd) {
+            continue;
+        }
+        if (slot->armed) { // pending poll holds reference to the file, cancel it right away
+            struct io_uring_sqe* sqe = uring_get_sqe(u);
+            if (sqe == NULL) {
+                return -1;
+            }
+            sqe->opcode = URING_OP_POLL_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = uring_slot_data(u, i);
+            sqe->user_data = URING_REMOVE;
+            uring_queue_sqe(u);
+            uring_enter(u, 0);
+        }
+        slot->used = 0;
+        slot->armed = 0;
+        slot->gen++;
+        return 0;
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+/* collects completions, sets *timed_out when timeout of this wait fired */
+static int
+uring_reap(event_uring* u, event_engine_event* events, int max, int* timed_out) {
+    unsigned head = atomic_load_explicit(u->cq_head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(u->cq_tail, memory_order_acquire);
+    int n = 0;
+    for (; head != tail && n < max; head++) {
+        struct io_uring_cqe* cqe = &u->cqes[head & u->cq_mask];
+        uint64_t data = cqe->user_data;
+        if (data & URING_CONTROL) {
+            if (data == u->timeout_data) {
+                *timed_out = 1;
+            }
+            continue;
+        }
+        int idx = (int)(data & URING_SLOT_MASK);
+        if (idx >= u->slot_count || !u->slots[idx].used || uring_slot_data(u, idx) != data) {
+            continue; // completion of removed registration
+        }
+        u->slots[idx].armed = 0;
+        if (cqe->res == -ECANCELED) {
+            continue;
+        }
+        events[n].token = u->slots[idx].token;
+        events[n].events = cqe->res < 0 ? EVENT_ENGINE_ERROR
+                                        : (cqe->res & (POLLIN | POLLHUP) ? EVENT_ENGINE_READ : 0)
+                                              | (cqe->res & POLLOUT ? EVENT_ENGINE_WRITE : 0)
+                                              | (cqe->res & (POLLERR | POLLNVAL) ? EVENT_ENGINE_ERROR : 0);
+        n++;
+    }
+    atomic_store_explicit(u->cq_head, head, memory_order_release);
+    return n;
+}
+
+static int
+uring_wait(event_uring* u, event_engine_event* events, int max, int timeout_ms) {
+    for (int i = 0; i < u->slot_count; i++) {
+        uring_slot* slot = &u->slots[i];
+        if (!slot->used || slot->armed) {
+            continue;
+        }
+        struct io_uring_sqe* sqe = uring_get_sqe(u);
+        if (sqe == NULL) {
+            return -1;
+        }
+        sqe->opcode = URING_OP_POLL_ADD;
+        sqe->fd = slot->fd;
+        // 16 bits are enough for POLLIN/POLLOUT; kernels reading poll32_events see them in the right half on big
+        // endian too, as they swap half-words of it there
+        sqe->poll_events = (slot->events & EVENT_ENGINE_READ ? POLLIN : 0)
+                         | (slot->events & EVENT_ENGINE_WRITE ? POLLOUT : 0);
+        sqe->user_data = uring_slot_data(u, i);
+        uring_queue_sqe(u);
+        slot->armed = 1;
+    }
+    u->timeout_data = 0;
+    if (timeout_ms > 0) {
+        struct io_uring_sqe* sqe = uring_get_sqe(u);
+        if (sqe == NULL) {
+            return -1;
+        }
+        u->ts.tv_sec = timeout_ms / 1000;
+        u->ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        u->timeout_data = URING_CONTROL | (++u->timeout_count & ~URING_REMOVE);
+        sqe->opcode = URING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t)(uintptr_t)&u->ts;
+        sqe->len = 1;
+        sqe->user_data = u->timeout_data;
+        uring_queue_sqe(u);
+    }
+    int timed_out = 0, n = 0;
+    for (;;) {
+        if (uring_enter(u, timeout_ms == 0 ? 0 : 1) == -1) {
+            if (errno == EINTR) {
+                break;
+            }
+            if (errno != EAGAIN && errno != EBUSY) {
+                n = -1;
+                break;
+            }
+        }
+        n = uring_reap(u, events, max, &timed_out);
+        if (n > 0 || timed_out || timeout_ms == 0) {
+            break;
+        }
+    }
+    if (u->timeout_data != 0 && !timed_out) { // late completion would be ignored, removal just frees it early
+        struct io_uring_sqe* sqe = uring_get_sqe(u);
+        if (sqe != NULL) {
+            sqe->opcode = URING_OP_TIMEOUT_REMOVE;
+            sqe->fd = -1;
+            sqe->addr = u->timeout_data;
+            sqe->user_data = URING_REMOVE;
+            uring_queue_sqe(u); // submitted with the next call
+        }
+    }
+    u->timeout_data = 0;
+    return n;
+}
+#endif
+
+event_engine*
+event_engine_new(void) {
+    event_engine* engine = calloc(1, sizeof(event_engine));
+    if (engine == NULL) {
+        return NULL;
+    }
+#ifdef __linux__
+    engine->epfd = -1;
+#ifdef EVENT_ENGINE_HAS_IO_URING
+    if (defaultBackend != EVENT_ENGINE_EPOLL) {
+        engine->uring = uring_try_new();
+        if (engine->uring != NULL) {
+            return engine;
+        }
+        if (defaultBackend == EVENT_ENGINE_IO_URING) {
+            free(engine);
+            return NULL;
+        }
+    }
+#endif
+    engine->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (engine->epfd == -1) {
+        free(engine);
+        return NULL;
+    }
+#endif
+    return engine;
+}
+
+void
+event_engine_free(event_engine* engine) {
+    if (engine == NULL) {
+        return;
+    }
+#ifdef __linux__
+#ifdef EVENT_ENGINE_HAS_IO_URING
+    if (engine->uring != NULL) {
+        uring_free(engine->uring);
+    }
+#endif
+    if (engine->epfd != -1) {
+        close(engine->epfd);
+    }
+#else
+    free(engine->fds);
+    free(engine->tokens);
+#endif
+    free(engine);
+}
+
+int
+event_engine_add(event_engine* engine, int fd, uint32_t events, uint64_t token) {
+#ifdef __linux__
+#ifdef EVENT_ENGINE_HAS_IO_URING
+    if (engine->uring != NULL) {
+        return uring_add(engine->uring, fd, events, token);
+    }
+#endif
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (events & EVENT_ENGINE_READ ? EPOLLIN : 0) | (events & EVENT_ENGINE_WRITE ? EPOLLOUT : 0);
+    ev.data.u64 = token;
+    return epoll_ctl(engine->epfd, EPOLL_CTL_ADD, fd, &ev);
+#else
+    if (engine->count == engine->capacity) {
+        int capacity = engine->capacity == 0 ? 16 : engine->capacity * 2;
+        struct pollfd* fds = realloc(engine->fds, capacity * sizeof(struct pollfd));
+        if (fds == NULL) {
+            return -1;
+        }
+        engine->fds = fds;
+        uint64_t* tokens = realloc(engine->tokens, capacity * sizeof(uint64_t));
+        if (tokens == NULL) {
+            return -1;
+        }
+        engine->tokens = tokens;
+        engine->capacity = capacity;
+    }
+    engine->fds[engine->count].fd = fd;
+    engine->fds[engine->count].events = (events & EVENT_ENGINE_READ ? POLLIN : 0)
+                                      | (events & EVENT_ENGINE_WRITE ? POLLOUT : 0);
+    engine->fds[engine->count].revents = 0;
+    engine->tokens[engine->count] = token;
+    engine->count++;
+    return 0;
+#endif
+}
+
+int
+event_engine_remove(event_engine* engine, int fd) {
+#ifdef __linux__
+#ifdef EVENT_ENGINE_HAS_IO_URING
+    if (engine->uring != NULL) {
+        return uring_remove(engine->uring, fd);
+    }
+#endif
+    return epoll_ctl(engine->epfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    for (int i = 0; i < engine->count; i++) {
+        if (engine->fds[i].fd == fd) {
+            engine->count--;
+            engine->fds[i] = engine->fds[engine->count];
+            engine->tokens[i] = engine->tokens[engine->count];
+            return 0;
+        }
+    }
+    errno = ENOENT;
+    return -1;
+#endif
+}
+
+/* returns number of events, 0 on timeout and -1 on error; EINTR is reported as timeout */
+int
+event_engine_wait(event_engine* engine, event_engine_event* events, int max, int timeout_ms) {
+#ifdef __linux__
+#ifdef EVENT_ENGINE_HAS_IO_URING
+    if (engine->uring != NULL) {
+        return uring_wait(engine->uring, events, max, timeout_ms);
+    }
+#endif
+    struct epoll_event ready[64];
+    if (max > 64) {
+        max = 64;
+    }
+    int n = epoll_wait(engine->epfd, ready, max, timeout_ms);
+    if (n == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++) {
+        events[i].token = ready[i].data.u64;
+        events[i].events = (ready[i].events & (EPOLLIN | EPOLLHUP) ? EVENT_ENGINE_READ : 0)
+                         | (ready[i].events & EPOLLOUT ? EVENT_ENGINE_WRITE : 0)
+                         | (ready[i].events & EPOLLERR ? EVENT_ENGINE_ERROR : 0);
+    }
+    return n;
+#else
+    int res = poll(engine->fds, engine->count, timeout_ms);
+    if (res == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+    int n = 0;
+    for (int i = 0; i < engine->count && n < max; i++) {
+        short revents = engine->fds[i].revents;
+        if (revents == 0) {
+            continue;
+        }
+        events[n].token = engine->tokens[i];
+        events[n].events = (revents & (POLLIN | POLLHUP) ? EVENT_ENGINE_READ : 0)
+                         | (revents & POLLOUT ? EVENT_ENGINE_WRITE : 0)
+                         | (revents & (POLLERR | POLLNVAL) ? EVENT_ENGINE_ERROR : 0);
+        n++;
+    }
+    return n;
+#endif
+}
+
+int
+event_engine_backend(event_engine* engine) {
+#ifdef EVENT_ENGINE_HAS_IO_URING
+    if (engine->uring != NULL) {
+        return EVENT_ENGINE_IO_URING;
+    }
+#endif
+    (void)engine;
+    return EVENT_ENGINE_EPOLL;
+}
+
+int
+event_engine_set_default_backend(int backend) {
+    if (backend == EVENT_ENGINE_IO_URING) {
+#ifdef EVENT_ENGINE_HAS_IO_URING
+        if (__atomic_load_n(&uringSupport, __ATOMIC_RELAXED) <= 0) { // probe, kernel may have io_uring disabled
+            event_uring* u = uring_try_new();
+            if (u == NULL) {
+                return -1;
+            }
+            uring_free(u);
+        }
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
+    defaultBackend = backend;
+    return 0;
+}
+
+/* backend engines created now get */
+int
+event_engine_default_backend(void) {
+    if (defaultBackend != EVENT_ENGINE_AUTO) {
+        return defaultBackend;
+    }
+#ifdef EVENT_ENGINE_HAS_IO_URING
+    if (__atomic_load_n(&uringSupport, __ATOMIC_RELAXED) == 0) { // probed at most once unless it failed transiently
+        event_uring* u = uring_try_new();
+        if (u != NULL) {
+            uring_free(u);
+        }
+    }
+    if (__atomic_load_n(&uringSupport, __ATOMIC_RELAXED) > 0) {
+        return EVENT_ENGINE_IO_URING;
+    }
+#endif
+    return EVENT_ENGINE_EPOLL;
+}
+
+const char*
+event_engine_backend_name(int backend) {
+    switch (backend) {
+        case EVENT_ENGINE_AUTO: return "auto";
+        case EVENT_ENGINE_IO_URING: return "io_uring";
+#ifdef __linux__
+        default: return "epoll";
+#else
+        default: return "poll";
+#endif
+    }
+}
+#endif
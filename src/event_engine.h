@@ -0,0 +1,36 @@
+#ifndef ELI_EVENT_ENGINE_H_
+#define ELI_EVENT_ENGINE_H_
+#ifndef _WIN32
+#include <stdint.h>
+
+#define EVENT_ENGINE_READ  0x1
+#define EVENT_ENGINE_WRITE 0x2
+#define EVENT_ENGINE_ERROR 0x4
+
+/* backends, auto picks io_uring when kernel allows it and falls back to epoll */
+#define EVENT_ENGINE_AUTO     0
+#define EVENT_ENGINE_EPOLL    1 // poll outside of linux
+#define EVENT_ENGINE_IO_URING 2
+
+typedef struct event_engine_event {
+    uint64_t token;
+    uint32_t events;
+} event_engine_event;
+
+typedef struct event_engine event_engine;
+
+/* Level triggered readiness notifications over a set of fds (io_uring or epoll on linux, poll elsewhere). */
+event_engine* event_engine_new(void);
+void event_engine_free(event_engine* engine);
+int event_engine_add(event_engine* engine, int fd, uint32_t events, uint64_t token);
+int event_engine_remove(event_engine* engine, int fd);
+int event_engine_wait(event_engine* engine, event_engine_event* events, int max, int timeout_ms);
+int event_engine_backend(event_engine* engine);
+
+/* backend of engines created from now on, -1 (ENOSYS) if requested one is not available */
+int event_engine_set_default_backend(int backend);
+int event_engine_default_backend(void);
+const char* event_engine_backend_name(int backend);
+
+#endif
+#endif
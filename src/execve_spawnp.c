@@ -1,50 +1,96 @@
 #ifndef _WIN32
 #include "execve_spawnp.h"
+#include "spawn_stats.h"
 
+/* returns 0 or -1 (ENOMEM); searches PATH of the calling process, empty entries are skipped */
 int
-execve_spawnp(const char* file, char* const argv[], char* const envp[]) {
-    const char *p, *z, *path_env = getenv("PATH");
-    int seen_eacces = 0;
+execve_path_prepare(execve_path* path, const char* file) {
+    const char* path_env = getenv("PATH");
+    path->candidates = NULL;
+    path->error = 0;
 
-    errno = ENOENT;
     if (!*file) {
-        return -1;
+        path->error = ENOENT;
+        return 0;
     }
-
     if (strchr(file, '/') != NULL) {
-        return execve(file, argv, envp);
+        return 0;
+    }
+    size_t file_len = strnlen(file, NAME_MAX + 1);
+    if (file_len > NAME_MAX) {
+        path->error = ENAMETOOLONG;
+        return 0;
     }
-
     if (!path_env) {
         path_env = "/usr/local/bin:/bin:/usr/bin";
     }
-    if (strnlen(file, NAME_MAX + 1) > NAME_MAX) {
-        errno = ENAMETOOLONG;
+
+    size_t count = 0, size = 0;
+    for (const char* p = path_env; *p;) {
+        size_t len = strcspn(p, ":");
+        if (len > 0) {
+            count++;
+            size += len + file_len + 2;
+        }
+        p += len + (p[len] == ':');
+    }
+
+    char** candidates = spawn_malloc((count + 1) * sizeof(char*) + size);
+    if (candidates == NULL) {
         return -1;
     }
+    char* next = (char*)(candidates + count + 1);
+    size_t index = 0;
+    for (const char* p = path_env; *p;) {
+        size_t len = strcspn(p, ":");
+        if (len > 0) {
+            candidates[index++] = next;
+            memcpy(next, p, len);
+            next[len] = '/';
+            memcpy(next + len + 1, file, file_len + 1);
+            next += len + file_len + 2;
+        }
+        p += len + (p[len] == ':');
+    }
+    candidates[index] = NULL;
+    path->candidates = candidates;
+    return 0;
+}
+
+void
+execve_path_free(execve_path* path) {
+    free(path->candidates);
+    path->candidates = NULL;
+}
+
+/* async signal safe, meant to be called in child after fork */
+int
+execve_spawnp(const execve_path* path, const char* file, char* const argv[], char* const envp[], int* candidate) {
+    int seen_eacces = 0;
 
-    char* path = strdup(path_env);
-    char* token = strtok(path, ":");
-    while (token != NULL) {
-        char* full_path = malloc(strlen(token) + strlen(file) + 2);
-        strcpy(full_path, token);
-        strcat(full_path, "/");
-        strcat(full_path, file);
+    *candidate = -1;
+    if (path->error != 0) {
+        errno = path->error;
+        return -1;
+    }
+    if (path->candidates == NULL) {
+        return execve(file, argv, envp);
+    }
 
-        execve(full_path, argv, envp);
+    errno = ENOENT;
+    for (int index = 0; path->candidates[index] != NULL; index++) {
+        execve(path->candidates[index], argv, envp);
         switch (errno) {
-            case EACCES: seen_eacces = 1;
+            case EACCES:
+                if (!seen_eacces) {
+                    *candidate = index;
+                }
+                seen_eacces = 1;
             case ENOENT:
             case ENOTDIR: break;
-            default:
-                free(full_path);
-                free(path);
-                return -1;
+            default: *candidate = index; return -1;
         }
-        free(full_path);
-        token = strtok(NULL, ":");
     }
-    free(path);
 
     if (seen_eacces) {
         errno = EACCES;
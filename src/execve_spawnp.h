@@ -8,7 +8,17 @@
 #include <string.h>
 #include <unistd.h>
 
-int execve_spawnp(const char* file, char* const argv[], char* const envp[]);
+/* PATH candidates of a command resolved before fork, so the child neither allocates nor reads environment */
+typedef struct execve_path {
+    char** candidates; // NULL terminated, NULL if file is executed as is (contains '/')
+    int error;         // errno reported without exec attempt, 0 - none
+} execve_path;
+
+int execve_path_prepare(execve_path* path, const char* file);
+void execve_path_free(execve_path* path);
+
+/* candidate is set to index of PATH entry which caused the returned error, -1 if there is no such single entry */
+int execve_spawnp(const execve_path* path, const char* file, char* const argv[], char* const envp[], int* candidate);
 
 #endif // ELI_EXECVPE_H_
 #endif
\ No newline at end of file
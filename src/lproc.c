@@ -3,10 +3,20 @@
 
 #include <signal.h>
 #include "lerror.h"
+#include "lproc_channel.h"
+#include "lproc_executable.h"
+#include "lproc_list.h"
+#include "lproc_snapshot.h"
 #include "lprocess.h"
+#include "lprocess_async.h"
+#include "lprocess_pool.h"
 #include "lspawn.h"
 #include "pipe.h"
+#include "spawn_server.h"
+#include "spawn_stats.h"
+#include "stdio_pump.h"
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -20,11 +30,26 @@
 #define CREATION_FLAG    _S_IREAD | _S_IWRITE
 #define SLEEP_MULTIPLIER 1e3
 #else
+#include <errno.h>
 #include <fcntl.h>
+#include <sys/resource.h>
 #include <unistd.h>
+#include "event_engine.h"
+#ifdef __linux__
+#include <sched.h>
+#include <sys/prctl.h>
 
-#define RDONLY_FLAG      O_RDONLY
-#define WRONLY_FLAG      O_WRONLY | O_TRUNC | O_CREAT
+#ifndef SCHED_BATCH
+#define SCHED_BATCH 3
+#endif
+#ifndef SCHED_IDLE
+#define SCHED_IDLE 5
+#endif
+#define IOPRIO_CLASS_SHIFT 13
+#endif
+
+#define RDONLY_FLAG      O_RDONLY | O_CLOEXEC
+#define WRONLY_FLAG      O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC
 #define CREATION_FLAG    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH
 #define SLEEP_MULTIPLIER 1e6
 #endif
@@ -34,6 +59,12 @@
 #define INHERIT 1
 #define PIPE    2
 #define PATH    3
+#define TAIL    4
+#define ROTATE  5 // { rotate = {...} }
+#define STREAM  6 // FILE* or ELI_STREAM
+
+#define TAIL_DEFAULT_SIZE    4096
+#define STAMPS_DEFAULT_COUNT 4096
 
 /* END REDIRECT KINDS */
 
@@ -57,112 +88,348 @@ lcheck_option_with_fallback(lua_State* L, int arg, const char* def, const char*
     return luaL_argerror(L, arg, lua_pushfstring(L, "invalid option '%s'", name));
 }
 
+/* ... stdtab -- ... stdtab; 0 if not set */
 static int
-setup_redirect(lua_State* L, const char* stdname, int idx, spawn_params* p) {
-    stdio_channel* channel = new_stdio_channel();
-    lua_getfield(L, idx, stdname);
+get_stdio_size_option(lua_State* L, const char* stdname, const char* name) {
+    int size = 0;
+    if (lua_getfield(L, -1, name) != LUA_TNIL) {
+        if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) <= 0 || lua_tointeger(L, -1) > INT_MAX) {
+            return luaL_error(L, "bad %s option for %s (positive integer expected)", name, stdname);
+        }
+        size = (int)lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+    return size;
+}
+
+#ifdef __linux__
+static void
+close_pipe_keep_errno(int fds[2]) {
+    int err = errno;
+    close(fds[0]);
+    close(fds[1]);
+    errno = err;
+}
 
+/*
+** Child writes into fds, pump moves its output into a second pipe stamping each chunk,
+** fds[0] is replaced by read end of that pipe.
+*/
+static int
+setup_relay(int fds[2], int pipeSize, int stampCount, stdio_channel* channel) {
+    int relay[2];
+    if (spawn_pipe_cloexec(relay) == -1) {
+        close_pipe_keep_errno(fds);
+        return -1;
+    }
+    stdio_pump_target* t = NULL;
+    if ((pipeSize > 0 && stdio_pipe_set_size(relay[0], pipeSize) == -1)
+        || (t = stdio_relay_new(fds[0], relay[1], (size_t)stampCount)) == NULL) {
+        close_pipe_keep_errno(relay);
+        close_pipe_keep_errno(fds);
+        return -1;
+    }
+    if (stdio_pump_add(t) == -1) {
+        int err = errno;
+        stdio_pump_release(t); // closes fds[0] and relay[1]
+        close(relay[0]);
+        close(fds[1]);
+        errno = err;
+        return -1;
+    }
+    channel->pump = t;
+    fds[0] = relay[0];
+    return 0;
+}
+#endif
+
+/* stdio entry parsed from options, checked against its kind before anything is opened or allocated */
+typedef struct redirect_options {
+    const char* stdname;
     int stdioKind;
+    int kind; // redirect kind, IGNORE ... STREAM
+    int pipeSize, tailSize, stampCount;
+    const char* rotatePath; // anchored by options
+    lua_Integer maxBytes, keep;
+} redirect_options;
 
+/* ... stdtab -- ... stdtab value; value is kind string/nil, rotate table or stream anchored by options */
+static void
+check_redirect(lua_State* L, const char* stdname, redirect_options* r) {
+    memset(r, 0, sizeof *r);
+    r->stdname = stdname;
     switch (stdname[3]) {
-        case 'i': stdioKind = STDIO_STDIN; break;
-        case 'o': stdioKind = STDIO_STDOUT; break;
-        case 'e': stdioKind = STDIO_STDERR; break;
-        case 'p': stdioKind = STDIO_OUTPUT_STREAMS; break; // output
+        case 'i': r->stdioKind = STDIO_STDIN; break;
+        case 'o': r->stdioKind = STDIO_STDOUT; break;
+        case 'e': r->stdioKind = STDIO_STDERR; break;
+        case 'p': r->stdioKind = STDIO_OUTPUT_STREAMS; break; // output
+    }
+    lua_getfield(L, -1, stdname);
+
+    if (lua_type(L, -1) == LUA_TTABLE) { // { kind, pipe_size = bytes, size = tail bytes, timestamps = entries }
+        r->pipeSize = get_stdio_size_option(L, stdname, "pipe_size");
+        r->tailSize = get_stdio_size_option(L, stdname, "size");
+        if (lua_getfield(L, -1, "timestamps") == LUA_TBOOLEAN) {
+            r->stampCount = lua_toboolean(L, -1) ? STAMPS_DEFAULT_COUNT : 0;
+            lua_pop(L, 1);
+        } else {
+            lua_pop(L, 1);
+            r->stampCount = get_stdio_size_option(L, stdname, "timestamps");
+        }
+#ifndef __linux__
+        if (r->stampCount > 0) {
+            luaL_error(L, "timestamps are not supported on this platform");
+        }
+#endif
+        switch (lua_getfield(L, -1, "rotate")) {
+            case LUA_TNIL:
+                lua_pop(L, 1);
+                lua_rawgeti(L, -1, 1);
+                lua_replace(L, -2); // kind takes place of the table, stays anchored by it
+                if (lua_type(L, -1) == LUA_TTABLE) {
+                    luaL_error(L, "bad %s option (nested table)", stdname);
+                }
+                break;
+            case LUA_TTABLE: lua_replace(L, -2); break; // { rotate = { path, max_bytes, keep } }
+            default:
+                luaL_error(L, "bad rotate option for %s (table expected, got %s)", stdname, luaL_typename(L, -1));
+        }
     }
 
-    int top = lua_gettop(L);
     switch (lua_type(L, -1)) {
         case LUA_TNIL: // fall through
         case LUA_TSTRING:;
-            static const char* lst[] = {"ignore", "inherit", "pipe", "path", NULL};
-            int kind = lcheck_option_with_fallback(L, -1, "pipe", "path", lst); // fallback to default pipe mode
-            switch (kind) {
-                case INHERIT: channel->kind = STDIO_CHANNEL_INHERIT_KIND;
+            static const char* lst[] = {"ignore", "inherit", "pipe", "path", "tail", NULL};
+            r->kind = lcheck_option_with_fallback(L, -1, "pipe", "path", lst); // fallback to default pipe mode
+            break;
+        case LUA_TTABLE:
+            r->kind = ROTATE;
+#ifdef _WIN32
+            luaL_error(L, "rotate is not supported on this platform");
+#else
+            if (r->stdioKind == STDIO_STDIN) {
+                luaL_error(L, "rotate is not supported for stdin");
+            }
+            if (lua_getfield(L, -1, "path") != LUA_TSTRING) {
+                luaL_error(L, "bad rotate path for %s (string expected, got %s)", stdname, luaL_typename(L, -1));
+            }
+            r->rotatePath = lua_tostring(L, -1);
+            lua_pop(L, 1);
+            r->maxBytes = lua_getfield(L, -1, "max_bytes") == LUA_TNUMBER ? lua_tointeger(L, -1) : 0;
+            lua_pop(L, 1);
+            if (r->maxBytes <= 0) {
+                luaL_error(L, "bad rotate max_bytes for %s (positive integer expected)", stdname);
+            }
+            r->keep = 1;
+            if (lua_getfield(L, -1, "keep") != LUA_TNIL) {
+                r->keep = lua_isinteger(L, -1) ? lua_tointeger(L, -1) : -1;
+            }
+            lua_pop(L, 1);
+            if (r->keep < 0 || r->keep > 1000) {
+                luaL_error(L, "bad rotate keep for %s (0 to 1000 expected)", stdname);
+            }
+#endif
+            break;
+        case LUA_TUSERDATA:
+            r->kind = STREAM;
+            if (luaL_testudata(L, -1, LUA_FILEHANDLE) != NULL) {
+                luaL_Stream* fh = lua_touserdata(L, -1);
+                if (fh->closef == 0 || fh->f == NULL) {
+                    luaL_error(L, "%s: closed file", stdname);
+                }
+            } else if (luaL_testudata(L, -1, ELI_STREAM_RW_METATABLE) != NULL
+                       || luaL_testudata(L, -1,
+                                         r->stdioKind == STDIO_STDIN ? ELI_STREAM_W_METATABLE
+                                                                     : ELI_STREAM_R_METATABLE)
+                              != NULL) {
+                ELI_STREAM* stream = lua_touserdata(L, -1);
+                if (stream->closed) {
+                    luaL_error(L, "%s: closed pipe", stdname);
+                }
+            } else {
+                luaL_typeerror(L, -1, "FILE*/ELI_STREAM");
+            }
+            break;
+        default: r->kind = -1; break; // left as inherited
+    }
+    if (r->pipeSize > 0 && r->kind != PIPE && r->kind != TAIL && r->kind != ROTATE) {
+        luaL_error(L, "bad pipe_size option for %s (applies to pipe only)", stdname);
+    }
+    if (r->stampCount > 0 && r->kind != PIPE) {
+        luaL_error(L, "bad timestamps option for %s (applies to pipe only)", stdname);
+    }
+    if (r->stampCount > 0 && r->stdioKind == STDIO_STDIN) {
+        luaL_error(L, "timestamps are not supported for stdin");
+    }
+    if (r->tailSize > 0 && r->kind != TAIL) {
+        luaL_error(L, "bad size option for %s (applies to tail only)", stdname);
+    }
+    if (r->kind == TAIL) {
 #ifdef _WIN32
-                    spawn_param_redirect_inherit(p, stdioKind);
+        luaL_error(L, "tail is not supported on this platform");
 #else
-                    spawn_param_redirect_inherit(p, stdioKind);
-#endif
-                    break;
-                case PATH:
-                    channel->kind = STDIO_CHANNEL_EXTERNAL_PATH_KIND;
-                    const char* path = luaL_checkstring(L, -1);
-                    channel->path = path;
-                    int fd;
-                    if (stdioKind == STDIO_STDIN) {
-                        if ((fd = open(path, RDONLY_FLAG)) == -1) {
-                            return push_error(L, "Failed to open stdin file!");
-                        }
-                    } else {
-                        if ((fd = open(path, WRONLY_FLAG, CREATION_FLAG)) == -1) {
-                            return push_error(L, "Failed to create stdout/stderr file!");
-                        }
-                    }
+        if (r->stdioKind == STDIO_STDIN) {
+            luaL_error(L, "tail is not supported for stdin");
+        }
+#endif
+    }
+}
+
+/* ... value -- ... nil error errno? (on failure); opens what entry needs, channel is owned by params */
+static int
+setup_redirect(lua_State* L, const redirect_options* r, spawn_params* p) {
+    int stdioKind = r->stdioKind;
+    int pipeSize = r->pipeSize, tailSize = r->tailSize, stampCount = r->stampCount;
+
+    stdio_channel* channel = new_stdio_channel();
+    if (channel == NULL) {
+        return luaL_error(L, "not enough memory");
+    }
+    switch (stdioKind) { // released with params unless spawn hands it over to the process
+        case STDIO_OUTPUT_STREAMS:
+            p->stdio[STDIO_STDOUT] = channel;
+            p->stdio[STDIO_STDERR] = channel;
+            break;
+        default: p->stdio[stdioKind] = channel; break;
+    }
+
+    switch (r->kind) {
+        case INHERIT:
+            channel->kind = STDIO_CHANNEL_INHERIT_KIND;
+            spawn_param_redirect_inherit(p, stdioKind);
+            break;
+        case PATH:
+            channel->kind = STDIO_CHANNEL_EXTERNAL_PATH_KIND;
+            const char* path = lua_tostring(L, -1);
+            channel->path = path;
+            int fd;
+            if (stdioKind == STDIO_STDIN) {
+                if ((fd = open(path, RDONLY_FLAG)) == -1) {
+                    return push_error(L, "Failed to open stdin file!");
+                }
+            } else {
+                if ((fd = open(path, WRONLY_FLAG, CREATION_FLAG)) == -1) {
+                    return push_error(L, "Failed to create stdout/stderr file!");
+                }
+            }
 #ifdef _WIN32
-                    spawn_param_redirect(p, stdioKind, (HANDLE)_get_osfhandle(fd));
+            spawn_param_redirect(p, stdioKind, (HANDLE)_get_osfhandle(fd));
 #else
-                    spawn_param_redirect(p, stdioKind, fd);
+            spawn_param_redirect(p, stdioKind, fd);
+            channel->fd_to_close = fd; // child has its own copy after spawn
 #endif
-                    break;
-                case IGNORE: {
+            break;
+        case IGNORE: {
 #ifdef _WIN32
-                    HANDLE dev_null_fd = CreateFile("NUL", GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
-                                                    FILE_ATTRIBUTE_NORMAL, NULL);
+            HANDLE dev_null_fd =
+                CreateFile("NUL", GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 
-                    if (dev_null_fd == INVALID_HANDLE_VALUE) {
-                        return push_error(L, "Failed to open NUL device!");
-                    }
-                    spawn_param_redirect(p, stdioKind, dev_null_fd);
+            if (dev_null_fd == INVALID_HANDLE_VALUE) {
+                return push_error(L, "Failed to open NUL device!");
+            }
+            spawn_param_redirect(p, stdioKind, dev_null_fd);
 #else
-                    int dev_null_fd = open("/dev/null", O_RDWR);
-                    if (dev_null_fd == -1) {
-                        return push_error(L, "failed to open /dev/null");
-                    }
-                    spawn_param_redirect(p, stdioKind, dev_null_fd);
-#endif
-                    channel->fd_to_close = dev_null_fd;
-                    break;
-                }
-                case PIPE: {
-                    channel->kind = STDIO_CHANNEL_STREAM_KIND;
-                    PIPE_DESCRIPTORS descriptors;
-                    if (new_pipe(&descriptors) == -1) {
-                        return push_error(L, "failed to create pipe");
-                    };
-                    ELI_STREAM* stream = eli_new_stream(NULL);
-                    stream->fd = descriptors.fd[stdioKind == STDIO_STDIN ? 1 : 0];
-                    channel->stream = stream;
-                    spawn_param_redirect(p, stdioKind, descriptors.fd[stdioKind == STDIO_STDIN ? 0 : 1]);
-                    channel->fd_to_close = descriptors.fd[stdioKind == STDIO_STDIN ? 0 : 1];
-                    break;
-                }
-                default: luaL_error(L, "invalid stdio type: %s!"); return 1;
+            int dev_null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+            if (dev_null_fd == -1) {
+                return push_error(L, "failed to open /dev/null");
             }
+            spawn_param_redirect(p, stdioKind, dev_null_fd);
+#endif
+            channel->fd_to_close = dev_null_fd;
             break;
-        case LUA_TUSERDATA:
-            lua_getmetatable(L, idx);
-            luaL_getmetatable(L, LUA_FILEHANDLE);
-            luaL_getmetatable(L, ELI_STREAM_RW_METATABLE);
-            switch (stdioKind) {
-                case STDIO_STDIN: luaL_getmetatable(L, ELI_STREAM_W_METATABLE); break;
-                case STDIO_OUTPUT_STREAMS:
-                case STDIO_STDOUT:
-                case STDIO_STDERR: luaL_getmetatable(L, ELI_STREAM_R_METATABLE); break;
+        }
+        case PIPE: {
+            channel->kind = STDIO_CHANNEL_STREAM_KIND;
+            PIPE_DESCRIPTORS descriptors;
+#ifdef _WIN32
+            if (new_pipe(&descriptors) == -1) {
+                return push_error(L, "failed to create pipe");
+            };
+#else
+            if (spawn_pipe_cloexec(descriptors.fd) == -1) {
+                return push_error(L, "failed to create pipe");
+            };
+#ifdef __linux__
+            if (pipeSize > 0 && stdio_pipe_set_size(descriptors.fd[0], pipeSize) == -1) {
+                close_pipe_keep_errno(descriptors.fd);
+                return push_error(L, "failed to resize pipe");
             }
-
-            if (lua_rawequal(L, -3, -4)) { // file
-                lua_pop(L, lua_gettop(L) - top);
-                luaL_Stream* fh = (luaL_Stream*)luaL_checkudata(L, -1, "FILE*");
-                if (fh == NULL) {
-                    luaL_error(L, "%s: invalid file");
-                    return 1;
+            if (stampCount > 0 && setup_relay(descriptors.fd, pipeSize, stampCount, channel) == -1) {
+                return push_error(L, "failed to start output relay");
+            }
+#endif
+#endif
+            ELI_STREAM* stream = eli_new_stream(NULL);
+            stream->fd = descriptors.fd[stdioKind == STDIO_STDIN ? 1 : 0];
+            channel->stream = stream;
+            spawn_param_redirect(p, stdioKind, descriptors.fd[stdioKind == STDIO_STDIN ? 0 : 1]);
+            channel->fd_to_close = descriptors.fd[stdioKind == STDIO_STDIN ? 0 : 1];
+            break;
+        }
+#ifndef _WIN32
+        case TAIL: {
+            int fds[2];
+            if (spawn_pipe_cloexec(fds) == -1) {
+                return push_error(L, "failed to create pipe");
+            }
+#ifdef __linux__
+            if (pipeSize > 0 && stdio_pipe_set_size(fds[0], pipeSize) == -1) {
+                close_pipe_keep_errno(fds);
+                return push_error(L, "failed to resize pipe");
+            }
+#endif
+            stdio_pump_target* tail = stdio_tail_new(fds[0], tailSize > 0 ? tailSize : TAIL_DEFAULT_SIZE);
+            if (tail == NULL || stdio_pump_add(tail) == -1) {
+                int err = errno;
+                if (tail != NULL) {
+                    stdio_pump_release(tail); // closes read end
+                } else {
+                    close(fds[0]);
                 }
-                if (fh->closef == 0 || fh->f == NULL) {
-                    luaL_error(L, "%s: closed file");
-                    return 1;
+                close(fds[1]);
+                errno = err;
+                return push_error(L, "failed to start tail capture");
+            }
+            channel->kind = STDIO_CHANNEL_TAIL_KIND;
+            channel->pump = tail;
+            spawn_param_redirect(p, stdioKind, fds[1]);
+            channel->fd_to_close = fds[1];
+            break;
+        }
+        case ROTATE: {
+            int fds[2];
+            if (spawn_pipe_cloexec(fds) == -1) {
+                return push_error(L, "failed to create pipe");
+            }
+#ifdef __linux__
+            if (pipeSize > 0 && stdio_pipe_set_size(fds[0], pipeSize) == -1) {
+                close_pipe_keep_errno(fds);
+                return push_error(L, "failed to resize pipe");
+            }
+#endif
+            stdio_pump_target* rotate = stdio_rotate_new(fds[0], r->rotatePath, (uint64_t)r->maxBytes, (int)r->keep);
+            if (rotate == NULL || stdio_pump_add(rotate) == -1) {
+                int err = errno;
+                if (rotate != NULL) {
+                    stdio_pump_release(rotate); // closes read end
+                } else {
+                    close(fds[0]);
                 }
-
+                close(fds[1]);
+                errno = err;
+                return push_error(L, "failed to open rotated output file");
+            }
+            channel->kind = STDIO_CHANNEL_ROTATE_KIND;
+            channel->pump = rotate;
+            channel->path = stdio_rotate_path(rotate);
+            spawn_param_redirect(p, stdioKind, fds[1]);
+            channel->fd_to_close = fds[1];
+            break;
+        }
+#endif
+        case STREAM:
+            if (luaL_testudata(L, -1, LUA_FILEHANDLE) != NULL) {
+                luaL_Stream* fh = lua_touserdata(L, -1);
                 channel->kind = STDIO_CHANNEL_EXTERNAL_FILE_KIND;
                 channel->file = fh;
 #ifdef _WIN32
@@ -170,34 +437,13 @@ setup_redirect(lua_State* L, const char* stdname, int idx, spawn_params* p) {
 #else
                 spawn_param_redirect(p, stdioKind, fileno(fh->f));
 #endif
-            } else if (lua_rawequal(L, -1, -4) || lua_rawequal(L, -2, -4)) { // eli pipe
-                lua_pop(L, lua_gettop(L) - top);
-                ELI_STREAM* stream = (ELI_STREAM*)lua_touserdata(L, -1);
-                if (stream == NULL) {
-                    luaL_error(L, "%s: invalid stream");
-                    return 1;
-                }
-                if (stream->closed) {
-                    luaL_error(L, "%s: closed pipe");
-                    return 1;
-                }
-
+            } else { // eli pipe
+                ELI_STREAM* stream = lua_touserdata(L, -1);
                 channel->kind = STDIO_CHANNEL_EXTERNAL_STREAM_KIND;
                 channel->stream = stream;
                 spawn_param_redirect(p, stdioKind, stream->fd);
-            } else {
-                lua_pop(L, lua_gettop(L) - top);
-                luaL_typeerror(L, -1, "FILE*/ELI_STREAM");
-                return 1;
             }
-    }
-
-    switch (stdioKind) {
-        case STDIO_OUTPUT_STREAMS:
-            p->stdio[STDIO_STDOUT] = channel;
-            p->stdio[STDIO_STDERR] = channel;
             break;
-        default: p->stdio[stdioKind] = channel; break;
     }
     lua_pop(L, 1);
     return 0;
@@ -229,12 +475,7 @@ setup_redirects(lua_State* L, int idx, spawn_params* p) {
         case LUA_TTABLE: break;
     }
 
-    int res;
-    res = setup_redirect(L, "stdin", -1, p);
-    if (res) {
-        return res;
-    }
-
+    const char* names[3] = {"stdin", "stdout", "stderr"};
     int wantsCombinedOutput = lua_getfield(L, -1, "output") != LUA_TNIL;
     lua_pop(L, 1);
     if (wantsCombinedOutput) {
@@ -246,34 +487,527 @@ setup_redirects(lua_State* L, int idx, spawn_params* p) {
             luaL_error(L, "cannot specify both the output option and stdout/stderr options");
             return 1;
         }
-        res = setup_redirect(L, "output", -1, p);
+        names[1] = "output";
+    }
+    int count = wantsCombinedOutput ? 2 : 3;
+
+    // every entry is checked before any of them opens something, so option errors leave nothing behind
+    redirect_options redirects[3];
+    for (int i = 0; i < count; i++) {
+        lua_pushvalue(L, -1 - i);                   /* stdtab values... stdtab */
+        check_redirect(L, names[i], &redirects[i]); /* stdtab values... stdtab value */
+        lua_replace(L, -2);                         /* stdtab values... value */
+    }
+    for (int i = 0; i < count; i++) {
+        lua_pushvalue(L, -count + i); /* stdtab values... value */
+        int res = setup_redirect(L, &redirects[i], p);
         if (res) {
-            return res;
+            return res; // channels set up so far are released by caller
         }
-    } else {
-        res = setup_redirect(L, "stdout", -1, p);
-        if (res) {
-            return res;
+    }
+    lua_pop(L, count + 1);
+    return 0;
+}
+
+#ifndef _WIN32
+static const struct {
+    const char* name;
+    int resource;
+} rlimitNames[] = {
+    {"as", RLIMIT_AS},
+    {"core", RLIMIT_CORE},
+    {"cpu", RLIMIT_CPU},
+    {"data", RLIMIT_DATA},
+    {"fsize", RLIMIT_FSIZE},
+    {"nofile", RLIMIT_NOFILE},
+    {"stack", RLIMIT_STACK},
+#ifdef RLIMIT_NPROC
+    {"nproc", RLIMIT_NPROC},
+#endif
+#ifdef RLIMIT_MEMLOCK
+    {"memlock", RLIMIT_MEMLOCK},
+#endif
+#ifdef RLIMIT_RSS
+    {"rss", RLIMIT_RSS},
+#endif
+#ifdef RLIMIT_LOCKS
+    {"locks", RLIMIT_LOCKS},
+#endif
+#ifdef RLIMIT_MSGQUEUE
+    {"msgqueue", RLIMIT_MSGQUEUE},
+#endif
+#ifdef RLIMIT_NICE
+    {"nice", RLIMIT_NICE},
+#endif
+#ifdef RLIMIT_RTPRIO
+    {"rtprio", RLIMIT_RTPRIO},
+#endif
+#ifdef RLIMIT_RTTIME
+    {"rttime", RLIMIT_RTTIME},
+#endif
+#ifdef RLIMIT_SIGPENDING
+    {"sigpending", RLIMIT_SIGPENDING},
+#endif
+    {NULL, 0},
+};
+
+/* number, negative number or "unlimited" */
+static rlim_t
+check_rlimit_value(lua_State* L, int idx, const char* name) {
+    if (lua_type(L, idx) == LUA_TSTRING && strcmp(lua_tostring(L, idx), "unlimited") == 0) {
+        return RLIM_INFINITY;
+    }
+    if (!lua_isinteger(L, idx)) {
+        luaL_error(L, "bad rlimits.%s value (integer or 'unlimited' expected, got %s)", name, luaL_typename(L, idx));
+        return 0;
+    }
+    lua_Integer value = lua_tointeger(L, idx);
+    return value < 0 ? RLIM_INFINITY : (rlim_t)value;
+}
+
+/* rlimits = { nofile = 1024, core = { soft, hard }, cpu = { soft = 10, hard = 20 } } */
+static void
+setup_rlimits(lua_State* L, int idx, spawn_params* p) {
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) { // ... rlimits name value
+        if (lua_type(L, -2) != LUA_TSTRING) {
+            luaL_error(L, "bad rlimits option (resource name expected, got %s)", luaL_typename(L, -2));
+            return;
         }
-        res = setup_redirect(L, "stderr", -1, p);
-        if (res) {
-            return res;
+        const char* name = lua_tostring(L, -2);
+        int i = 0;
+        while (rlimitNames[i].name != NULL && strcmp(rlimitNames[i].name, name) != 0) {
+            i++;
+        }
+        if (rlimitNames[i].name == NULL) {
+            luaL_error(L, "bad rlimits option (unknown resource '%s')", name);
+            return;
+        }
+        if (p->rlimit_count == SPAWN_MAX_RLIMITS) {
+            luaL_error(L, "bad rlimits option (too many limits)");
+            return;
+        }
+        spawn_rlimit* limit = &p->rlimits[p->rlimit_count++];
+        limit->resource = rlimitNames[i].resource;
+        if (lua_type(L, -1) == LUA_TTABLE) {
+            if (lua_getfield(L, -1, "soft") == LUA_TNIL) {
+                lua_pop(L, 1);
+                lua_rawgeti(L, -1, 1);
+            }
+            if (lua_getfield(L, -2, "hard") == LUA_TNIL) {
+                lua_pop(L, 1);
+                lua_rawgeti(L, -2, 2);
+            }
+            limit->limit.rlim_cur = check_rlimit_value(L, -2, name);
+            limit->limit.rlim_max = check_rlimit_value(L, -1, name);
+            lua_pop(L, 2);
+        } else {
+            limit->limit.rlim_cur = limit->limit.rlim_max = check_rlimit_value(L, -1, name);
         }
+        lua_pop(L, 1); // ... rlimits name
+    }
+}
+
+/* rlimits, nice, cpu_affinity, sched_policy, sched_priority and ioprio options */
+static void
+setup_limits(lua_State* L, int idx, spawn_params* p) {
+    switch (lua_getfield(L, idx, "rlimits")) {
+        case LUA_TNIL: break;
+        case LUA_TTABLE: setup_rlimits(L, lua_gettop(L), p); break;
+        default: luaL_error(L, "bad rlimits option (table expected, got %s)", luaL_typename(L, -1)); return;
     }
+    lua_pop(L, 1);
 
+    if (lua_getfield(L, idx, "nice") != LUA_TNIL) {
+        if (!lua_isinteger(L, -1)) {
+            luaL_error(L, "bad nice option (integer expected, got %s)", luaL_typename(L, -1));
+            return;
+        }
+        p->nice = (int)lua_tointeger(L, -1);
+        p->has_nice = 1;
+    }
     lua_pop(L, 1);
+
+    int cpu_affinity = lua_getfield(L, idx, "cpu_affinity");
+    int sched_policy = lua_getfield(L, idx, "sched_policy");
+    int ioprio = lua_getfield(L, idx, "ioprio");
+#ifdef __linux__
+    if (cpu_affinity == LUA_TTABLE) {
+        size_t n = lua_rawlen(L, -3);
+        for (size_t i = 1; i <= n; i++) {
+            lua_rawgeti(L, -3, i);
+            lua_Integer cpu = lua_isinteger(L, -1) ? lua_tointeger(L, -1) : -1;
+            if (cpu < 0 || cpu >= SPAWN_MAX_CPUS) {
+                luaL_error(L, "bad cpu_affinity option (cpu index expected at position %d)", (int)i);
+                return;
+            }
+            p->cpu_affinity[cpu / (8 * sizeof(unsigned long))] |= 1UL << (cpu % (8 * sizeof(unsigned long)));
+            lua_pop(L, 1);
+        }
+        p->has_cpu_affinity = n > 0;
+    } else if (cpu_affinity != LUA_TNIL) {
+        luaL_error(L, "bad cpu_affinity option (table expected, got %s)", luaL_typename(L, -3));
+        return;
+    }
+
+    if (sched_policy != LUA_TNIL) {
+        static const char* policies[] = {"other", "batch", "idle", "fifo", "rr", NULL};
+        static const int policyValues[] = {SCHED_OTHER, SCHED_BATCH, SCHED_IDLE, SCHED_FIFO, SCHED_RR};
+        p->sched_policy = policyValues[luaL_checkoption(L, -2, NULL, policies)];
+        lua_getfield(L, idx, "sched_priority");
+        p->sched_priority = (int)luaL_optinteger(L, -1, 0);
+        lua_pop(L, 1);
+    }
+
+    if (ioprio != LUA_TNIL) {
+        static const char* classes[] = {"none", "realtime", "best-effort", "idle", NULL};
+        int ioclass, level = 0;
+        if (ioprio == LUA_TTABLE) {
+            lua_getfield(L, -1, "class");
+            ioclass = luaL_checkoption(L, -1, "best-effort", classes);
+            lua_getfield(L, -2, "level");
+            level = (int)luaL_optinteger(L, -1, 4);
+            lua_pop(L, 2);
+        } else {
+            ioclass = luaL_checkoption(L, -1, NULL, classes);
+            level = ioclass == 3 ? 0 : 4;
+        }
+        if (level < 0 || level > 7) {
+            luaL_error(L, "bad ioprio option (level must be in range 0-7)");
+            return;
+        }
+        p->ioprio = (ioclass << IOPRIO_CLASS_SHIFT) | level;
+    }
+#else
+    if (cpu_affinity != LUA_TNIL || sched_policy != LUA_TNIL || ioprio != LUA_TNIL) {
+        luaL_error(L, "cpu_affinity, sched_policy and ioprio options are not supported on this platform");
+        return;
+    }
+#endif
+    lua_pop(L, 3);
+}
+#endif
+
+/* parses all options except stdio, opts are expected at index 2 */
+/* cmd opts ... -- cmd opts ... */
+#ifndef _WIN32
+/* fd of integer, FILE* or ELI_STREAM at idx, -1 if value is not usable */
+static int
+get_passed_fd(lua_State* L, int idx) {
+    if (lua_isinteger(L, idx)) {
+        lua_Integer fd = lua_tointeger(L, idx);
+        return fd >= 0 && fd <= INT_MAX && fcntl((int)fd, F_GETFD) != -1 ? (int)fd : -1;
+    }
+    luaL_Stream* fh = (luaL_Stream*)luaL_testudata(L, idx, LUA_FILEHANDLE);
+    if (fh != NULL) {
+        return fh->closef != 0 && fh->f != NULL ? fileno(fh->f) : -1;
+    }
+    ELI_STREAM* stream = (ELI_STREAM*)luaL_testudata(L, idx, ELI_STREAM_R_METATABLE);
+    if (stream == NULL) {
+        stream = (ELI_STREAM*)luaL_testudata(L, idx, ELI_STREAM_W_METATABLE);
+    }
+    if (stream == NULL) {
+        stream = (ELI_STREAM*)luaL_testudata(L, idx, ELI_STREAM_RW_METATABLE);
+    }
+    return stream != NULL && !stream->closed ? stream->fd : -1;
+}
+
+/* fds = { [child fd] = fd | FILE* | ELI_STREAM, ... }, listen_fds = true */
+static int
+setup_passed_fds(lua_State* L, spawn_params* params) {
+    lua_getfield(L, 2, "fds"); /* cmd opts ... fds */
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    if (!lua_istable(L, -1)) {
+        return luaL_error(L, "bad fds option (table expected, got %s)", luaL_typename(L, -1));
+    }
+    lua_pushnil(L); /* cmd opts ... fds nil */
+    while (lua_next(L, -2) != 0) { /* cmd opts ... fds target source */
+        if (!lua_isinteger(L, -2) || lua_tointeger(L, -2) < 3 || lua_tointeger(L, -2) >= SPAWN_MAX_FD) {
+            return luaL_error(L, "bad fds option (keys have to be fd numbers from 3 to %d)", SPAWN_MAX_FD - 1);
+        }
+        if (params->fd_count >= SPAWN_MAX_FDS) {
+            return luaL_error(L, "bad fds option (at most %d fds can be passed)", SPAWN_MAX_FDS);
+        }
+        int fd = get_passed_fd(L, -1);
+        if (fd == -1) {
+            return luaL_error(L, "bad fds option (open fd, FILE* or ELI_STREAM expected for fd %d)",
+                              (int)lua_tointeger(L, -2));
+        }
+        params->fds[params->fd_count].fd = fd;
+        params->fds[params->fd_count].target = (int)lua_tointeger(L, -2);
+        params->fd_count++;
+        lua_pop(L, 1); /* cmd opts ... fds target */
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+    // targets in ascending order, LISTEN_FDS consumers expect them from 3 on
+    for (int i = 1; i < params->fd_count; i++) {
+        spawn_fd fd = params->fds[i];
+        int j = i;
+        for (; j > 0 && params->fds[j - 1].target > fd.target; j--) {
+            params->fds[j] = params->fds[j - 1];
+        }
+        params->fds[j] = fd;
+    }
+    return 0;
+}
+#endif
+
+/* pinned executable at idx or NULL, raises if it is closed */
+static proc_executable*
+check_pinned(lua_State* L, int idx) {
+    proc_executable* e = luaL_testudata(L, idx, PROC_EXECUTABLE_METATABLE);
+    if (e != NULL && e->fd == -1) {
+        luaL_error(L, "pinned executable is closed");
+    }
+    return e;
+}
+
+/* command is a string or pinned executable (proc.pin) */
+static void
+set_spawn_command(lua_State* L, int idx, spawn_params* params) {
+    proc_executable* e = check_pinned(L, idx);
+    if (e == NULL) {
+        spawn_param_filename(params, luaL_checkstring(L, idx));
+        return;
+    }
+#ifndef _WIN32
+    lua_pushvalue(L, idx);
+    spawn_param_command_pinned(L, params, e->path, e->fd);
+#endif
+}
+
+#ifndef _WIN32
+#define DEADLINE_MAX_SECONDS 3153600000.0 // 100 years, now + timeout + grace stays within long long ns
+
+/* ... seconds -- ... seconds; ns, -1 if not a number in range (NaN and inf included) */
+static long long
+get_seconds_option(lua_State* L, int allow_zero) {
+    if (!lua_isnumber(L, -1)) {
+        return -1;
+    }
+    lua_Number seconds = lua_tonumber(L, -1);
+    if (!(seconds >= 0 && seconds <= DEADLINE_MAX_SECONDS) || (seconds == 0 && !allow_zero)) {
+        return -1;
+    }
+    return (long long)(seconds * 1e9);
+}
+#endif
+
+static int
+setup_spawn_options(lua_State* L, spawn_params* params) {
+    // new process_group
+    lua_getfield(L, 2, "create_process_group"); /* cmd opts ... create_process_group */
+    if (lua_isboolean(L, -1) && lua_toboolean(L, -1)) {
+        params->create_process_group = 1;
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+    lua_getfield(L, 2, "username"); /* cmd opts ... create_process_group */
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        params->username = lua_tostring(L, -1);
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+    lua_getfield(L, 2, "password"); /* cmd opts ... create_process_group */
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        params->password = lua_tostring(L, -1);
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+#ifndef _WIN32
+    setup_limits(L, 2, params); /* cmd opts ... */
+#endif
+
+    // working directory, path or directory fd
+    lua_getfield(L, 2, "cwd"); /* cmd opts ... cwd */
+    switch (lua_type(L, -1)) {
+        case LUA_TNIL: break;
+        case LUA_TSTRING: params->cwd = lua_tostring(L, -1); break;
+#ifndef _WIN32
+        case LUA_TNUMBER:
+            if (lua_isinteger(L, -1) && lua_tointeger(L, -1) >= 0) {
+                params->cwd_fd = (int)lua_tointeger(L, -1);
+                break;
+            }
+#endif
+            /*FALLTHRU*/
+        default: return luaL_error(L, "bad cwd option (path or directory fd expected, got %s)", luaL_typename(L, -1));
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+#ifndef _WIN32
+    lua_getfield(L, 2, "umask"); /* cmd opts ... umask */
+    if (!lua_isnil(L, -1)) {
+        if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) < 0 || lua_tointeger(L, -1) > 0777) {
+            return luaL_error(L, "bad umask option (integer in range 0-0777 expected)");
+        }
+        params->umask = (mode_t)lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+    // run time limit in seconds
+    lua_getfield(L, 2, "timeout"); /* cmd opts ... timeout */
+    if (!lua_isnil(L, -1)) {
+        params->timeout = get_seconds_option(L, 0);
+        if (params->timeout == -1) {
+            return luaL_error(L, "bad timeout option (positive number of seconds up to 100 years expected)");
+        }
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+    lua_getfield(L, 2, "kill_signal"); /* cmd opts ... kill_signal */
+    if (!lua_isnil(L, -1)) {
+        if (!lua_isinteger(L, -1) || lua_tointeger(L, -1) <= 0) {
+            return luaL_error(L, "bad kill_signal option (signal number expected)");
+        }
+        params->kill_signal = (int)lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+    lua_getfield(L, 2, "kill_grace"); /* cmd opts ... kill_grace */
+    if (!lua_isnil(L, -1)) {
+        params->kill_grace = get_seconds_option(L, 1);
+        if (params->kill_grace == -1) {
+            return luaL_error(L, "bad kill_grace option (non-negative number of seconds up to 100 years expected)");
+        }
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+    // die_with_parent = true (SIGKILL) or signal number, sent when the spawning thread exits (the keeper thread for
+    // spawn server children, which lives as long as the host)
+    lua_getfield(L, 2, "die_with_parent"); /* cmd opts ... die_with_parent */
+    if (!lua_isnil(L, -1) && !(lua_isboolean(L, -1) && !lua_toboolean(L, -1))) {
+#ifdef __linux__
+        if (lua_isboolean(L, -1)) {
+            params->death_signal = SIGKILL;
+        } else if (lua_isinteger(L, -1) && lua_tointeger(L, -1) > 0) {
+            params->death_signal = (int)lua_tointeger(L, -1);
+        } else {
+            return luaL_error(L, "bad die_with_parent option (boolean or signal number expected)");
+        }
+#else
+        return luaL_error(L, "die_with_parent option is not supported on this platform");
+#endif
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+    // executable = pinned executable, command is still used as argv[0] and for scripts
+    lua_getfield(L, 2, "executable"); /* cmd opts ... executable */
+    if (!lua_isnil(L, -1)) {
+        proc_executable* e = check_pinned(L, -1);
+        if (e == NULL) {
+            return luaL_error(L, "bad executable option (pinned executable expected, got %s)", luaL_typename(L, -1));
+        }
+        lua_pushvalue(L, -1);
+        spawn_param_executable(L, params, e->fd);
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+    lua_getfield(L, 2, "spawn_server"); /* cmd opts ... spawn_server */
+    if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+        params->use_spawn_server = 0;
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+    setup_passed_fds(L, params);
+#else
+    lua_getfield(L, 2, "fds"); /* cmd opts ... fds */
+    if (!lua_isnil(L, -1)) {
+        return luaL_error(L, "fds option is not supported on this platform");
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+    // ignoring these would silently drop deadlines and lifetime guarantees
+    static const char* unsupported[] = {"timeout", "kill_signal", "kill_grace", "die_with_parent", "executable", NULL};
+    for (const char** name = unsupported; *name != NULL; name++) {
+        lua_getfield(L, 2, *name); /* cmd opts ... value */
+        if (!lua_isnil(L, -1) && !(lua_isboolean(L, -1) && !lua_toboolean(L, -1))) {
+            return luaL_error(L, "%s option is not supported on this platform", *name);
+        }
+        lua_pop(L, 1); /* cmd opts ... */
+    }
+#endif
+
+    // options
+    lua_getfield(L, 2, "args"); /* cmd opts ... argtab */
+    switch (lua_type(L, -1)) {
+        default: return luaL_error(L, "bad args option (table expected, got %s)", luaL_typename(L, -1));
+        case LUA_TNIL:
+            lua_pop(L, 1);       /* cmd opts ... */
+            lua_pushvalue(L, 2); /* cmd opts ... opts */
+                                 /*FALLTHRU*/
+        case LUA_TTABLE:
+            if (lua_rawlen(L, 2) > 0) {
+                return luaL_error(L, "cannot specify both the args option and array values");
+            }
+            spawn_param_args(L, params); /* cmd opts ... */
+            break;
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+
+    // env, env = { inherit = true, ... }, env_add, env_remove
+    lua_getfield(L, 2, "env");        /* cmd opts ... envtab */
+    lua_getfield(L, 2, "env_add");    /* cmd opts ... envtab addtab */
+    lua_getfield(L, 2, "env_remove"); /* cmd opts ... envtab addtab removetab */
+    int envtab = lua_gettop(L) - 2;
+    const char* names[3] = {"env", "env_add", "env_remove"};
+    for (int i = 0; i < 3; i++) {
+        if (!lua_isnil(L, envtab + i) && !lua_istable(L, envtab + i)) {
+            return luaL_error(L, "bad %s option (table expected, got %s)", names[i], luaL_typename(L, envtab + i));
+        }
+    }
+    int inherit = !lua_isnil(L, envtab + 1) || !lua_isnil(L, envtab + 2);
+    if (lua_istable(L, envtab)) {
+        inherit = lua_getfield(L, envtab, "inherit") == LUA_TBOOLEAN && lua_toboolean(L, -1) ? 1 : inherit;
+        lua_pop(L, 1);
+    }
+    if (inherit) {
+#ifdef _WIN32
+        return luaL_error(L, "inherited environment overlay is not supported on this platform");
+#else
+        spawn_param_env_overlay(L, params, lua_istable(L, envtab) ? envtab : 0,
+                                lua_istable(L, envtab + 1) ? envtab + 1 : 0, lua_istable(L, envtab + 2) ? envtab + 2 : 0);
+#endif
+    } else if (lua_istable(L, envtab)) {
+        lua_pushvalue(L, envtab);  /* cmd opts ... envtab addtab removetab envtab */
+        spawn_param_env(L, params);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 3); /* cmd opts ... */
+
+#ifndef _WIN32
+    // listen_fds = true - pass fds with the socket activation protocol (LISTEN_FDS, LISTEN_PID)
+    lua_getfield(L, 2, "listen_fds"); /* cmd opts ... listen_fds */
+    if (lua_toboolean(L, -1)) {
+        // consumers take LISTEN_FDS fds starting at 3, a gap would hand them wrong or closed fds
+        for (int i = 0; i < params->fd_count; i++) {
+            if (params->fds[i].target != 3 + i) {
+                return luaL_error(L, "bad listen_fds option (fds have to be passed as 3 to %d without gaps)",
+                                  3 + params->fd_count - 1);
+            }
+        }
+        params->listen_fds = 1;
+        spawn_param_listen_env(L, params);
+    }
+    lua_pop(L, 1); /* cmd opts ... */
+#endif
     return 0;
 }
 
 /* filename [args, opts] -- proc/nil error */
 /* args-opts -- proc/nil error */
-static int
+int
 eli_spawn(lua_State* L) {
     spawn_params* params;
     process_group* pg = NULL;
     int have_options;
     switch (lua_type(L, 1)) {
         default: return luaL_typeerror(L, 1, "string or table");
+        case LUA_TUSERDATA: // pinned executable
         case LUA_TSTRING:
             switch (lua_type(L, 2)) {
                 default: return luaL_typeerror(L, 2, "table");
@@ -298,7 +1032,7 @@ eli_spawn(lua_State* L) {
                 }
                 lua_rawseti(L, 2, n); /* cmd opts ... */
             }
-            if (lua_type(L, 1) != LUA_TSTRING) {
+            if (lua_type(L, 1) != LUA_TSTRING && check_pinned(L, 1) == NULL) {
                 return luaL_error(L, "bad command option (string expected, got %s)", luaL_typename(L, 1));
             }
             break;
@@ -306,61 +1040,18 @@ eli_spawn(lua_State* L) {
 
     params = spawn_param_init(L);
     /* get filename to execute */
-    spawn_param_filename(params, lua_tostring(L, 1));
+    set_spawn_command(L, 1, params);
     /* get arguments, environment, and redirections */
     if (have_options) {
-        // new process_group
-        lua_getfield(L, 2, "create_process_group"); /* cmd opts ... create_process_group */
-        if (lua_isboolean(L, -1) && lua_toboolean(L, -1)) {
-            params->create_process_group = 1;
-        }
-        lua_pop(L, 1); /* cmd opts ... */
-
-        lua_getfield(L, 2, "username"); /* cmd opts ... create_process_group */
-        if (lua_type(L, -1) == LUA_TSTRING) {
-            params->username = lua_tostring(L, -1);
-        }
-        lua_pop(L, 1); /* cmd opts ... */
-
-        lua_getfield(L, 2, "password"); /* cmd opts ... create_process_group */
-        if (lua_type(L, -1) == LUA_TSTRING) {
-            params->password = lua_tostring(L, -1);
-        }
-        lua_pop(L, 1); /* cmd opts ... */
-
-        // options
-        lua_getfield(L, 2, "args"); /* cmd opts ... argtab */
-        switch (lua_type(L, -1)) {
-            default: return luaL_error(L, "bad args option (table expected, got %s)", luaL_typename(L, -1));
-            case LUA_TNIL:
-                lua_pop(L, 1);       /* cmd opts ... */
-                lua_pushvalue(L, 2); /* cmd opts ... opts */
-                                     /*FALLTHRU*/
-            case LUA_TTABLE:
-                if (lua_rawlen(L, 2) > 0) {
-                    return luaL_error(L, "cannot specify both the args option and array values");
-                }
-                spawn_param_args(L, params); /* cmd opts ... */
-                break;
-        }
-        lua_pop(L, 1); /* cmd opts ... */
-
-        // env
-        lua_getfield(L, 2, "env"); /* cmd opts ... envtab */
-        switch (lua_type(L, -1)) {
-            default: return luaL_error(L, "bad env option (table expected, got %s)", luaL_typename(L, -1));
-            case LUA_TNIL: break;
-            case LUA_TTABLE:
-                spawn_param_env(L, params);
-                /* cmd opts ... */
-                break;
-        }
-        lua_pop(L, 1);
+        setup_spawn_options(L, params); /* cmd opts ... */
     }
+    SPAWN_TIMING_MARK(params, SPAWN_PHASE_OPTIONS);
     int err_count = setup_redirects(L, 2, params); /* cmd opts ... */
     if (err_count > 0) {
+        spawn_param_close_stdio(params);
         return err_count;
     }
+    SPAWN_TIMING_MARK(params, SPAWN_PHASE_REDIRECTS);
     // keep just params and process group at the stack
     lua_getfield(L, 2, "process_group"); /* -> cmd opts params process_group/nil */
     lua_rotate(L, 1, 2);                 /* -> params process_group/nil cmd opts */
@@ -368,6 +1059,100 @@ eli_spawn(lua_State* L) {
     return spawn_param_execute(L);       /* proc/nil error */
 }
 
+/*
+** ... nil error [errno [details]] -- ... nil error {proc...} details; one shape whichever step failed, details
+** are those of proc.spawn or just {errno} when stdio of the child could not be set up
+*/
+static int
+spawn_many_failure(lua_State* L, int procs, int n) {
+    int first = lua_gettop(L) - n + 1;
+    lua_pushnil(L);
+    lua_pushvalue(L, first + 1);
+    lua_pushvalue(L, procs);
+    if (n >= 4 && lua_istable(L, first + 3)) {
+        lua_pushvalue(L, first + 3);
+    } else {
+        lua_createtable(L, 0, 1);
+        if (n >= 3) {
+            lua_pushvalue(L, first + 2);
+            lua_setfield(L, -2, "errno");
+        }
+    }
+    return 4;
+}
+
+/* cmd opts count/{args...} -- {proc...}/nil error {proc...} details */
+/* options are parsed once, each child gets its own stdio channels, children spawned before a failure are kept */
+static int
+eli_spawn_many(lua_State* L) {
+    if (check_pinned(L, 1) == NULL) {
+        luaL_checkstring(L, 1);
+    }
+    if (lua_isnoneornil(L, 2)) {
+        lua_settop(L, 1);
+        lua_newtable(L);
+    }
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int overrides = lua_type(L, 3) == LUA_TTABLE;
+    lua_Integer count = overrides ? (lua_Integer)lua_rawlen(L, 3) : luaL_checkinteger(L, 3);
+    luaL_argcheck(L, count >= 0, 3, "count must not be negative");
+    lua_settop(L, 3);
+
+    spawn_params* params = spawn_param_init(L); /* cmd opts count params */
+    set_spawn_command(L, 1, params);
+    setup_spawn_options(L, params);
+#ifdef _WIN32
+    int have_args = params->cmdline != NULL;
+#else
+    int have_args = params->argv != NULL;
+#endif
+    if (!have_args && !overrides) {
+        lua_newtable(L);
+        spawn_param_args_pinned(L, params); /* cmd opts count params argtab vector */
+    }
+    // one group shared by all children, created together with the first one
+    int shared_group = params->create_process_group;
+    params->create_process_group = 0;
+    lua_getfield(L, 2, "process_group"); /* ... group/nil */
+    int group = lua_gettop(L);
+    lua_createtable(L, (int)count, 0); /* ... group/nil procs */
+    int procs = lua_gettop(L);
+
+    for (lua_Integer i = 1; i <= count; i++) {
+        if (overrides) {
+            if (lua_rawgeti(L, 3, i) != LUA_TTABLE) {
+                return luaL_error(L, "bad args override %d (table expected, got %s)", (int)i, luaL_typename(L, -1));
+            }
+            spawn_param_args_pinned(L, params); /* ... procs argtab vector */
+        }
+        SPAWN_TIMING_MARK(params, SPAWN_PHASE_OPTIONS);
+        int err_count = setup_redirects(L, 2, params);
+        if (err_count > 0) {
+            spawn_param_close_stdio(params);
+            return spawn_many_failure(L, procs, err_count);
+        }
+        SPAWN_TIMING_MARK(params, SPAWN_PHASE_REDIRECTS);
+        params->create_process_group = shared_group && i == 1;
+        int base = lua_gettop(L);
+        lua_pushcfunction(L, spawn_param_execute);
+        lua_pushvalue(L, 4); // params
+        lua_pushvalue(L, group);
+        lua_call(L, 2, LUA_MULTRET); /* ... proc/nil error errno details */
+        if (lua_isnil(L, base + 1)) {
+            return spawn_many_failure(L, procs, lua_gettop(L) - base);
+        }
+        lua_settop(L, base + 1);
+        if (params->create_process_group) {
+            lua_getiuservalue(L, -1, 1); // new process group
+            lua_replace(L, group);
+        }
+        lua_rawseti(L, procs, i);
+        lua_settop(L, procs);
+        spawn_timing_start(&params->timing, L); // options are parsed only once, next child starts with redirects
+    }
+    return 1;
+}
+
 static int
 eli_get_process_by_id(lua_State* L) {
     int pid = luaL_checkinteger(L, 1);
@@ -379,6 +1164,11 @@ eli_get_process_by_id(lua_State* L) {
     lua_setmetatable(L, -2);
 
     memset(p->stdio, 0, sizeof(p->stdio)); // zero out stdio
+    memset(&p->timing, 0, sizeof(p->timing));
+#ifndef _WIN32
+    p->pidfd = -1;
+    process_deadline_init(p);
+#endif
 
     // if second argument is a table, check options for - assume process group
     if (lua_type(L, 2) == LUA_TTABLE) {                     // pid options process
@@ -415,22 +1205,159 @@ eli_get_process_by_id(lua_State* L) {
     if (kill(pid, 0) == -1) {
         return push_error(L, "failed to open process");
     }
-    p->pid = pid;
+    process_attach(p, pid);
 #endif
 
     return 1;
 }
 
+/* [servers] -- true/nil error */
+/* servers - helpers serving spawns in parallel (1-64), one per core up to 8 by default */
+static int
+eli_start_spawn_server(lua_State* L) {
+#ifdef _WIN32
+    return push_error(L, "spawn server is not supported on this platform");
+#else
+    lua_Integer servers = luaL_optinteger(L, 1, 0);
+    luaL_argcheck(L, lua_isnoneornil(L, 1) || (servers >= 1 && servers <= 64), 1, "server count out of range");
+    if (spawn_server_start((int)servers) == -1) {
+        return push_error(L, NULL);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+#endif
+}
+
+/* enabled -- true/nil error */
+/* as subreaper orphaned descendants are re-parented to us, collect them with proc.reap_orphans (see there) */
+static int
+eli_set_subreaper(lua_State* L) {
+#ifdef __linux__
+    if (prctl(PR_SET_CHILD_SUBREAPER, lua_toboolean(L, 1) ? 1 : 0) != 0) {
+        return push_error(L, NULL);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+#else
+    return push_error(L, "subreaper is not supported on this platform");
+#endif
+}
+
+/* [backend] -- backend/nil error */
+/* backend ("auto", "io_uring", "epoll") of event engines used by pools and event loops created afterwards */
+static int
+eli_event_engine(lua_State* L) {
+#ifdef _WIN32
+    return push_error(L, "event engine is not supported on this platform");
+#else
+    if (!lua_isnoneornil(L, 1)) {
+        static const char* const backends[] = {"auto", "epoll", "io_uring", NULL};
+        int backend = luaL_checkoption(L, 1, NULL, backends); // indexes match EVENT_ENGINE_* values
+        if (event_engine_set_default_backend(backend) == -1) {
+            return push_error(L, NULL);
+        }
+    }
+    lua_pushstring(L, event_engine_backend_name(event_engine_default_backend()));
+    return 1;
+#endif
+}
+
+/* -- true */
+static int
+eli_stop_spawn_server(lua_State* L) {
+#ifndef _WIN32
+    spawn_server_stop();
+#endif
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* -- "running"/"stopped"/"lost" [error] */
+/* lost - a spawn found the server gone (killed from outside), spawns fork directly until it is started again */
+static int
+eli_spawn_server_status(lua_State* L) {
+#ifdef _WIN32
+    lua_pushstring(L, "stopped");
+    return 1;
+#else
+    static const char* const states[] = {"running", "stopped", "lost"}; // indexes match SPAWN_SERVER_* values
+    int err;
+    int status = spawn_server_status(&err);
+    lua_pushstring(L, states[status]);
+    if (status != SPAWN_SERVER_LOST) {
+        return 1;
+    }
+    lua_pushstring(L, strerror(err));
+    return 2;
+#endif
+}
+
 static const struct luaL_Reg eliProcExtra[] = {
     {"spawn", eli_spawn},
+    {"spawn_many", eli_spawn_many},
     {"get_by_pid", eli_get_process_by_id},
+    {"wait_any", process_wait_any},
+    {"list", proc_list},
+    {"snapshot", proc_snapshot_new},
+    {"pool", process_pool_new},
+    {"channel", proc_channel_new},
+    {"pin", proc_pin},
+    {"start_spawn_server", eli_start_spawn_server},
+    {"stop_spawn_server", eli_stop_spawn_server},
+    {"spawn_server_status", eli_spawn_server_status},
+    {"set_subreaper", eli_set_subreaper},
+    {"reap_orphans", proc_reap_orphans},
+    {"exec_async", proc_exec_async},
+    {"stats", proc_stats},
+    {"stats_reset", proc_stats_reset},
+    {"stats_enable", proc_stats_enable},
+    {"usage", proc_usage},
+    {"event_loop", process_loop_new},
+    {"event_engine", eli_event_engine},
     {NULL, NULL},
 };
 
+#define PROC_LIBRARY_SENTINEL "ELI_PROC_EXTRA_SENTINEL"
+
+/* collected when the Lua state closes, after objects of the library, before the library is unloaded */
+static int
+proc_library_gc(lua_State* L) {
+    (void)L;
+#ifndef _WIN32
+    stdio_pump_close(); // pump thread must not outlive the code it runs
+#endif
+    return 0;
+}
+
+/* one sentinel per Lua state, it holds a reference to background threads of the library */
+static void
+proc_library_sentinel(lua_State* L) {
+    if (lua_getfield(L, LUA_REGISTRYINDEX, PROC_LIBRARY_SENTINEL) != LUA_TNIL) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+#ifndef _WIN32
+    stdio_pump_open();
+#endif
+    lua_newuserdatauv(L, 0, 0);
+    lua_newtable(L);
+    lua_pushcfunction(L, proc_library_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, LUA_REGISTRYINDEX, PROC_LIBRARY_SENTINEL);
+}
+
 int
 luaopen_eli_proc_extra(lua_State* L) {
+    proc_library_sentinel(L);
     process_create_meta(L);
     process_group_create_meta(L);
+    proc_snapshot_create_meta(L);
+    process_pool_create_meta(L);
+    process_loop_create_meta(L);
+    proc_channel_create_meta(L);
+    proc_executable_create_meta(L);
 
     lua_newtable(L);
     luaL_setfuncs(L, eliProcExtra, 0);
@@ -1,3 +1,4 @@
 #include "lua.h"
 
+int eli_spawn(lua_State* L);
 int luaopen_eli_proc_extra(lua_State* L);
@@ -0,0 +1,207 @@
+#include "lproc_channel.h"
+#include <string.h>
+#include "lauxlib.h"
+#include "lerror.h"
+#include "lsleep.h"
+#include "lua.h"
+
+#ifdef __linux__
+#include "proc_channel.h"
+
+#define CHANNEL_DEFAULT_CAPACITY (1 << 20)
+
+static proc_channel*
+check_channel(lua_State* L, int idx) {
+    proc_channel* ch = luaL_checkudata(L, idx, PROC_CHANNEL_METATABLE);
+    if (ch->shared == NULL) {
+        luaL_error(L, "channel is closed");
+    }
+    return ch;
+}
+
+/* ch message... or ch {message...} -- count/nil error */
+static int
+channel_send(lua_State* L) {
+    proc_channel* ch = check_channel(L, 1);
+    int is_table = lua_istable(L, 2);
+    lua_Integer count = is_table ? (lua_Integer)lua_rawlen(L, 2) : lua_gettop(L) - 1;
+    for (lua_Integer i = 1; i <= count; i++) {
+        size_t len;
+        const char* msg;
+        if (is_table) {
+            lua_rawgeti(L, 2, i);
+            msg = luaL_checklstring(L, -1, &len);
+        } else {
+            msg = luaL_checklstring(L, (int)i + 1, &len);
+        }
+        if (len > proc_channel_max_message(ch)) {
+            return luaL_error(L, "message %d is too large for channel (%d bytes max)", (int)i,
+                              (int)proc_channel_max_message(ch));
+        }
+        while (proc_channel_write(ch, msg, (uint32_t)len) == 0) { // full, publish batch and wait for reader
+            proc_channel_flush(ch);
+            int res = proc_channel_wait(ch, 1, (uint32_t)len, -1);
+            if (res == -1) {
+                return push_error(L, NULL);
+            }
+            if (res == 0) {
+                proc_channel_flush(ch);
+                return push_error(L, "channel closed");
+            }
+        }
+        if (is_table) {
+            lua_pop(L, 1);
+        }
+    }
+    proc_channel_flush(ch);
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+/* ch max -- messages; reads up to max (0 - all) available messages into table */
+static int
+channel_collect(lua_State* L, proc_channel* ch, lua_Integer max) {
+    lua_newtable(L);
+    lua_Integer n = 0;
+    int64_t len = 0;
+    while ((max <= 0 || n < max) && (len = proc_channel_next_size(ch)) >= 0) {
+        luaL_Buffer b;
+        char* buf = luaL_buffinitsize(L, &b, (size_t)len);
+        proc_channel_read(ch, buf, (uint32_t)len);
+        luaL_pushresultsize(&b, (size_t)len);
+        lua_rawseti(L, -2, ++n);
+    }
+    proc_channel_release(ch);
+    if (len == PROC_CHANNEL_CORRUPT && n == 0) { // messages read before it are returned first
+        lua_pop(L, 1);
+        return push_error(L, "channel corrupted (malformed message length)");
+    }
+    return 1;
+}
+
+/*
+** ch [max] [timeout, unit] -- messages/nil error; waits for at least one message (no timeout - until peer closes
+** channel or its process exits)
+*/
+static int
+channel_recv(lua_State* L) {
+    proc_channel* ch = check_channel(L, 1);
+    lua_Integer max = luaL_optinteger(L, 2, 0);
+    int duration = (int)luaL_optnumber(L, 3, 0);
+    double divider = get_ms_divider_from_state(L, 4, 1.0);
+    if (proc_channel_next_size(ch) == -1) {
+        int res = proc_channel_wait(ch, 0, 0, duration > 0 ? (int)(duration / divider) : -1);
+        if (res == -1) {
+            return push_error(L, NULL);
+        }
+        if (res == 0 && proc_channel_peer_closed(ch) && proc_channel_next_size(ch) == -1) {
+            return push_error(L, "channel closed");
+        }
+    }
+    return channel_collect(L, ch, max);
+}
+
+/* ch [max] -- messages; does not block */
+static int
+channel_try_recv(lua_State* L) {
+    proc_channel* ch = check_channel(L, 1);
+    return channel_collect(L, ch, luaL_optinteger(L, 2, 0));
+}
+
+/* ch [first] -- fds; table for fds spawn option, child attaches with proc_channel_attach(first, first + 1, first + 2) */
+static int
+channel_fds(lua_State* L) {
+    proc_channel* ch = check_channel(L, 1);
+    lua_Integer first = luaL_optinteger(L, 2, 3);
+    lua_newtable(L);
+    lua_pushinteger(L, ch->memfd);
+    lua_rawseti(L, -2, first);
+    lua_pushinteger(L, ch->peer_wake_fd); // child sleeps on
+    lua_rawseti(L, -2, first + 1);
+    lua_pushinteger(L, ch->wake_fd); // child wakes parent through
+    lua_rawseti(L, -2, first + 2);
+    return 1;
+}
+
+static int
+channel_capacity(lua_State* L) {
+    proc_channel* ch = check_channel(L, 1);
+    lua_pushinteger(L, ch->mask + 1);
+    return 1;
+}
+
+static int
+channel_close(lua_State* L) {
+    proc_channel* ch = luaL_checkudata(L, 1, PROC_CHANNEL_METATABLE);
+    proc_channel_close(ch);
+    return 0;
+}
+
+static int
+channel_tostring(lua_State* L) {
+    proc_channel* ch = luaL_checkudata(L, 1, PROC_CHANNEL_METATABLE);
+    if (ch->shared == NULL) {
+        lua_pushliteral(L, "process channel (closed)");
+    } else {
+        lua_pushfstring(L, "process channel (%d bytes)", (int)(ch->mask + 1));
+    }
+    return 1;
+}
+#endif
+
+/* [capacity] -- channel/nil error */
+int
+proc_channel_new(lua_State* L) {
+#ifndef __linux__
+    return push_error(L, "process channel is not supported on this platform");
+#else
+    lua_Integer capacity = luaL_optinteger(L, 1, CHANNEL_DEFAULT_CAPACITY);
+    luaL_argcheck(L, capacity > 0 && capacity <= (1 << 30), 1, "capacity out of range");
+    proc_channel* ch = lua_newuserdatauv(L, sizeof(proc_channel), 0);
+    memset(ch, 0, sizeof(proc_channel));
+    ch->memfd = ch->wake_fd = ch->peer_wake_fd = -1;
+    luaL_getmetatable(L, PROC_CHANNEL_METATABLE);
+    lua_setmetatable(L, -2);
+    if (proc_channel_create(ch, (uint32_t)capacity) == -1) {
+        return push_error(L, NULL);
+    }
+    return 1;
+#endif
+}
+
+/*
+** Creates process channel metatable.
+*/
+int
+proc_channel_create_meta(lua_State* L) {
+    luaL_newmetatable(L, PROC_CHANNEL_METATABLE);
+#ifdef __linux__
+    /* Method table */
+    lua_newtable(L);
+    lua_pushcfunction(L, channel_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, channel_send);
+    lua_setfield(L, -2, "send");
+    lua_pushcfunction(L, channel_recv);
+    lua_setfield(L, -2, "recv");
+    lua_pushcfunction(L, channel_try_recv);
+    lua_setfield(L, -2, "try_recv");
+    lua_pushcfunction(L, channel_fds);
+    lua_setfield(L, -2, "fds");
+    lua_pushcfunction(L, channel_capacity);
+    lua_setfield(L, -2, "capacity");
+    lua_pushcfunction(L, channel_close);
+    lua_setfield(L, -2, "close");
+
+    lua_pushstring(L, PROC_CHANNEL_METATABLE);
+    lua_setfield(L, -2, "__type");
+    /* Metamethods */
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, channel_close);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, channel_close);
+    lua_setfield(L, -2, "__close");
+#endif
+    return 1;
+}
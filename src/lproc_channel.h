@@ -0,0 +1,9 @@
+#ifndef ELI_PROC_CHANNEL_LUA_H_
+#define ELI_PROC_CHANNEL_LUA_H_
+#include "lua.h"
+
+#define PROC_CHANNEL_METATABLE "ELI_PROCESS_CHANNEL"
+
+int proc_channel_new(lua_State* L);
+int proc_channel_create_meta(lua_State* L);
+#endif
@@ -0,0 +1,155 @@
+#include "lproc_executable.h"
+#include <string.h>
+#include "lauxlib.h"
+#include "lerror.h"
+#include "lua.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "execve_spawnp.h"
+
+#ifndef O_PATH
+#define O_PATH 010000000
+#endif
+
+/* opens candidate if it is an executable regular file, -1 with errno otherwise */
+static int
+open_executable(const char* path) {
+    if (access(path, X_OK) == -1) {
+        return -1;
+    }
+    int fd = open(path, O_PATH | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = EACCES; // what exec would report
+        return -1;
+    }
+    return fd;
+}
+
+static int
+executable_path(lua_State* L) {
+    proc_executable* e = luaL_checkudata(L, 1, PROC_EXECUTABLE_METATABLE);
+    lua_pushstring(L, e->path);
+    return 1;
+}
+
+static int
+executable_fd(lua_State* L) {
+    proc_executable* e = luaL_checkudata(L, 1, PROC_EXECUTABLE_METATABLE);
+    lua_pushinteger(L, e->fd);
+    return 1;
+}
+
+static int
+executable_close(lua_State* L) {
+    proc_executable* e = luaL_checkudata(L, 1, PROC_EXECUTABLE_METATABLE);
+    if (e->fd != -1) {
+        close(e->fd);
+        e->fd = -1;
+    }
+    return 0;
+}
+
+static int
+executable_tostring(lua_State* L) {
+    proc_executable* e = luaL_checkudata(L, 1, PROC_EXECUTABLE_METATABLE);
+    lua_pushfstring(L, "pinned executable (%s%s)", e->path, e->fd == -1 ? ", closed" : "");
+    return 1;
+}
+#endif
+
+/* command -- executable/nil error; resolves command through PATH like spawn does */
+int
+proc_pin(lua_State* L) {
+#ifndef __linux__
+    return push_error(L, "pinned executables are not supported on this platform");
+#else
+    const char* command = luaL_checkstring(L, 1);
+    // collectable before anything is opened, its __gc closes fd whatever raises later
+    proc_executable* e = lua_newuserdatauv(L, sizeof(proc_executable), 1);
+    e->fd = -1;
+    e->path = "";
+    luaL_getmetatable(L, PROC_EXECUTABLE_METATABLE);
+    lua_setmetatable(L, -2);
+
+    execve_path path;
+    if (execve_path_prepare(&path, command) == -1) {
+        return push_error(L, NULL);
+    }
+    int fd = -1;
+    const char* resolved = command;
+    if (path.error != 0) {
+        errno = path.error;
+    } else if (path.candidates == NULL) {
+        fd = open_executable(command);
+    } else {
+        int seen_eacces = 0;
+        errno = ENOENT;
+        for (char** c = path.candidates; *c != NULL && fd == -1; c++) {
+            fd = open_executable(*c);
+            if (fd != -1) {
+                resolved = *c;
+            } else if (errno == EACCES) {
+                seen_eacces = 1;
+            }
+        }
+        if (fd == -1 && seen_eacces) {
+            errno = EACCES;
+        }
+    }
+    if (fd == -1) {
+        int err = errno;
+        execve_path_free(&path);
+        errno = err;
+        return push_error(L, NULL);
+    }
+    e->fd = fd;
+    // opened path is shorter than PATH_MAX, copied so candidates are freed before Lua may raise
+    char copy[PATH_MAX];
+    snprintf(copy, sizeof(copy), "%s", resolved);
+    execve_path_free(&path);
+
+    e->path = lua_pushstring(L, copy);
+    lua_setiuservalue(L, -2, 1);
+    return 1;
+#endif
+}
+
+/*
+** Creates pinned executable metatable.
+*/
+int
+proc_executable_create_meta(lua_State* L) {
+    luaL_newmetatable(L, PROC_EXECUTABLE_METATABLE);
+#ifdef __linux__
+    /* Method table */
+    lua_newtable(L);
+    lua_pushcfunction(L, executable_path);
+    lua_setfield(L, -2, "path");
+    lua_pushcfunction(L, executable_fd);
+    lua_setfield(L, -2, "fd");
+    lua_pushcfunction(L, executable_close);
+    lua_setfield(L, -2, "close");
+
+    lua_pushstring(L, PROC_EXECUTABLE_METATABLE);
+    lua_setfield(L, -2, "__type");
+    /* Metamethods */
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, executable_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, executable_close);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, executable_close);
+    lua_setfield(L, -2, "__close");
+#endif
+    return 1;
+}
@@ -0,0 +1,15 @@
+#ifndef ELI_PROC_EXECUTABLE_H_
+#define ELI_PROC_EXECUTABLE_H_
+#include "lua.h"
+
+#define PROC_EXECUTABLE_METATABLE "ELI_PROCESS_EXECUTABLE"
+
+/* executable resolved once and held open (O_PATH), spawned through execveat without PATH search */
+typedef struct proc_executable {
+    int fd;           // -1 once closed
+    const char* path; // resolved path, anchored in user value
+} proc_executable;
+
+int proc_pin(lua_State* L);
+int proc_executable_create_meta(lua_State* L);
+#endif
@@ -0,0 +1,435 @@
+#include "lproc_list.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lauxlib.h"
+#include "lerror.h"
+#include "lprocess.h"
+#include "lprocess_group.h"
+#include "lua.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "proc_scan.h"
+#include "spawn_server.h"
+
+#define PROC_SCAN_METATABLE "ELI_PROC_SCAN"
+#define ORPHAN_MAX_DEPTH    64
+
+/*
+** Descendants of spawned children seen by the scanner while we are a subreaper, and members of process groups
+** created by spawns (recorded at spawn time, so orphans which exit before any scan are known too). Only these
+** are reaped by default, other children of the host (io.popen, ...) belong to whoever waits for them.
+** Both lists are sorted for binary search.
+*/
+typedef struct orphan_candidate {
+    pid_t pid;
+    unsigned long long start_time; // tells reused pids apart
+} orphan_candidate;
+
+static pthread_mutex_t candidatesLock = PTHREAD_MUTEX_INITIALIZER;
+static orphan_candidate* candidates = NULL;
+static size_t candidateCount = 0;
+static size_t candidateCapacity = 0;
+static pid_t* spawnGroups = NULL; // dropped once a scan finds no member
+static size_t spawnGroupCount = 0;
+static size_t spawnGroupCapacity = 0;
+
+typedef struct proc_list_filter {
+    pid_t ppid, pgid;
+    const char* state;
+    const char* comm;
+} proc_list_filter;
+
+static int
+proc_scan_gc(lua_State* L) {
+    proc_scan* scan = luaL_checkudata(L, 1, PROC_SCAN_METATABLE);
+    proc_scan_free(scan);
+    return 0;
+}
+
+/* scanner (and its buffers) is allocated once per lua state and reused */
+static proc_scan*
+get_scanner(lua_State* L) {
+    static const char scanKey = 0;
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &scanKey) == LUA_TUSERDATA) {
+        proc_scan* scan = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return scan;
+    }
+    lua_pop(L, 1);
+    proc_scan* scan = lua_newuserdatauv(L, sizeof(proc_scan), 0);
+    if (proc_scan_init(scan) == -1) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    if (luaL_newmetatable(L, PROC_SCAN_METATABLE)) {
+        lua_pushcfunction(L, proc_scan_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &scanKey);
+    return scan;
+}
+
+static int
+filter_matches(proc_list_filter* filter, proc_entry* entry) {
+    return (filter->ppid == -1 || filter->ppid == entry->ppid) && (filter->pgid == -1 || filter->pgid == entry->pgid)
+        && (filter->state == NULL || strchr(filter->state, entry->state) != NULL)
+        && (filter->comm == NULL || strcmp(filter->comm, entry->comm) == 0);
+}
+
+/* pushes { n, pids = {}, ppids = {}, pgids = {}, states = {}, comms = {} } */
+static void
+push_entries(lua_State* L, proc_scan* scan, size_t* indexes, size_t count) {
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, (lua_Integer)count);
+    lua_setfield(L, -2, "n");
+    static const char* fields[] = {"pids", "ppids", "pgids", "states", "comms"};
+    for (int f = 0; f < 5; f++) {
+        lua_createtable(L, (int)count, 0);
+        for (size_t i = 0; i < count; i++) {
+            proc_entry* entry = &scan->entries[indexes[i]];
+            switch (f) {
+                case 0: lua_pushinteger(L, entry->pid); break;
+                case 1: lua_pushinteger(L, entry->ppid); break;
+                case 2: lua_pushinteger(L, entry->pgid); break;
+                case 3: lua_pushlstring(L, &entry->state, 1); break;
+                case 4: lua_pushstring(L, entry->comm); break;
+            }
+            lua_rawseti(L, -2, (lua_Integer)i + 1);
+        }
+        lua_setfield(L, -2, fields[f]);
+    }
+}
+
+/* pushes process group of attached processes, members are signaled one by one */
+static void
+push_entries_group(lua_State* L, proc_scan* scan, size_t* indexes, size_t count) {
+    new_process_group(L, (pid_t)-1); // process_group
+    lua_getiuservalue(L, -1, 1);     // process_group process_table
+    for (size_t i = 0; i < count; i++) {
+        process* p = lua_newuserdatauv(L, sizeof(process), 1); // process_group process_table process
+        memset(p, 0, sizeof(process));
+        luaL_getmetatable(L, PROCESS_METATABLE);
+        lua_setmetatable(L, -2);
+        p->status = -1;
+        p->pidfd = -1;
+        process_attach(p, scan->entries[indexes[i]].pid);
+        lua_pushvalue(L, -3);                   // process_group process_table process process_group
+        lua_setiuservalue(L, -2, 1);            // process_group process_table process
+        lua_rawseti(L, -2, (lua_Integer)i + 1); // process_group process_table
+    }
+    lua_pop(L, 1); // process_group
+}
+#endif
+
+/* [filter] -- {pids, ppids, pgids, states, comms}/nil error */
+int
+proc_list(lua_State* L) {
+#ifdef __linux__
+    proc_list_filter filter = {-1, -1, NULL, NULL};
+    if (lua_type(L, 1) == LUA_TTABLE) {
+        if (lua_getfield(L, 1, "ppid") != LUA_TNIL) {
+            filter.ppid = (pid_t)luaL_checkinteger(L, -1);
+        }
+        if (lua_getfield(L, 1, "pgid") != LUA_TNIL) {
+            filter.pgid = (pid_t)luaL_checkinteger(L, -1);
+        }
+        if (lua_getfield(L, 1, "state") != LUA_TNIL) {
+            filter.state = luaL_checkstring(L, -1);
+        }
+        if (lua_getfield(L, 1, "comm") != LUA_TNIL) {
+            filter.comm = luaL_checkstring(L, -1);
+        }
+        lua_pop(L, 4); // strings stay referenced by the filter table
+    } else if (!lua_isnoneornil(L, 1)) {
+        return luaL_typeerror(L, 1, "table");
+    }
+
+    proc_scan* scan = get_scanner(L);
+    if (scan == NULL || proc_scan_run(scan) == -1) {
+        return push_error(L, NULL);
+    }
+    size_t* indexes = lua_newuserdatauv(L, (scan->count + 1) * sizeof(size_t), 0);
+    size_t count = 0;
+    for (size_t i = 0; i < scan->count; i++) {
+        if (filter_matches(&filter, &scan->entries[i])) {
+            indexes[count++] = i;
+        }
+    }
+    push_entries(L, scan, indexes, count);
+    return 1;
+#else
+    return push_error(L, "process listing is not supported on this platform");
+#endif
+}
+
+#ifdef __linux__
+/* whether entry descends from a process spawned (and tracked) by us */
+static int
+is_spawned_descendant(proc_scan* scan, proc_entry* entry, pid_t self) {
+    pid_t ppid = entry->ppid;
+    for (int depth = 0; depth < ORPHAN_MAX_DEPTH && ppid > 1 && ppid != self; depth++) {
+        if (process_is_tracked(ppid)) {
+            return 1;
+        }
+        proc_entry* parent = proc_scan_find(scan, ppid);
+        if (parent == NULL) {
+            return 0;
+        }
+        ppid = parent->ppid;
+    }
+    return 0;
+}
+
+static int
+compare_candidates(const void* a, const void* b) {
+    const orphan_candidate* x = a;
+    const orphan_candidate* y = b;
+    if (x->pid != y->pid) {
+        return x->pid < y->pid ? -1 : 1;
+    }
+    return x->start_time < y->start_time ? -1 : x->start_time > y->start_time;
+}
+
+static int
+compare_pids(const void* a, const void* b) {
+    pid_t x = *(const pid_t*)a;
+    pid_t y = *(const pid_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* expects candidatesLock held */
+static int
+is_candidate(proc_entry* entry) {
+    orphan_candidate key = {entry->pid, entry->start_time};
+    return bsearch(&key, candidates, candidateCount, sizeof(orphan_candidate), compare_candidates) != NULL;
+}
+
+/* expects candidatesLock held */
+static int
+is_spawn_group(pid_t pgid) {
+    return bsearch(&pgid, spawnGroups, spawnGroupCount, sizeof(pid_t), compare_pids) != NULL;
+}
+
+/* records process group created by a spawn, only as subreaper */
+void
+proc_orphan_group_record(pid_t pgid) {
+    int subreaper = 0;
+    if (prctl(PR_GET_CHILD_SUBREAPER, &subreaper) != 0 || !subreaper) {
+        return;
+    }
+    pthread_mutex_lock(&candidatesLock);
+    size_t at = 0;
+    while (at < spawnGroupCount && spawnGroups[at] < pgid) { // binary search is not worth it for inserts
+        at++;
+    }
+    if (at < spawnGroupCount && spawnGroups[at] == pgid) {
+        pthread_mutex_unlock(&candidatesLock);
+        return;
+    }
+    if (spawnGroupCount == spawnGroupCapacity) {
+        size_t capacity = spawnGroupCapacity == 0 ? 64 : spawnGroupCapacity * 2;
+        pid_t* grown = realloc(spawnGroups, capacity * sizeof(pid_t));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&candidatesLock);
+            return; // members can still be recorded by scans or reaped with explicit pids
+        }
+        spawnGroups = grown;
+        spawnGroupCapacity = capacity;
+    }
+    memmove(&spawnGroups[at + 1], &spawnGroups[at], (spawnGroupCount - at) * sizeof(pid_t));
+    spawnGroups[at] = pgid;
+    spawnGroupCount++;
+    pthread_mutex_unlock(&candidatesLock);
+}
+
+/* expects candidatesLock held, drops groups without members in scan */
+static void
+prune_spawn_groups(proc_scan* scan) {
+    if (spawnGroupCount == 0) {
+        return;
+    }
+    unsigned char* seen = calloc(spawnGroupCount, 1);
+    if (seen == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < scan->count; i++) {
+        pid_t* group = bsearch(&scan->entries[i].pgid, spawnGroups, spawnGroupCount, sizeof(pid_t), compare_pids);
+        if (group != NULL) {
+            seen[group - spawnGroups] = 1;
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < spawnGroupCount; i++) {
+        if (seen[i]) {
+            spawnGroups[kept++] = spawnGroups[i];
+        }
+    }
+    spawnGroupCount = kept;
+    free(seen);
+}
+
+/* drops candidates which are gone and adds descendants of spawned children, only as subreaper */
+static void
+record_orphan_candidates(proc_scan* scan) {
+    int subreaper = 0;
+    if (prctl(PR_GET_CHILD_SUBREAPER, &subreaper) != 0 || !subreaper) {
+        return;
+    }
+    pid_t self = getpid();
+    pthread_mutex_lock(&candidatesLock);
+    prune_spawn_groups(scan);
+    size_t kept = 0;
+    for (size_t i = 0; i < candidateCount; i++) {
+        proc_entry* entry = proc_scan_find(scan, candidates[i].pid);
+        if (entry != NULL && entry->start_time == candidates[i].start_time) {
+            candidates[kept++] = candidates[i];
+        }
+    }
+    candidateCount = kept;
+    size_t sorted = candidateCount; // new ones are appended and sorted in at the end
+    for (size_t i = 0; i < scan->count; i++) {
+        proc_entry* entry = &scan->entries[i];
+        orphan_candidate key = {entry->pid, entry->start_time};
+        if (!is_spawned_descendant(scan, entry, self)
+            || bsearch(&key, candidates, sorted, sizeof(orphan_candidate), compare_candidates) != NULL) {
+            continue;
+        }
+        if (candidateCount == candidateCapacity) {
+            size_t capacity = candidateCapacity == 0 ? 64 : candidateCapacity * 2;
+            orphan_candidate* grown = realloc(candidates, capacity * sizeof(orphan_candidate));
+            if (grown == NULL) {
+                break; // missed ones can still be reaped with explicit pids
+            }
+            candidates = grown;
+            candidateCapacity = capacity;
+        }
+        candidates[candidateCount++] = key;
+    }
+    if (candidateCount > sorted) {
+        qsort(candidates, candidateCount, sizeof(orphan_candidate), compare_candidates);
+    }
+    pthread_mutex_unlock(&candidatesLock);
+}
+
+static int
+pid_listed(lua_State* L, int pids, pid_t pid) {
+    lua_Integer n = (lua_Integer)lua_rawlen(L, pids);
+    for (lua_Integer i = 1; i <= n; i++) {
+        lua_rawgeti(L, pids, i);
+        int match = lua_tointeger(L, -1) == pid;
+        lua_pop(L, 1);
+        if (match) {
+            return 1;
+        }
+    }
+    return 0;
+}
+#endif
+
+/* proc [recursive, options] -- {pids, ppids, pgids, states, comms}/process_group/nil error */
+int
+process_children(lua_State* L) {
+    process* p = luaL_checkudata(L, 1, PROCESS_METATABLE);
+#ifdef __linux__
+    int recursive = lua_toboolean(L, 2);
+    int as_group = 0;
+    if (lua_type(L, 3) == LUA_TTABLE) {
+        lua_getfield(L, 3, "as_group");
+        as_group = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+
+    proc_scan* scan = get_scanner(L);
+    if (scan == NULL || proc_scan_run(scan) == -1) {
+        return push_error(L, NULL);
+    }
+    record_orphan_candidates(scan);
+    size_t count;
+    size_t* indexes = lua_newuserdatauv(L, (scan->count + 1) * sizeof(size_t), 0); // collected if pushing raises
+    if (proc_scan_descendants(scan, p->pid, recursive, indexes, &count) == -1) {
+        return push_error(L, NULL);
+    }
+    if (as_group) {
+        push_entries_group(L, scan, indexes, count);
+    } else {
+        push_entries(L, scan, indexes, count);
+    }
+    return 1;
+#else
+    return push_error(L, "process listing is not supported on this platform");
+#endif
+}
+
+
+/* [options] -- {{pid, exitcode, signal}...}/nil error */
+/*
+** Reaps exited children which are not owned by any process object, i.e. orphans adopted as subreaper.
+** By default only members of process groups created by spawns (create_process_group) and descendants of
+** other spawned children seen by an earlier reap_orphans or process:children call are reaped, so call it
+** periodically or spawn with process groups. options.pids = {...} reaps listed pids, options.all = true
+** reaps every unowned child, including those of io.popen and other libraries, which then lose their
+** exit status (waitpid fails with ECHILD).
+*/
+int
+proc_reap_orphans(lua_State* L) {
+#ifdef __linux__
+    int all = 0, pids = 0;
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        lua_getfield(L, 1, "all");
+        all = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        if (lua_getfield(L, 1, "pids") == LUA_TTABLE) {
+            pids = lua_gettop(L);
+        } else if (!lua_isnil(L, -1)) {
+            return luaL_error(L, "bad pids option (table expected, got %s)", luaL_typename(L, -1));
+        }
+    }
+    proc_scan* scan = get_scanner(L);
+    if (scan == NULL || proc_scan_run(scan) == -1) {
+        return push_error(L, NULL);
+    }
+    record_orphan_candidates(scan);
+    pid_t self = getpid();
+    pid_t group = getpgrp(); // io.popen children share it, spawn groups never do
+    lua_newtable(L);
+    lua_Integer n = 0;
+    for (size_t i = 0; i < scan->count; i++) {
+        proc_entry* entry = &scan->entries[i];
+        if (entry->ppid != self || entry->state != 'Z' || process_is_tracked(entry->pid)
+            || spawn_server_is_server(entry->pid)) {
+            continue;
+        }
+        int owned = all || (pids != 0 && pid_listed(L, pids, entry->pid));
+        if (!owned) {
+            pthread_mutex_lock(&candidatesLock);
+            owned = is_candidate(entry) || (entry->pgid != group && is_spawn_group(entry->pgid));
+            pthread_mutex_unlock(&candidatesLock);
+        }
+        if (!owned) {
+            continue;
+        }
+        int status;
+        if (waitpid(entry->pid, &status, WNOHANG) <= 0) {
+            continue;
+        }
+        lua_createtable(L, 0, 3);
+        lua_pushinteger(L, entry->pid);
+        lua_setfield(L, -2, "pid");
+        int signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+        lua_pushinteger(L, WIFEXITED(status) ? WEXITSTATUS(status) : 255 + signal);
+        lua_setfield(L, -2, "exitcode");
+        lua_pushinteger(L, signal);
+        lua_setfield(L, -2, "signal");
+        lua_rawseti(L, -2, ++n);
+    }
+    return 1;
+#else
+    return push_error(L, "orphan reaping is not supported on this platform");
+#endif
+}
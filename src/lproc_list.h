@@ -0,0 +1,12 @@
+#ifndef ELI_PROC_LIST_H_
+#define ELI_PROC_LIST_H_
+#include "lua.h"
+
+int proc_list(lua_State* L);
+int process_children(lua_State* L);
+int proc_reap_orphans(lua_State* L);
+#ifdef __linux__
+#include <sys/types.h>
+void proc_orphan_group_record(pid_t pgid);
+#endif
+#endif
@@ -0,0 +1,213 @@
+#include "lproc_snapshot.h"
+#include <stdlib.h>
+#include <string.h>
+#include "lauxlib.h"
+#include "lerror.h"
+#include "lua.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#include "proc_scan.h"
+
+typedef struct proc_snapshot {
+    proc_scan scan;       // buffers for the next scan
+    proc_entry* previous; // last scan, sorted by pid
+    size_t previous_count;
+    size_t previous_capacity;
+    unsigned long long cpu_threshold; // clock ticks
+    long rss_threshold;               // pages
+} proc_snapshot;
+
+/* swaps scan buffer with the previous one, so steady state updates do not allocate */
+static void
+proc_snapshot_swap(proc_snapshot* s) {
+    proc_entry* entries = s->scan.entries;
+    size_t capacity = s->scan.capacity;
+    s->scan.entries = s->previous;
+    s->scan.capacity = s->previous_capacity;
+    s->previous = entries;
+    s->previous_capacity = capacity;
+    s->previous_count = s->scan.count;
+    s->scan.count = 0;
+}
+#endif
+
+/* [options] -- snapshot/nil error */
+int
+proc_snapshot_new(lua_State* L) {
+#ifdef __linux__
+    proc_snapshot* s = lua_newuserdatauv(L, sizeof(proc_snapshot), 0);
+    memset(s, 0, sizeof(proc_snapshot));
+    luaL_getmetatable(L, PROC_SNAPSHOT_METATABLE);
+    lua_setmetatable(L, -2);
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    s->cpu_threshold = 1;
+    s->rss_threshold = 1;
+    if (lua_type(L, 1) == LUA_TTABLE) {
+        if (lua_getfield(L, 1, "cpu_threshold") != LUA_TNIL) { // clock ticks
+            s->cpu_threshold = (unsigned long long)luaL_checkinteger(L, -1);
+        }
+        if (lua_getfield(L, 1, "rss_threshold") != LUA_TNIL) { // bytes
+            s->rss_threshold = (long)(luaL_checkinteger(L, -1) / page_size);
+        }
+        lua_pop(L, 2);
+    }
+    if (s->cpu_threshold == 0) {
+        s->cpu_threshold = 1;
+    }
+    if (s->rss_threshold <= 0) {
+        s->rss_threshold = 1;
+    }
+
+    s->previous_capacity = 1024;
+    s->previous = malloc(s->previous_capacity * sizeof(proc_entry));
+    if (s->previous == NULL || proc_scan_init(&s->scan) == -1 || proc_scan_run(&s->scan) == -1) {
+        return push_error(L, NULL);
+    }
+    proc_snapshot_swap(s);
+    return 1;
+#else
+    return push_error(L, "process snapshots are not supported on this platform");
+#endif
+}
+
+#ifdef __linux__
+static void
+append_pid(lua_State* L, int idx, pid_t pid) {
+    lua_pushinteger(L, pid);
+    lua_rawseti(L, idx, (lua_Integer)lua_rawlen(L, idx) + 1);
+}
+
+static int
+entry_changed(proc_snapshot* s, proc_entry* before, proc_entry* now) {
+    unsigned long long cpu_delta = now->cpu_time - before->cpu_time;
+    long rss_delta = now->rss > before->rss ? now->rss - before->rss : before->rss - now->rss;
+    return cpu_delta >= s->cpu_threshold || rss_delta >= s->rss_threshold || now->state != before->state;
+}
+
+/* snapshot -- { new = {pid...}, exited = {pid...}, changed = {pid...} }/nil error */
+static int
+proc_snapshot_update(lua_State* L) {
+    proc_snapshot* s = luaL_checkudata(L, 1, PROC_SNAPSHOT_METATABLE);
+    if (proc_scan_run(&s->scan) == -1) {
+        return push_error(L, NULL);
+    }
+    lua_createtable(L, 0, 3);
+    lua_newtable(L); // delta new
+    lua_newtable(L); // delta new exited
+    lua_newtable(L); // delta new exited changed
+    int newIdx = lua_gettop(L) - 2, exitedIdx = newIdx + 1, changedIdx = newIdx + 2;
+
+    // both scans are sorted by pid, single merge pass
+    proc_entry* before = s->previous;
+    proc_entry* now = s->scan.entries;
+    size_t i = 0, j = 0;
+    while (i < s->previous_count || j < s->scan.count) {
+        if (j == s->scan.count || (i < s->previous_count && before[i].pid < now[j].pid)) {
+            append_pid(L, exitedIdx, before[i++].pid);
+        } else if (i == s->previous_count || now[j].pid < before[i].pid) {
+            append_pid(L, newIdx, now[j++].pid);
+        } else if (before[i].start_time != now[j].start_time) { // pid reused
+            append_pid(L, exitedIdx, before[i++].pid);
+            append_pid(L, newIdx, now[j++].pid);
+        } else {
+            if (entry_changed(s, &before[i], &now[j])) {
+                append_pid(L, changedIdx, now[j].pid);
+            }
+            i++;
+            j++;
+        }
+    }
+    proc_snapshot_swap(s);
+
+    lua_setfield(L, -4, "changed");
+    lua_setfield(L, -3, "exited");
+    lua_setfield(L, -2, "new");
+    return 1;
+}
+
+/* snapshot pid -- { ppid, pgid, state, comm, cpu_time, rss }/nil */
+static int
+proc_snapshot_get(lua_State* L) {
+    proc_snapshot* s = luaL_checkudata(L, 1, PROC_SNAPSHOT_METATABLE);
+    pid_t pid = (pid_t)luaL_checkinteger(L, 2);
+    proc_scan view = {.entries = s->previous, .count = s->previous_count};
+    proc_entry* entry = proc_scan_find(&view, pid);
+    if (entry == NULL) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_createtable(L, 0, 7);
+    lua_pushinteger(L, entry->pid);
+    lua_setfield(L, -2, "pid");
+    lua_pushinteger(L, entry->ppid);
+    lua_setfield(L, -2, "ppid");
+    lua_pushinteger(L, entry->pgid);
+    lua_setfield(L, -2, "pgid");
+    lua_pushlstring(L, &entry->state, 1);
+    lua_setfield(L, -2, "state");
+    lua_pushstring(L, entry->comm);
+    lua_setfield(L, -2, "comm");
+    lua_pushinteger(L, (lua_Integer)entry->cpu_time);
+    lua_setfield(L, -2, "cpu_time");
+    lua_pushinteger(L, (lua_Integer)entry->rss * sysconf(_SC_PAGESIZE));
+    lua_setfield(L, -2, "rss");
+    return 1;
+}
+
+static int
+proc_snapshot_count(lua_State* L) {
+    proc_snapshot* s = luaL_checkudata(L, 1, PROC_SNAPSHOT_METATABLE);
+    lua_pushinteger(L, (lua_Integer)s->previous_count);
+    return 1;
+}
+
+static int
+proc_snapshot_tostring(lua_State* L) {
+    proc_snapshot* s = luaL_checkudata(L, 1, PROC_SNAPSHOT_METATABLE);
+    lua_pushfstring(L, "process snapshot (%d processes)", (int)s->previous_count);
+    return 1;
+}
+
+static int
+proc_snapshot_close(lua_State* L) {
+    proc_snapshot* s = luaL_checkudata(L, 1, PROC_SNAPSHOT_METATABLE);
+    proc_scan_free(&s->scan);
+    free(s->previous);
+    s->previous = NULL;
+    s->previous_count = s->previous_capacity = 0;
+    return 0;
+}
+#endif
+
+/*
+** Creates process snapshot metatable.
+*/
+int
+proc_snapshot_create_meta(lua_State* L) {
+    luaL_newmetatable(L, PROC_SNAPSHOT_METATABLE);
+#ifdef __linux__
+    /* Method table */
+    lua_newtable(L);
+    lua_pushcfunction(L, proc_snapshot_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, proc_snapshot_update);
+    lua_setfield(L, -2, "update");
+    lua_pushcfunction(L, proc_snapshot_get);
+    lua_setfield(L, -2, "get");
+    lua_pushcfunction(L, proc_snapshot_count);
+    lua_setfield(L, -2, "count");
+
+    lua_pushstring(L, PROC_SNAPSHOT_METATABLE);
+    lua_setfield(L, -2, "__type");
+    /* Metamethods */
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, proc_snapshot_close);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, proc_snapshot_close);
+    lua_setfield(L, -2, "__close");
+#endif
+    return 1;
+}
@@ -0,0 +1,9 @@
+#ifndef ELI_PROC_SNAPSHOT_H_
+#define ELI_PROC_SNAPSHOT_H_
+#include "lua.h"
+
+#define PROC_SNAPSHOT_METATABLE "ELI_PROC_SNAPSHOT"
+
+int proc_snapshot_new(lua_State* L);
+int proc_snapshot_create_meta(lua_State* L);
+#endif
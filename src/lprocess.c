@@ -1,21 +1,37 @@
 #include "lprocess.h"
+#include <limits.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include "lauxlib.h"
 #include "lerror.h"
+#include "lproc_list.h"
+#include "lprocess_async.h"
 #include "lsleep.h"
 #include "lspawn.h"
 #include "lstream.h"
 #include "lua.h"
 #include "lualib.h"
+#include "stdio_pump.h"
 #include "stream.h"
 
 #ifdef _WIN32
 #include <windows.h>
 #else
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#endif
 #endif
 
 /* proc -- pid */
@@ -30,8 +46,168 @@ process_pid(lua_State* L) {
     return 1;
 }
 #ifndef _WIN32
+int
+process_open_pidfd(process_id pid) {
+#ifdef __linux__
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* pids of our children owned by process objects, orphan reaping leaves them alone; shared by all lua states */
+static pthread_mutex_t trackedLock = PTHREAD_MUTEX_INITIALIZER;
+static process_id* trackedPids = NULL;
+static size_t trackedCount = 0, trackedCapacity = 0;
+
+void
+process_track(process_id pid) {
+    pthread_mutex_lock(&trackedLock);
+    if (trackedCount == trackedCapacity) {
+        size_t capacity = trackedCapacity == 0 ? 64 : trackedCapacity * 2;
+        process_id* pids = realloc(trackedPids, capacity * sizeof(process_id));
+        if (pids == NULL) {
+            pthread_mutex_unlock(&trackedLock);
+            return; // worst case the child may be reaped as orphan
+        }
+        trackedPids = pids;
+        trackedCapacity = capacity;
+    }
+    trackedPids[trackedCount++] = pid;
+    pthread_mutex_unlock(&trackedLock);
+}
+
+static void
+process_untrack(process_id pid) {
+    pthread_mutex_lock(&trackedLock);
+    for (size_t i = 0; i < trackedCount; i++) {
+        if (trackedPids[i] == pid) {
+            trackedPids[i] = trackedPids[--trackedCount];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&trackedLock);
+}
+
+int
+process_is_tracked(process_id pid) {
+    int tracked = 0;
+    pthread_mutex_lock(&trackedLock);
+    for (size_t i = 0; i < trackedCount && !tracked; i++) {
+        tracked = trackedPids[i] == pid;
+    }
+    pthread_mutex_unlock(&trackedLock);
+    return tracked;
+}
+
+/* fills in a process we did not necessarily spawn ourselves */
+void
+process_attach(process* p, process_id pid) {
+    p->pid = pid;
+    // our own children can still be reaped with waitpid, others are watched through pidfd
+    siginfo_t info;
+    p->isChild = waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0;
+    if (p->isChild) {
+        process_track(pid);
+    }
+    p->pidfd = process_open_pidfd(pid);
+    process_deadline_init(p);
+}
+
+static long long
+monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void
+process_deadline_init(process* p) {
+    memset(&p->deadline, 0, sizeof(process_deadline));
+    p->deadline.timerfd = -1;
+}
+
+/* sets timerfd (if any) to fire at deadline.at, disarms it when there is no further action */
+static void
+deadline_set_timer(process_deadline* d) {
+#ifdef __linux__
+    if (d->timerfd < 0) {
+        return;
+    }
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = d->at / 1000000000LL;
+    spec.it_value.tv_nsec = d->at % 1000000000LL;
+    timerfd_settime(d->timerfd, TFD_TIMER_ABSTIME, &spec, NULL);
+#endif
+}
+
+/* timeout and grace in ns; signal is sent after timeout, SIGKILL after further grace (if > 0) */
+int
+process_deadline_arm(process* p, long long timeout, int signal, long long grace) {
+    process_deadline* d = &p->deadline;
+    d->at = monotonic_ns() + timeout;
+    d->signal = signal;
+    d->grace = grace;
+    d->stage = 0;
+#ifdef __linux__
+    if (d->timerfd < 0) {
+        d->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    }
+    deadline_set_timer(d); // without timerfd deadline is enforced by bounded waits
+#endif
+    return 0;
+}
+
+/* sends deadline signals which are due */
+void
+process_deadline_enforce(process* p) {
+    process_deadline* d = &p->deadline;
+    if (d->at == 0 || p->status != -1) {
+        return;
+    }
+    long long now = monotonic_ns();
+    if (now < d->at) {
+        return;
+    }
+#ifdef __linux__
+    if (d->timerfd >= 0) {
+        uint64_t expirations;
+        read(d->timerfd, &expirations, sizeof(expirations)); // reset readiness
+    }
+#endif
+    if (d->stage == 0) {
+        kill(p->pid, d->signal);
+        d->stage = 1;
+        d->at = d->grace > 0 && d->signal != SIGKILL ? now + d->grace : 0;
+    } else {
+        kill(p->pid, SIGKILL);
+        d->stage = 2;
+        d->at = 0;
+    }
+    deadline_set_timer(d);
+}
+
+/* shortens timeout_ms (negative - infinite) so wait wakes up for the next deadline action */
+static int
+deadline_bound_timeout(process* p, int timeout_ms) {
+    if (p->deadline.at == 0) {
+        return timeout_ms;
+    }
+    long long remaining = (p->deadline.at - monotonic_ns() + 999999) / 1000000;
+    if (remaining < 0) {
+        remaining = 0;
+    } else if (remaining > INT_MAX) {
+        remaining = INT_MAX; // woken up again before the deadline
+    }
+    return timeout_ms < 0 || remaining < timeout_ms ? (int)remaining : timeout_ms;
+}
+
+/* child was reaped */
 static void
 update_process_exit_status(process* p, int status) {
+    process_untrack(p->pid);
     if (WIFEXITED(status)) {
         p->status = WEXITSTATUS(status);
     } else if (WIFSIGNALED(status)) {
@@ -40,8 +216,84 @@ update_process_exit_status(process* p, int status) {
         p->status = 255 + p->signal;
     }
 }
+
+/* 1 - terminated, 0 - running, -1 - error; sends due deadline signals */
+int
+process_check_exit(process* p) {
+    if (p->status != -1) {
+        return 1;
+    }
+    process_deadline_enforce(p);
+    if (p->isChild) {
+        int status;
+        int res = waitpid(p->pid, &status, WNOHANG);
+        if (res == -1) {
+            return -1;
+        }
+        if (res == 0) {
+            return 0;
+        }
+        update_process_exit_status(p, status);
+        return 1;
+    }
+    if (p->pidfd >= 0) {
+        struct pollfd pfd = {p->pidfd, POLLIN, 0};
+        int res = poll(&pfd, 1, 0);
+        if (res == -1) {
+            return -1;
+        }
+        if (res == 0) {
+            return 0;
+        }
+    } else if (kill(p->pid, 0) == 0 || errno != ESRCH) {
+        return 0;
+    }
+    // exit status of a process we did not spawn is not available to us
+    p->status = 0;
+    return 1;
+}
+
+/* waits up to timeout_ms (forever if negative), 1 - terminated, 0 - timeout, -1 - error */
+static int
+process_wait_exit(process* p, int timeout_ms) {
+    int res = process_check_exit(p);
+    if (res != 0 || timeout_ms == 0) {
+        return res;
+    }
+    if (p->isChild && timeout_ms < 0 && p->deadline.at == 0) {
+        int status;
+        if (waitpid(p->pid, &status, 0) == -1) {
+            return -1;
+        }
+        update_process_exit_status(p, status);
+        return 1;
+    }
+    long long end = timeout_ms < 0 ? 0 : monotonic_ns() + (long long)timeout_ms * 1000000LL;
+    for (;;) {
+        int remaining = timeout_ms;
+        if (end != 0) {
+            long long left = end - monotonic_ns();
+            remaining = left > 0 ? (int)((left + 999999) / 1000000) : 0;
+        }
+        if (p->pidfd >= 0) {
+            // deadline timer wakes us up to send signals, bounded timeout covers missing timerfd
+            struct pollfd pfds[2] = {{p->pidfd, POLLIN, 0}, {p->deadline.timerfd, POLLIN, 0}};
+            res = poll(pfds, 2, p->deadline.timerfd >= 0 ? remaining : deadline_bound_timeout(p, remaining));
+            if (res == -1 && errno != EINTR) {
+                return -1;
+            }
+        } else {
+            // no pidfd (old kernel or non linux) - poll
+            sleep_ms(1);
+        }
+        res = process_check_exit(p);
+        if (res != 0 || (end != 0 && monotonic_ns() >= end)) {
+            return res;
+        }
+    }
+}
 #endif
-/* proc -- exitcode/nil error */
+/* proc -- exitcode signal timed_out/nil error */
 static int
 process_wait(lua_State* L) {
     process* p = luaL_checkudata(L, 1, PROCESS_METATABLE);
@@ -56,39 +308,123 @@ process_wait(lua_State* L) {
         }
         p->status = exitcode;
 #else
-        int status = 0;
-        int res = waitpid(p->pid, &status, WNOHANG);
-        if (p->pid == res) {
-            update_process_exit_status(p, status);
-        } else if (duration > 0) {
-            int elapsed = 0;
-            while (p->status == -1 && elapsed < duration) {
-                int res = waitpid(p->pid, &status, WNOHANG);
-                if (p->pid == res) {
-                    update_process_exit_status(p, status);
-                    break;
-                } else if (res == -1) {
-                    p->status = 0;
-                    break;
-                }
-                // res == 0 means process is still running
-                sleep_ms(1.0 / divider);
-                elapsed++;
+        if (process_wait_exit(p, duration > 0 ? (int)(duration / divider) : -1) == -1) {
+            return push_error(L, NULL);
+        }
+#endif
+    }
+    lua_pushinteger(L, p->status);
+    lua_pushinteger(L, p->signal);
+#ifdef _WIN32
+    lua_pushboolean(L, 0);
+#else
+    lua_pushboolean(L, p->deadline.stage > 0);
+#endif
+    return 3;
+}
+
+/* proc -- boolean; whether spawn timeout expired and process was signaled */
+static int
+process_timed_out(lua_State* L) {
+    process* p = luaL_checkudata(L, 1, PROCESS_METATABLE);
+#ifdef _WIN32
+    lua_pushboolean(L, 0);
+#else
+    if (p->status == -1) {
+        process_check_exit(p);
+    }
+    lua_pushboolean(L, p->deadline.stage > 0);
+#endif
+    return 1;
+}
+
+/* {proc...} [timeout, unit] -- proc index/nil */
+int
+process_wait_any(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    int duration = (int)luaL_optnumber(L, 2, 0);
+    double divider = get_ms_divider_from_state(L, 3, 1.0);
+    int n = (int)lua_rawlen(L, 1);
+    if (n == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    process** procs = lua_newuserdatauv(L, n * sizeof(process*), 0);
+    for (int i = 0; i < n; i++) {
+        lua_rawgeti(L, 1, i + 1);
+        procs[i] = luaL_checkudata(L, -1, PROCESS_METATABLE);
+        lua_pop(L, 1);
+    }
+#ifdef _WIN32
+    if (n > MAXIMUM_WAIT_OBJECTS) {
+        return luaL_error(L, "wait_any supports at most %d processes", MAXIMUM_WAIT_OBJECTS);
+    }
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+    for (int i = 0; i < n; i++) {
+        handles[i] = procs[i]->hProcess;
+    }
+    DWORD res = WaitForMultipleObjects(n, handles, FALSE, duration <= 0 ? INFINITE : (1e3 * duration / divider));
+    if (res == WAIT_FAILED) {
+        return push_error(L, NULL);
+    }
+    if (res == WAIT_TIMEOUT) {
+        lua_pushnil(L);
+        return 1;
+    }
+    int index = res - WAIT_OBJECT_0;
+    DWORD exitcode;
+    if (GetExitCodeProcess(procs[index]->hProcess, &exitcode)) {
+        procs[index]->status = exitcode;
+    }
+#else
+    int timeout_ms = duration > 0 ? (int)(duration / divider) : -1;
+    // pidfds followed by deadline timers (negative fds are ignored by poll)
+    struct pollfd* pfds = lua_newuserdatauv(L, 2 * n * sizeof(struct pollfd), 0);
+    int pollable = 1;
+    for (int i = 0; i < n; i++) {
+        pfds[i].fd = procs[i]->pidfd;
+        pfds[i].events = POLLIN;
+        pfds[n + i].fd = procs[i]->deadline.timerfd;
+        pfds[n + i].events = POLLIN;
+        pollable = pollable && procs[i]->pidfd >= 0;
+    }
+    // deadline timers and signals wake poll up early, each round waits only for what is left
+    long long end = timeout_ms < 0 ? 0 : monotonic_ns() + (long long)timeout_ms * 1000000LL;
+    int index = -1;
+    while (index == -1) {
+        for (int i = 0; i < n; i++) {
+            int res = process_check_exit(procs[i]);
+            if (res == -1) {
+                return push_error(L, NULL);
             }
-            if (p->status != -1) {
-                update_process_exit_status(p, status);
+            if (res == 1) {
+                index = i;
+                break;
             }
-        } else {
-            int status;
-            if (-1 == waitpid(p->pid, &status, 0)) {
+        }
+        if (index != -1) {
+            break;
+        }
+        int remaining = timeout_ms;
+        if (end != 0) {
+            long long left = end - monotonic_ns();
+            if (left <= 0) {
+                lua_pushnil(L);
+                return 1;
+            }
+            remaining = (int)((left + 999999) / 1000000);
+        }
+        if (pollable) {
+            if (poll(pfds, 2 * n, remaining) == -1 && errno != EINTR) {
                 return push_error(L, NULL);
             }
-            update_process_exit_status(p, status);
+        } else {
+            sleep_ms(1);
         }
-#endif
     }
-    lua_pushinteger(L, p->status);
-    lua_pushinteger(L, p->signal);
+#endif
+    lua_rawgeti(L, 1, index + 1);
+    lua_pushinteger(L, index + 1);
     return 2;
 }
 
@@ -147,11 +483,7 @@ process_tostring(lua_State* L) {
         }
         p->status = (exitcode == STILL_ACTIVE) ? -1 : 0;
 #else
-        int status = 0;
-        int res = waitpid(p->pid, &status, WNOHANG);
-        if (p->pid == res) {
-            update_process_exit_status(p, status);
-        }
+        process_check_exit(p);
 #endif
     }
     lua_pushlstring(
@@ -171,14 +503,9 @@ process_exitcode(lua_State* L) {
         }
         p->status = exitcode;
 #else
-        int status;
-        int res = waitpid(p->pid, &status, WNOHANG);
-        if (res == -1) {
+        if (process_check_exit(p) == -1) {
             return push_error(L, NULL);
         }
-        if (res != 0) {
-            update_process_exit_status(p, status);
-        }
 #endif
     }
     lua_pushinteger(L, p->status);
@@ -199,16 +526,11 @@ process_exited(lua_State* L) {
         p->status = exitcode;
         active = exitcode == STILL_ACTIVE;
 #else
-        int status;
-        int res = waitpid(p->pid, &status, WNOHANG);
+        int res = process_check_exit(p);
         if (res == -1) {
             return push_error(L, NULL);
         }
-        if (res == 0) {
-            active = 1;
-        } else {
-            update_process_exit_status(p, status);
-        }
+        active = res == 0;
 #endif
     }
     lua_pushboolean(L, !active);
@@ -252,6 +574,7 @@ process_get_stdout(lua_State* L) {
             luaL_getmetatable(L, ELI_STREAM_R_METATABLE);
             lua_setmetatable(L, -2);
             break;
+        case STDIO_CHANNEL_ROTATE_KIND: // current file
         case STDIO_CHANNEL_EXTERNAL_PATH_KIND:
             lua_pop(L, 1); // remove process from stack
             luaL_requiref(L, "io", luaopen_io, 0);
@@ -282,6 +605,7 @@ process_get_stderr(lua_State* L) {
             luaL_getmetatable(L, ELI_STREAM_R_METATABLE);
             lua_setmetatable(L, -2);
             break;
+        case STDIO_CHANNEL_ROTATE_KIND: // current file
         case STDIO_CHANNEL_EXTERNAL_PATH_KIND:
             lua_pop(L, 1); // remove process from stack
             luaL_requiref(L, "io", luaopen_io, 0);
@@ -308,6 +632,8 @@ get_channel_kind_alias(stdio_channel* channel) {
         case STDIO_CHANNEL_EXTERNAL_PATH_KIND:
         case STDIO_CHANNEL_EXTERNAL_FILE_KIND: return "file";
         case STDIO_CHANNEL_IGNORE_KIND: return "ignore";
+        case STDIO_CHANNEL_TAIL_KIND: return "tail";
+        case STDIO_CHANNEL_ROTATE_KIND: return "rotate";
     }
 }
 
@@ -324,9 +650,74 @@ process_stdio_info(lua_State* L) {
     lua_setfield(L, -2, "stdout");
     lua_pushstring(L, get_channel_kind_alias(p->stdio[STDIO_STDERR]));
     lua_setfield(L, -2, "stderr");
+
+    // effective pipe capacities, only for pipes with known size
+    static const char* names[] = {"stdin", "stdout", "stderr"};
+    lua_newtable(L);
+    for (int i = STDIO_STDIN; i <= STDIO_STDERR; i++) {
+        int size = stdio_channel_pipe_size(p->stdio[i]);
+        if (size > 0) {
+            lua_pushinteger(L, size);
+            lua_setfield(L, -2, names[i]);
+        }
+    }
+    lua_setfield(L, -2, "pipe_size");
     return 1;
 }
 
+/* proc [stream] -- data total/nil error; last bytes of tail captured stdout (default, as get_timestamps) or stderr */
+static int
+process_get_tail(lua_State* L) {
+    process* p = (process*)luaL_checkudata(L, 1, PROCESS_METATABLE);
+    static const char* names[] = {"stdout", "stderr", NULL};
+    stdio_channel* channel = p->stdio[STDIO_STDOUT + luaL_checkoption(L, 2, "stdout", names)];
+#ifdef _WIN32
+    (void)channel;
+    return push_error(L, "tail is not supported on this platform");
+#else
+    if (channel == NULL || channel->kind != STDIO_CHANNEL_TAIL_KIND) {
+        return push_error(L, "stream is not captured as tail");
+    }
+    luaL_Buffer b;
+    char* out = luaL_buffinitsize(L, &b, stdio_tail_capacity(channel->pump));
+    uint64_t total;
+    size_t n = stdio_tail_read(channel->pump, out, &total);
+    luaL_pushresultsize(&b, n);
+    lua_pushinteger(L, (lua_Integer)total);
+    return 2;
+#endif
+}
+
+/* proc [stream [from]] -- offsets times/nil error; chunk stamps of stdout (default) or stderr */
+static int
+process_get_timestamps(lua_State* L) {
+    process* p = (process*)luaL_checkudata(L, 1, PROCESS_METATABLE);
+    static const char* names[] = {"stdout", "stderr", NULL};
+    stdio_channel* channel = p->stdio[STDIO_STDOUT + luaL_checkoption(L, 2, "stdout", names)];
+    lua_Integer from = luaL_optinteger(L, 3, 0);
+#ifndef __linux__
+    (void)channel;
+    (void)from;
+    return push_error(L, "timestamps are not supported on this platform");
+#else
+    if (channel == NULL || channel->kind != STDIO_CHANNEL_STREAM_KIND || channel->pump == NULL) {
+        return push_error(L, "stream is not captured with timestamps");
+    }
+    stdio_chunk_stamp* stamps =
+        lua_newuserdatauv(L, stdio_relay_capacity(channel->pump) * sizeof(stdio_chunk_stamp), 0);
+    size_t n = stdio_relay_stamps(channel->pump, from > 0 ? (uint64_t)from : 0, stamps);
+    lua_createtable(L, (int)n, 0); /* proc ... stamps offsets */
+    lua_createtable(L, (int)n, 0); /* proc ... stamps offsets times */
+    for (size_t i = 0; i < n; i++) {
+        lua_pushinteger(L, (lua_Integer)stamps[i].offset);
+        lua_rawseti(L, -3, (lua_Integer)i + 1);
+        lua_pushinteger(L, (lua_Integer)stamps[i].time_ns);
+        lua_rawseti(L, -2, (lua_Integer)i + 1);
+    }
+    return 2;
+#endif
+}
+
 static int
 process_get_group(lua_State* L) {
     process* p = (process*)luaL_checkudata(L, 1, PROCESS_METATABLE);
@@ -347,9 +738,34 @@ process_close(lua_State* L) {
     close_proc_stdio_channel(p, STDIO_STDIN);
     close_proc_stdio_channel(p, STDIO_STDOUT);
     close_proc_stdio_channel(p, STDIO_STDERR);
+#ifndef _WIN32
+    if (p->isChild && p->status == -1) {
+        process_untrack(p->pid); // nobody waits for it anymore, let orphan reaping collect it
+    }
+    if (p->deadline.timerfd >= 0) {
+        close(p->deadline.timerfd);
+        p->deadline.timerfd = -1;
+    }
+    if (p->pidfd >= 0) {
+        close(p->pidfd);
+        p->pidfd = -1;
+    }
+#endif
     return 0;
 }
 
+/* proc -- { phase = ns, ... }/nil */
+static int
+process_spawn_timings(lua_State* L) {
+    process* p = (process*)luaL_checkudata(L, 1, PROCESS_METATABLE);
+    if (p->timing.start == 0) {
+        lua_pushnil(L); // spawned with stats disabled or not spawned by us
+        return 1;
+    }
+    spawn_timing_push(L, &p->timing);
+    return 1;
+}
+
 /*
 ** Creates process metatable.
 */
@@ -383,8 +799,24 @@ process_create_meta(lua_State* L) {
     lua_setfield(L, -2, "get_stderr");
     lua_pushcfunction(L, process_stdio_info);
     lua_setfield(L, -2, "get_stdio_info");
+    lua_pushcfunction(L, process_get_tail);
+    lua_setfield(L, -2, "get_tail");
+    lua_pushcfunction(L, process_get_timestamps);
+    lua_setfield(L, -2, "get_timestamps");
     lua_pushcfunction(L, process_get_group);
     lua_setfield(L, -2, "get_group");
+    lua_pushcfunction(L, process_children);
+    lua_setfield(L, -2, "children");
+    lua_pushcfunction(L, process_wait_async);
+    lua_setfield(L, -2, "wait_async");
+    lua_pushcfunction(L, process_read_async);
+    lua_setfield(L, -2, "read_async");
+    lua_pushcfunction(L, process_write_async);
+    lua_setfield(L, -2, "write_async");
+    lua_pushcfunction(L, process_spawn_timings);
+    lua_setfield(L, -2, "spawn_timings");
+    lua_pushcfunction(L, process_timed_out);
+    lua_setfield(L, -2, "timed_out");
 
     lua_pushstring(L, PROCESS_METATABLE);
     lua_setfield(L, -2, "__type");
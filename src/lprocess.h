@@ -1,6 +1,7 @@
 #ifndef ELI_PROCESS_H_
 #define ELI_PROCESS_H_
 #include "lua.h"
+#include "spawn_stats.h"
 #include "stdio_channel.h"
 
 #ifdef _WIN32
@@ -13,18 +14,44 @@
 #define process_id pid_t
 #endif
 
+#ifndef _WIN32
+/* optional run time limit, enforced whenever the process is checked or waited for */
+typedef struct process_deadline {
+    int timerfd;     // fires at next action, -1 when not armed or timerfd is not available
+    long long at;    // CLOCK_MONOTONIC ns of next action, 0 - none
+    int signal;      // sent when timeout expires
+    long long grace; // ns after signal until SIGKILL follows, 0 - no escalation
+    int stage;       // 0 - armed, 1 - signal sent, 2 - SIGKILL sent
+} process_deadline;
+#endif
+
 typedef struct process {
     int status;
     int signal;
-#ifdef _WIN32
     int isChild;
+#ifdef _WIN32
     HANDLE hProcess;
+#else
+    int pidfd; // -1 when pidfd is not available, exits are detected by polling
+    process_deadline deadline;
 #endif
     process_id pid;
     stdio_channel* stdio[3];
+    spawn_timing timing; // zeroed when spawn was not timed
 } process;
 
 #define PROCESS_METATABLE "ELI_PROCESS"
 
 int process_create_meta(lua_State* L);
+int process_wait_any(lua_State* L);
+#ifndef _WIN32
+int process_open_pidfd(process_id pid);
+void process_attach(process* p, process_id pid);
+int process_check_exit(process* p);
+void process_track(process_id pid);
+int process_is_tracked(process_id pid);
+void process_deadline_init(process* p);
+int process_deadline_arm(process* p, long long timeout, int signal, long long grace);
+void process_deadline_enforce(process* p);
+#endif
 #endif
\ No newline at end of file
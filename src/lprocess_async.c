@@ -0,0 +1,593 @@
+#include "lprocess_async.h"
+#include <stdlib.h>
+#include <string.h>
+#include "lauxlib.h"
+#include "lerror.h"
+#include "lproc.h"
+#include "lprocess.h"
+#include "lspawn.h"
+#include "lua.h"
+#include "stdio_channel.h"
+#include "stream.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include "event_engine.h"
+
+#define ASYNC_READ_SIZE  65536
+#define ASYNC_MAX_PAIRS  4
+#define LOOP_MAX_EVENTS  64
+#define LOOP_RETRY_MS    1
+
+/* user values of loop */
+#define LOOP_THREADS 1 // id -> coroutine
+#define LOOP_READY   2 // array of ids to resume
+#define LOOP_WAITS   3 // id -> { fd... } registered in engine
+#define LOOP_RETRY   4 // array of ids which yielded without fd
+
+/* blocks until one of (fd, interest) pairs on top of the stack is ready and pops them */
+static void
+wait_ready(lua_State* L, int pairs) {
+    struct pollfd pfds[ASYNC_MAX_PAIRS];
+    int n = 0, retry = 0;
+    int first = lua_gettop(L) - pairs * 2 + 1;
+    for (int i = 0; i < pairs && i < ASYNC_MAX_PAIRS; i++) {
+        int idx = first + i * 2;
+        if (lua_isnil(L, idx)) {
+            retry = 1;
+            continue;
+        }
+        pfds[n].fd = (int)lua_tointeger(L, idx);
+        pfds[n].events = lua_tostring(L, idx + 1)[0] == 'w' ? POLLOUT : POLLIN;
+        pfds[n].revents = 0;
+        n++;
+    }
+    lua_pop(L, pairs * 2);
+    poll(pfds, n, retry ? LOOP_RETRY_MS : -1);
+}
+
+/* pushes deadline timer pair when spawn timeout is pending, returns number of pairs */
+static int
+push_deadline_watch(lua_State* L, process* p) {
+    if (p->deadline.at == 0) {
+        return 0;
+    }
+    if (p->deadline.timerfd >= 0) {
+        lua_pushinteger(L, p->deadline.timerfd);
+    } else {
+        lua_pushnil(L); // no timer, retry shortly
+    }
+    lua_pushliteral(L, "r");
+    return 1;
+}
+
+/* 1 - readable or eof, 0 - would block, -1 - error */
+static int
+fd_readable(int fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int res = poll(&pfd, 1, 0);
+    if (res == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+    return res > 0;
+}
+
+/* pushes (fd, "r") pairs to watch for exit of p, returns number of pairs */
+static int
+push_exit_watch(lua_State* L, process* p) {
+    if (p->pidfd >= 0) {
+        lua_pushinteger(L, p->pidfd);
+    } else {
+        lua_pushnil(L);
+    }
+    lua_pushliteral(L, "r");
+    return 1 + push_deadline_watch(L, p);
+}
+
+static int
+process_wait_async_k(lua_State* L, int status, lua_KContext ctx) {
+    process* p = luaL_checkudata(L, 1, PROCESS_METATABLE);
+    lua_settop(L, 1);
+    for (;;) {
+        int res = process_check_exit(p);
+        if (res == -1) {
+            return push_error(L, NULL);
+        }
+        if (res == 1) {
+            lua_pushinteger(L, p->status);
+            lua_pushinteger(L, p->signal);
+            return 2;
+        }
+        int pairs = push_exit_watch(L, p);
+        if (lua_isyieldable(L)) {
+            return lua_yieldk(L, pairs * 2, ctx, process_wait_async_k);
+        }
+        wait_ready(L, pairs);
+    }
+}
+
+/* proc -- exitcode signal/nil error */
+int
+process_wait_async(lua_State* L) {
+    return process_wait_async_k(L, LUA_OK, 0);
+}
+
+static int
+get_readable_fd(process* p, int kind) {
+    stdio_channel* channel = p->stdio[kind];
+    if (channel == NULL
+        || (channel->kind != STDIO_CHANNEL_STREAM_KIND && channel->kind != STDIO_CHANNEL_EXTERNAL_STREAM_KIND)
+        || channel->stream == NULL || channel->stream->closed) {
+        return -1;
+    }
+    return channel->stream->fd;
+}
+
+static int
+process_read_async_k(lua_State* L, int status, lua_KContext ctx) {
+    process* p = luaL_checkudata(L, 1, PROCESS_METATABLE);
+    lua_settop(L, 3);
+    size_t size = (size_t)luaL_optinteger(L, 3, ASYNC_READ_SIZE);
+    int fd = get_readable_fd(p, (int)ctx);
+    if (fd == -1) {
+        return push_error(L, "stream is not readable");
+    }
+    for (;;) {
+        int res = fd_readable(fd);
+        if (res == -1) {
+            return push_error(L, NULL);
+        }
+        if (res == 1) {
+            luaL_Buffer b;
+            char* buf = luaL_buffinitsize(L, &b, size);
+            ssize_t n = read(fd, buf, size);
+            if (n == -1) {
+                if (errno == EINTR || errno == EAGAIN) {
+                    lua_settop(L, 3);
+                    continue;
+                }
+                return push_error(L, NULL);
+            }
+            if (n == 0) {
+                lua_pushnil(L); // eof
+                return 1;
+            }
+            luaL_pushresultsize(&b, n);
+            return 1;
+        }
+        lua_pushinteger(L, fd);
+        lua_pushliteral(L, "r");
+        if (lua_isyieldable(L)) {
+            return lua_yieldk(L, 2, ctx, process_read_async_k);
+        }
+        wait_ready(L, 1);
+    }
+}
+
+/* proc [stream, size] -- data/nil(eof)/nil error */
+int
+process_read_async(lua_State* L) {
+    luaL_checkudata(L, 1, PROCESS_METATABLE);
+    static const char* streams[] = {"stdout", "stderr", NULL};
+    int kind = luaL_checkoption(L, 2, "stdout", streams) == 0 ? STDIO_STDOUT : STDIO_STDERR;
+    return process_read_async_k(L, LUA_OK, kind);
+}
+
+static int
+process_write_async_k(lua_State* L, int status, lua_KContext ctx) {
+    process* p = luaL_checkudata(L, 1, PROCESS_METATABLE);
+    lua_settop(L, 2);
+    size_t len;
+    const char* data = luaL_checklstring(L, 2, &len);
+    stdio_channel* channel = p->stdio[STDIO_STDIN];
+    if (channel == NULL
+        || (channel->kind != STDIO_CHANNEL_STREAM_KIND && channel->kind != STDIO_CHANNEL_EXTERNAL_STREAM_KIND)
+        || channel->stream == NULL || channel->stream->closed) {
+        return push_error(L, "stream is not writable");
+    }
+    int fd = channel->stream->fd;
+    size_t offset = (size_t)ctx;
+    while (offset < len) {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        int res = poll(&pfd, 1, 0);
+        if (res == -1 && errno != EINTR) {
+            return push_error(L, NULL);
+        }
+        if (res > 0) {
+            // at least PIPE_BUF bytes fit when pipe is writable
+            size_t chunk = len - offset > PIPE_BUF ? PIPE_BUF : len - offset;
+            ssize_t n = write(fd, data + offset, chunk);
+            if (n == -1) {
+                if (errno == EINTR || errno == EAGAIN) {
+                    continue;
+                }
+                return push_error(L, NULL);
+            }
+            offset += n;
+            continue;
+        }
+        lua_pushinteger(L, fd);
+        lua_pushliteral(L, "w");
+        if (lua_isyieldable(L)) {
+            return lua_yieldk(L, 2, (lua_KContext)offset, process_write_async_k);
+        }
+        wait_ready(L, 1);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* proc data -- true/nil error */
+int
+process_write_async(lua_State* L) {
+    return process_write_async_k(L, LUA_OK, 0);
+}
+
+/* reads everything available from fd into chunks table; 1 - eof, 0 - would block, -1 - error */
+static int
+drain_available(lua_State* L, int fd, int chunks) {
+    char buf[ASYNC_READ_SIZE];
+    for (;;) {
+        int res = fd_readable(fd);
+        if (res != 1) {
+            return res;
+        }
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return 1;
+        }
+        lua_pushlstring(L, buf, n);
+        lua_rawseti(L, chunks, (lua_Integer)lua_rawlen(L, chunks) + 1);
+    }
+}
+
+static void
+push_concat(lua_State* L, int chunks) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    lua_Integer n = (lua_Integer)lua_rawlen(L, chunks);
+    for (lua_Integer i = 1; i <= n; i++) {
+        lua_rawgeti(L, chunks, i);
+        luaL_addvalue(&b);
+    }
+    luaL_pushresult(&b);
+}
+
+/* stack: proc stdout_chunks stderr_chunks stdout_done stderr_done */
+static int
+proc_exec_async_k(lua_State* L, int status, lua_KContext ctx) {
+    lua_settop(L, 5);
+    process* p = luaL_checkudata(L, 1, PROCESS_METATABLE);
+    for (;;) {
+        int pairs = 0;
+        for (int kind = STDIO_STDOUT; kind <= STDIO_STDERR; kind++) {
+            int done = 3 + kind;
+            if (lua_toboolean(L, done)) {
+                continue;
+            }
+            int fd = get_readable_fd(p, kind);
+            int res = fd == -1 || (kind == STDIO_STDERR && p->stdio[STDIO_STDERR] == p->stdio[STDIO_STDOUT])
+                        ? 1
+                        : drain_available(L, fd, 1 + kind);
+            if (res == -1) {
+                return push_error(L, NULL);
+            }
+            if (res == 1) {
+                lua_pushboolean(L, 1);
+                lua_replace(L, done);
+                continue;
+            }
+            lua_pushinteger(L, fd);
+            lua_pushliteral(L, "r");
+            pairs++;
+        }
+        if (pairs == 0) {
+            int res = process_check_exit(p);
+            if (res == -1) {
+                return push_error(L, NULL);
+            }
+            if (res == 1) {
+                lua_pushinteger(L, p->status);
+                lua_pushinteger(L, p->signal);
+                push_concat(L, 2);
+                push_concat(L, 3);
+                lua_pushboolean(L, p->deadline.stage > 0);
+                return 5;
+            }
+            pairs = push_exit_watch(L, p);
+        } else {
+            process_deadline_enforce(p); // timeout applies while output is streamed as well
+            pairs += push_deadline_watch(L, p);
+        }
+        if (lua_isyieldable(L)) {
+            return lua_yieldk(L, pairs * 2, ctx, proc_exec_async_k);
+        }
+        wait_ready(L, pairs);
+    }
+}
+#else
+int
+process_wait_async(lua_State* L) {
+    return push_error(L, "async api is not supported on this platform");
+}
+
+int
+process_read_async(lua_State* L) {
+    return push_error(L, "async api is not supported on this platform");
+}
+
+int
+process_write_async(lua_State* L) {
+    return push_error(L, "async api is not supported on this platform");
+}
+#endif
+
+/* cmd [opts] -- exitcode signal stdout stderr timed_out/nil error details */
+int
+proc_exec_async(lua_State* L) {
+#ifdef _WIN32
+    return push_error(L, "async api is not supported on this platform");
+#else
+    int nargs = lua_gettop(L) > 1 ? 2 : 1;
+    lua_pushcfunction(L, eli_spawn);
+    lua_rotate(L, 1, 1);
+    lua_call(L, nargs, 3); // proc/nil nil/error nil/details
+    process* p = luaL_testudata(L, 1, PROCESS_METATABLE);
+    if (p == NULL) {
+        return 3;
+    }
+    // child gets no input
+    if (p->stdio[STDIO_STDIN] != NULL && p->stdio[STDIO_STDIN]->kind == STDIO_CHANNEL_STREAM_KIND) {
+        close_proc_stdio_channel(p, STDIO_STDIN);
+    }
+    lua_settop(L, 1);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushboolean(L, 0);
+    lua_pushboolean(L, 0); // proc stdout_chunks stderr_chunks stdout_done stderr_done
+    return proc_exec_async_k(L, LUA_OK, 0);
+#endif
+}
+
+#ifndef _WIN32
+typedef struct process_loop {
+    event_engine* engine;
+    lua_Integer next_id;
+    int active;
+    lua_Integer ready_head, ready_tail;
+} process_loop;
+
+static void
+loop_push_ready(lua_State* L, process_loop* loop, lua_Integer id) {
+    lua_getiuservalue(L, 1, LOOP_READY);
+    lua_pushinteger(L, id);
+    lua_rawseti(L, -2, loop->ready_tail++);
+    lua_pop(L, 1);
+}
+
+/* registers yielded (fd, interest) pairs, returns 0 when coroutine has to be retried without fd */
+static int
+loop_register_waits(lua_State* L, process_loop* loop, lua_Integer id, lua_State* co, int nres) {
+    if (nres < 2) {
+        return 0;
+    }
+    lua_createtable(L, nres / 2, 0); // fds
+    int registered = 0;
+    for (int i = lua_gettop(co) - nres + 1; i + 1 <= lua_gettop(co); i += 2) {
+        if (!lua_isinteger(co, i)) {
+            continue;
+        }
+        int fd = (int)lua_tointeger(co, i);
+        const char* interest = lua_tostring(co, i + 1);
+        uint32_t events = interest != NULL && interest[0] == 'w' ? EVENT_ENGINE_WRITE : EVENT_ENGINE_READ;
+        if (event_engine_add(loop->engine, fd, events, (uint64_t)id) == -1) {
+            continue;
+        }
+        lua_pushinteger(L, fd);
+        lua_rawseti(L, -2, ++registered);
+    }
+    if (registered == 0) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_getiuservalue(L, 1, LOOP_WAITS);
+    lua_rotate(L, -2, 1);
+    lua_rawseti(L, -2, id);
+    lua_pop(L, 1);
+    return 1;
+}
+
+static void
+loop_unregister_waits(lua_State* L, process_loop* loop, lua_Integer id) {
+    lua_getiuservalue(L, 1, LOOP_WAITS);
+    if (lua_rawgeti(L, -1, id) == LUA_TTABLE) {
+        lua_Integer n = (lua_Integer)lua_rawlen(L, -1);
+        for (lua_Integer i = 1; i <= n; i++) {
+            lua_rawgeti(L, -1, i);
+            event_engine_remove(loop->engine, (int)lua_tointeger(L, -1));
+            lua_pop(L, 1);
+        }
+        lua_pushnil(L);
+        lua_rawseti(L, -3, id);
+    }
+    lua_pop(L, 2);
+}
+
+/* resumes coroutine, raises its error */
+static void
+loop_resume(lua_State* L, process_loop* loop, lua_Integer id) {
+    lua_getiuservalue(L, 1, LOOP_THREADS);
+    if (lua_rawgeti(L, -1, id) != LUA_TTHREAD) {
+        lua_pop(L, 2);
+        return;
+    }
+    lua_State* co = lua_tothread(L, -1);
+    int nargs = lua_status(co) == LUA_OK ? lua_gettop(co) - 1 : 0; // not started yet, function and args
+    int nres = 0;
+    int status = lua_resume(co, L, nargs, &nres);
+    if (status == LUA_YIELD) {
+        if (!loop_register_waits(L, loop, id, co, nres)) {
+            lua_getiuservalue(L, 1, LOOP_RETRY);
+            lua_pushinteger(L, id);
+            lua_rawseti(L, -2, (lua_Integer)lua_rawlen(L, -2) + 1);
+            lua_pop(L, 1);
+        }
+        lua_pop(co, nres);
+        lua_pop(L, 2);
+        return;
+    }
+    // finished or failed
+    lua_pushnil(L);
+    lua_rawseti(L, -3, id);
+    loop->active--;
+    if (status != LUA_OK) {
+        lua_xmove(co, L, 1); // threads co error
+        lua_error(L);
+    }
+    lua_pop(L, 2);
+}
+
+/* loop fn [args...] -- id */
+static int
+process_loop_spawn(lua_State* L) {
+    process_loop* loop = luaL_checkudata(L, 1, PROCESS_LOOP_METATABLE);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+    int nargs = lua_gettop(L) - 1;
+    lua_State* co = lua_newthread(L); // loop fn args... co
+    lua_rotate(L, 2, 1);              // loop co fn args...
+    lua_xmove(L, co, nargs);          // loop co
+    lua_Integer id = ++loop->next_id;
+    lua_getiuservalue(L, 1, LOOP_THREADS);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, id);
+    lua_pop(L, 1);
+    loop->active++;
+    loop_push_ready(L, loop, id);
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+/* loop -- true/nil error; runs until all coroutines finish */
+static int
+process_loop_run(lua_State* L) {
+    process_loop* loop = luaL_checkudata(L, 1, PROCESS_LOOP_METATABLE);
+    lua_settop(L, 1);
+    event_engine_event events[LOOP_MAX_EVENTS];
+    while (loop->active > 0) {
+        while (loop->ready_head != loop->ready_tail) {
+            lua_getiuservalue(L, 1, LOOP_READY);
+            lua_rawgeti(L, -1, loop->ready_head);
+            lua_Integer id = lua_tointeger(L, -1);
+            lua_pushnil(L);
+            lua_rawseti(L, -3, loop->ready_head++);
+            lua_pop(L, 2);
+            loop_resume(L, loop, id);
+        }
+        if (loop->active == 0) {
+            break;
+        }
+
+        lua_getiuservalue(L, 1, LOOP_RETRY);
+        int retry = lua_gettop(L);
+        lua_Integer retries = (lua_Integer)lua_rawlen(L, retry);
+        int n = event_engine_wait(loop->engine, events, LOOP_MAX_EVENTS, retries > 0 ? LOOP_RETRY_MS : -1);
+        if (n == -1) {
+            return push_error(L, NULL);
+        }
+        for (int i = 0; i < n; i++) {
+            lua_Integer id = (lua_Integer)events[i].token;
+            lua_getiuservalue(L, 1, LOOP_WAITS);
+            int waiting = lua_rawgeti(L, -1, id) == LUA_TTABLE;
+            lua_pop(L, 2);
+            if (waiting) { // several fds of one coroutine may fire together
+                loop_unregister_waits(L, loop, id);
+                loop_push_ready(L, loop, id);
+            }
+        }
+        for (lua_Integer i = 1; i <= retries; i++) {
+            lua_rawgeti(L, retry, i);
+            loop_push_ready(L, loop, lua_tointeger(L, -1));
+            lua_pop(L, 1);
+        }
+        lua_newtable(L);
+        lua_setiuservalue(L, 1, LOOP_RETRY);
+        lua_settop(L, 1);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int
+process_loop_tostring(lua_State* L) {
+    process_loop* loop = luaL_checkudata(L, 1, PROCESS_LOOP_METATABLE);
+    lua_pushfstring(L, "process loop (%d active)", loop->active);
+    return 1;
+}
+
+static int
+process_loop_close(lua_State* L) {
+    process_loop* loop = luaL_checkudata(L, 1, PROCESS_LOOP_METATABLE);
+    event_engine_free(loop->engine);
+    loop->engine = NULL;
+    return 0;
+}
+#endif
+
+/* -- loop/nil error */
+int
+process_loop_new(lua_State* L) {
+#ifdef _WIN32
+    return push_error(L, "async api is not supported on this platform");
+#else
+    process_loop* loop = lua_newuserdatauv(L, sizeof(process_loop), 4);
+    memset(loop, 0, sizeof(process_loop));
+    luaL_getmetatable(L, PROCESS_LOOP_METATABLE);
+    lua_setmetatable(L, -2);
+    loop->ready_head = loop->ready_tail = 1;
+    loop->engine = event_engine_new();
+    if (loop->engine == NULL) {
+        return push_error(L, NULL);
+    }
+    for (int i = LOOP_THREADS; i <= LOOP_RETRY; i++) {
+        lua_newtable(L);
+        lua_setiuservalue(L, -2, i);
+    }
+    return 1;
+#endif
+}
+
+/*
+** Creates process loop metatable.
+*/
+int
+process_loop_create_meta(lua_State* L) {
+    luaL_newmetatable(L, PROCESS_LOOP_METATABLE);
+#ifndef _WIN32
+    /* Method table */
+    lua_newtable(L);
+    lua_pushcfunction(L, process_loop_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, process_loop_spawn);
+    lua_setfield(L, -2, "spawn");
+    lua_pushcfunction(L, process_loop_run);
+    lua_setfield(L, -2, "run");
+
+    lua_pushstring(L, PROCESS_LOOP_METATABLE);
+    lua_setfield(L, -2, "__type");
+    /* Metamethods */
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, process_loop_close);
+    lua_setfield(L, -2, "__gc");
+#endif
+    return 1;
+}
@@ -0,0 +1,20 @@
+#ifndef ELI_PROCESS_ASYNC_H_
+#define ELI_PROCESS_ASYNC_H_
+#include "lua.h"
+
+/*
+** Async variants suspend the running coroutine instead of blocking. They yield one or more
+** (fd, interest) pairs where interest is "r" or "w"; fd is nil when there is nothing to watch and
+** the operation should be retried shortly. Resume (with any values) once any of the fds is ready.
+** Called outside of a coroutine they block.
+*/
+
+#define PROCESS_LOOP_METATABLE "ELI_PROCESS_LOOP"
+
+int process_wait_async(lua_State* L);
+int process_read_async(lua_State* L);
+int process_write_async(lua_State* L);
+int proc_exec_async(lua_State* L);
+int process_loop_new(lua_State* L);
+int process_loop_create_meta(lua_State* L);
+#endif
@@ -16,6 +16,7 @@
 #include <windows.h>
 #include "kill.h"
 #else
+#include <errno.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #endif
@@ -235,6 +236,22 @@ process_group_kill(lua_State* L) {
         return push_error(L, NULL);
     }
 #else
+    if (p->gid == -1) {             // no kernel process group, signal members directly
+        lua_getiuservalue(L, 1, 1); // process-group process-table
+        lua_pushnil(L);
+        while (lua_next(L, -2) != 0) {
+            process* proc = (process*)luaL_testudata(L, -1, PROCESS_METATABLE); // key, proc/nil
+            lua_pop(L, 1);
+            if (proc == NULL || proc->status != -1) {
+                continue;
+            }
+            if (kill(proc->pid, signal) == -1 && errno != ESRCH) {
+                return push_error(L, NULL);
+            }
+        }
+        lua_pushboolean(L, 1);
+        return 1;
+    }
     int const status = kill(-p->gid, signal);
     if (status == -1) {
         return push_error(L, NULL);
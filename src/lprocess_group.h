@@ -15,7 +15,7 @@
 typedef struct process_group {
     int closed;
 
-    process_group_id gid;
+    process_group_id gid; // posix: -1 for groups without kernel process group (members are signaled directly)
 } process_group;
 
 #define PROCESS_GROUP_METATABLE "ELI_PROCESS_GROUP"
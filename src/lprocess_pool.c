@@ -0,0 +1,461 @@
+#include "lprocess_pool.h"
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lauxlib.h"
+#include "lerror.h"
+#include "lproc.h"
+#include "lprocess.h"
+#include "lsleep.h"
+#include "lua.h"
+
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#include "event_engine.h"
+
+/* user values of pool */
+#define POOL_QUEUE     1 // array of jobs waiting for slot
+#define POOL_RUNNING   2 // job id -> job
+#define POOL_COMPLETED 3 // array of finished jobs not yet collected through results
+#define POOL_ON_EXIT   4 // default completion callback
+
+#define POOL_MAX_EVENTS 64
+
+typedef struct process_pool {
+    int max;         // max concurrently running jobs
+    int queue_limit; // max queued jobs, 0 - unlimited
+    int running;
+    int unpollable; // running jobs without pidfd, their exit is checked by polling
+    lua_Integer next_id;
+    lua_Integer queue_head, queue_tail;
+    lua_Integer completed_head, completed_tail;
+    event_engine* engine;
+} process_pool;
+
+static long long
+monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* job -- job; spawns job, returns 1 if it runs */
+static int
+pool_start_job(lua_State* L, process_pool* pool, int job) {
+    lua_pushcfunction(L, eli_spawn);
+    int nargs = 1;
+    if (lua_getfield(L, job, "cmd") == LUA_TSTRING) {
+        if (lua_getfield(L, job, "opts") == LUA_TNIL) {
+            lua_pop(L, 1);
+        } else {
+            nargs = 2;
+        }
+    }
+    if (lua_pcall(L, nargs, 2, 0) != LUA_OK) { // job err
+        lua_setfield(L, job, "error");
+        return 0;
+    }
+    process* proc = luaL_testudata(L, -2, PROCESS_METATABLE); // job proc/nil nil/err
+    if (proc == NULL) {
+        lua_setfield(L, job, "error");
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pop(L, 1);
+    lua_setfield(L, job, "process"); // job
+
+    lua_getfield(L, job, "id");
+    lua_Integer id = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    int pollable = proc->pidfd >= 0 && event_engine_add(pool->engine, proc->pidfd, EVENT_ENGINE_READ, (uint64_t)id) == 0;
+    if (pollable && proc->deadline.at != 0) { // deadline timer wakes pool up to enforce spawn timeout
+        if (proc->deadline.timerfd < 0
+            || event_engine_add(pool->engine, proc->deadline.timerfd, EVENT_ENGINE_READ, (uint64_t)id) == -1) {
+            event_engine_remove(pool->engine, proc->pidfd);
+            pollable = 0;
+        }
+    }
+    if (!pollable) {
+        lua_pushboolean(L, 1);
+        lua_setfield(L, job, "polled");
+        pool->unpollable++;
+    }
+    return 1;
+}
+
+/* starts queued jobs while there are free slots, jobs which failed to spawn go to finished */
+static void
+pool_fill(lua_State* L, process_pool* pool, int finished) {
+    if (pool->running >= pool->max || pool->queue_head == pool->queue_tail) {
+        return;
+    }
+    lua_getiuservalue(L, 1, POOL_QUEUE);
+    lua_getiuservalue(L, 1, POOL_RUNNING); // queue running
+    int queue = lua_gettop(L) - 1, running = queue + 1;
+    while (pool->running < pool->max && pool->queue_head != pool->queue_tail) {
+        lua_rawgeti(L, queue, pool->queue_head); // queue running job
+        lua_pushnil(L);
+        lua_rawseti(L, queue, pool->queue_head++);
+        int job = lua_gettop(L);
+        if (pool_start_job(L, pool, job)) {
+            lua_getfield(L, job, "id");
+            lua_pushvalue(L, job);
+            lua_rawset(L, running); // queue running job
+            pool->running++;
+            lua_pop(L, 1); // queue running
+        } else {
+            lua_rawseti(L, finished, (lua_Integer)lua_rawlen(L, finished) + 1); // queue running
+        }
+    }
+    lua_pop(L, 2);
+}
+
+/* running[id] -- ; moves job to finished when its process exited */
+static void
+pool_check_job(lua_State* L, process_pool* pool, int running, lua_Integer id, int finished) {
+    if (lua_rawgeti(L, running, id) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_getfield(L, -1, "process");
+    process* proc = lua_touserdata(L, -1);
+    lua_getfield(L, -2, "polled"); // job proc polled
+    int polled = lua_toboolean(L, -1);
+    lua_pop(L, 2); // job
+    if (process_check_exit(proc) == 0) {
+        lua_pop(L, 1);
+        return;
+    }
+    if (polled) {
+        pool->unpollable--;
+    } else {
+        event_engine_remove(pool->engine, proc->pidfd);
+        if (proc->deadline.timerfd >= 0) {
+            event_engine_remove(pool->engine, proc->deadline.timerfd);
+        }
+    }
+    pool->running--;
+    lua_rawseti(L, finished, (lua_Integer)lua_rawlen(L, finished) + 1);
+    lua_pushnil(L);
+    lua_rawseti(L, running, id);
+}
+
+/* -- finished; waits up to timeout_ms for exits, refills slots right away */
+static int
+pool_poll(lua_State* L, process_pool* pool, int timeout_ms) {
+    lua_newtable(L);
+    int finished = lua_gettop(L);
+    pool_fill(L, pool, finished);
+    long long deadline = timeout_ms < 0 ? -1 : monotonic_ms() + timeout_ms;
+    event_engine_event events[POOL_MAX_EVENTS];
+
+    lua_getiuservalue(L, 1, POOL_RUNNING); // finished running
+    int running = finished + 1;
+    while (pool->running > 0) {
+        int wait_ms = deadline < 0 ? -1 : (int)(deadline - monotonic_ms());
+        if (wait_ms < 0 && deadline >= 0) {
+            wait_ms = 0;
+        }
+        if (pool->unpollable > 0 && (wait_ms < 0 || wait_ms > 1)) {
+            wait_ms = 1;
+        }
+        int n = event_engine_wait(pool->engine, events, POOL_MAX_EVENTS, wait_ms);
+        if (n == -1) {
+            return push_error(L, NULL);
+        }
+        for (int i = 0; i < n; i++) {
+            pool_check_job(L, pool, running, (lua_Integer)events[i].token, finished);
+        }
+        if (pool->unpollable > 0) {
+            lua_pushnil(L);
+            while (lua_next(L, running) != 0) { // finished running id job
+                lua_getfield(L, -1, "polled");
+                int polled = lua_toboolean(L, -1);
+                lua_pop(L, 2); // finished running id
+                if (polled) {
+                    pool_check_job(L, pool, running, lua_tointeger(L, -1), finished);
+                }
+            }
+        }
+        pool_fill(L, pool, finished);
+        if (lua_rawlen(L, finished) > 0 || (deadline >= 0 && monotonic_ms() >= deadline)) {
+            break;
+        }
+    }
+    lua_pop(L, 1); // finished
+    return 0;
+}
+
+/* finished -- ; runs callbacks or queues jobs for results, returns number of finished jobs */
+static int
+pool_dispatch(lua_State* L, process_pool* pool, int finished) {
+    int n = (int)lua_rawlen(L, finished);
+    for (int i = 1; i <= n; i++) {
+        lua_rawgeti(L, finished, i); // job
+        if (lua_getfield(L, -1, "callback") == LUA_TNIL) {
+            lua_pop(L, 1);
+            lua_getiuservalue(L, 1, POOL_ON_EXIT);
+        }
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            lua_getiuservalue(L, 1, POOL_COMPLETED);
+            lua_rotate(L, -2, 1);
+            lua_rawseti(L, -2, pool->completed_tail++);
+            lua_pop(L, 1);
+            continue;
+        }
+        // callback(process/nil, id, error/nil)
+        lua_getfield(L, -2, "process");
+        lua_getfield(L, -3, "id");
+        lua_getfield(L, -4, "error"); // job callback process id error
+        lua_call(L, 3, 0);
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return n;
+}
+
+/* pool cmd [opts, callback] -- id/nil error */
+static int
+process_pool_submit(lua_State* L) {
+    process_pool* pool = luaL_checkudata(L, 1, PROCESS_POOL_METATABLE);
+    lua_settop(L, 4);
+    if (lua_type(L, 2) != LUA_TSTRING && lua_type(L, 2) != LUA_TTABLE) {
+        return luaL_typeerror(L, 2, "string or table");
+    }
+    if (!lua_isnoneornil(L, 3) && !lua_istable(L, 3)) {
+        return luaL_typeerror(L, 3, "table");
+    }
+    if (!lua_isnoneornil(L, 4) && !lua_isfunction(L, 4)) {
+        return luaL_typeerror(L, 4, "function");
+    }
+    if (pool->queue_limit > 0 && pool->queue_tail - pool->queue_head >= pool->queue_limit) {
+        return push_error(L, "pool queue is full");
+    }
+
+    lua_Integer id = ++pool->next_id;
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, id);
+    lua_setfield(L, -2, "id");
+    lua_pushvalue(L, 2);
+    lua_setfield(L, -2, "cmd");
+    lua_pushvalue(L, 3);
+    lua_setfield(L, -2, "opts");
+    lua_pushvalue(L, 4);
+    lua_setfield(L, -2, "callback");
+
+    lua_getiuservalue(L, 1, POOL_QUEUE);
+    lua_rotate(L, -2, 1);
+    lua_rawseti(L, -2, pool->queue_tail++);
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    int finished = lua_gettop(L);
+    pool_fill(L, pool, finished);
+    pool_dispatch(L, pool, finished);
+
+    lua_pushinteger(L, id);
+    return 1;
+}
+
+/* pool [timeout, unit] -- finished_count */
+static int
+process_pool_wait(lua_State* L) {
+    process_pool* pool = luaL_checkudata(L, 1, PROCESS_POOL_METATABLE);
+    int duration = (int)luaL_optnumber(L, 2, 0);
+    double divider = get_ms_divider_from_state(L, 3, 1.0);
+    int res = pool_poll(L, pool, duration > 0 ? (int)(duration / divider) : -1);
+    if (res != 0) {
+        return res;
+    }
+    lua_pushinteger(L, pool_dispatch(L, pool, lua_gettop(L)));
+    return 1;
+}
+
+/* pool -- ; waits for all submitted jobs */
+static int
+process_pool_run(lua_State* L) {
+    process_pool* pool = luaL_checkudata(L, 1, PROCESS_POOL_METATABLE);
+    lua_settop(L, 1);
+    int total = 0;
+    while (pool->running > 0 || pool->queue_head != pool->queue_tail) {
+        int res = pool_poll(L, pool, -1);
+        if (res != 0) {
+            return res;
+        }
+        total += pool_dispatch(L, pool, lua_gettop(L));
+    }
+    lua_pushinteger(L, total);
+    return 1;
+}
+
+/* pool -- id process/nil error/nil */
+static int
+process_pool_results_next(lua_State* L) {
+    lua_settop(L, 0);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    process_pool* pool = luaL_checkudata(L, 1, PROCESS_POOL_METATABLE);
+    while (pool->completed_head == pool->completed_tail) {
+        if (pool->running == 0 && pool->queue_head == pool->queue_tail) {
+            lua_pushnil(L);
+            return 1;
+        }
+        int res = pool_poll(L, pool, -1);
+        if (res != 0) {
+            return res;
+        }
+        pool_dispatch(L, pool, lua_gettop(L));
+    }
+    lua_getiuservalue(L, 1, POOL_COMPLETED);
+    lua_rawgeti(L, -1, pool->completed_head); // completed job
+    lua_pushnil(L);
+    lua_rawseti(L, -3, pool->completed_head++);
+    lua_getfield(L, -1, "id");
+    lua_getfield(L, -2, "process");
+    lua_getfield(L, -3, "error");
+    return 3;
+}
+
+/* pool -- iterator */
+static int
+process_pool_results(lua_State* L) {
+    luaL_checkudata(L, 1, PROCESS_POOL_METATABLE);
+    lua_pushvalue(L, 1);
+    lua_pushcclosure(L, process_pool_results_next, 1);
+    return 1;
+}
+
+/* pool [signal] -- true */
+static int
+process_pool_kill(lua_State* L) {
+    luaL_checkudata(L, 1, PROCESS_POOL_METATABLE);
+    int signal = (int)luaL_optnumber(L, 2, SIGTERM);
+    lua_getiuservalue(L, 1, POOL_RUNNING);
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+        lua_getfield(L, -1, "process");
+        process* proc = lua_touserdata(L, -1);
+        if (proc != NULL && proc->status == -1) {
+            kill(proc->pid, signal);
+        }
+        lua_pop(L, 2);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/* pool -- { running, queued, completed } */
+static int
+process_pool_stats(lua_State* L) {
+    process_pool* pool = luaL_checkudata(L, 1, PROCESS_POOL_METATABLE);
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, pool->max);
+    lua_setfield(L, -2, "max");
+    lua_pushinteger(L, pool->running);
+    lua_setfield(L, -2, "running");
+    lua_pushinteger(L, pool->queue_tail - pool->queue_head);
+    lua_setfield(L, -2, "queued");
+    lua_pushinteger(L, pool->completed_tail - pool->completed_head);
+    lua_setfield(L, -2, "completed");
+    return 1;
+}
+
+static int
+process_pool_tostring(lua_State* L) {
+    process_pool* pool = luaL_checkudata(L, 1, PROCESS_POOL_METATABLE);
+    lua_pushfstring(L, "process pool (%d/%d running)", pool->running, pool->max);
+    return 1;
+}
+
+static int
+process_pool_close(lua_State* L) {
+    process_pool* pool = luaL_checkudata(L, 1, PROCESS_POOL_METATABLE);
+    event_engine_free(pool->engine);
+    pool->engine = NULL;
+    return 0;
+}
+#endif
+
+/* [{ max, queue_limit, on_exit }] -- pool/nil error */
+int
+process_pool_new(lua_State* L) {
+#ifdef _WIN32
+    return push_error(L, "process pool is not supported on this platform");
+#else
+    int max = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int queue_limit = 0;
+    if (lua_type(L, 1) == LUA_TTABLE) {
+        lua_getfield(L, 1, "max");
+        max = (int)luaL_optinteger(L, -1, max);
+        lua_getfield(L, 1, "queue_limit");
+        queue_limit = (int)luaL_optinteger(L, -1, 0);
+        lua_getfield(L, 1, "on_exit");
+        if (!lua_isnil(L, -1) && !lua_isfunction(L, -1)) {
+            return luaL_error(L, "bad on_exit option (function expected, got %s)", luaL_typename(L, -1));
+        }
+    } else {
+        lua_pushnil(L);
+    }
+    if (max <= 0) {
+        max = 1;
+    }
+
+    process_pool* pool = lua_newuserdatauv(L, sizeof(process_pool), 4); // ... on_exit pool
+    memset(pool, 0, sizeof(process_pool));
+    luaL_getmetatable(L, PROCESS_POOL_METATABLE);
+    lua_setmetatable(L, -2);
+    pool->max = max;
+    pool->queue_limit = queue_limit;
+    pool->queue_head = pool->queue_tail = 1;
+    pool->completed_head = pool->completed_tail = 1;
+    pool->engine = event_engine_new();
+    if (pool->engine == NULL) {
+        return push_error(L, NULL);
+    }
+    lua_newtable(L);
+    lua_setiuservalue(L, -2, POOL_QUEUE);
+    lua_newtable(L);
+    lua_setiuservalue(L, -2, POOL_RUNNING);
+    lua_newtable(L);
+    lua_setiuservalue(L, -2, POOL_COMPLETED);
+    lua_rotate(L, -2, 1); // ... pool on_exit
+    lua_setiuservalue(L, -2, POOL_ON_EXIT);
+    return 1;
+#endif
+}
+
+/*
+** Creates process pool metatable.
+*/
+int
+process_pool_create_meta(lua_State* L) {
+    luaL_newmetatable(L, PROCESS_POOL_METATABLE);
+#ifndef _WIN32
+    /* Method table */
+    lua_newtable(L);
+    lua_pushcfunction(L, process_pool_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, process_pool_submit);
+    lua_setfield(L, -2, "submit");
+    lua_pushcfunction(L, process_pool_wait);
+    lua_setfield(L, -2, "wait");
+    lua_pushcfunction(L, process_pool_run);
+    lua_setfield(L, -2, "run");
+    lua_pushcfunction(L, process_pool_results);
+    lua_setfield(L, -2, "results");
+    lua_pushcfunction(L, process_pool_kill);
+    lua_setfield(L, -2, "kill");
+    lua_pushcfunction(L, process_pool_stats);
+    lua_setfield(L, -2, "stats");
+
+    lua_pushstring(L, PROCESS_POOL_METATABLE);
+    lua_setfield(L, -2, "__type");
+    /* Metamethods */
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, process_pool_close);
+    lua_setfield(L, -2, "__gc");
+#endif
+    return 1;
+}
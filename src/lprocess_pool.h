@@ -0,0 +1,9 @@
+#ifndef ELI_PROCESS_POOL_H_
+#define ELI_PROCESS_POOL_H_
+#include "lua.h"
+
+#define PROCESS_POOL_METATABLE "ELI_PROCESS_POOL"
+
+int process_pool_new(lua_State* L);
+int process_pool_create_meta(lua_State* L);
+#endif
@@ -1,13 +1,39 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // sched_setaffinity
+#endif
 #include "lauxlib.h"
 #include "lerror.h"
 #include "lprocess.h"
+#include "lproc_list.h"
 #include "lprocess_group.h"
 #include "lua.h"
 
 #include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include "lspawn.h"
+#include "spawn_server.h"
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#define IOPRIO_WHO_PROCESS 1
+#endif
+
+/* user values of spawn params, keep argv/env vectors and pinned executables alive as long as params */
+#define SPAWN_PARAM_ARGV       1
+#define SPAWN_PARAM_ENV        2
+#define SPAWN_PARAM_LISTEN_ENV 3
+#define SPAWN_PARAM_COMMAND    4
+#define SPAWN_PARAM_EXECUTABLE 5
+#define SPAWN_PARAM_USERVALUES 5
+
+#define LISTEN_PID_PREFIX "LISTEN_PID="
+
+#define SPAWN_PARAM_METATABLE "ELI_PROCESS_SPAWN_PARAMS"
 
 #ifdef _WIN32
 /* quotes and adds argument string to b */
@@ -40,10 +66,36 @@ add_argument(luaL_Buffer* b, const char* s) {
 #define close _close
 #endif
 
+/* stdio channels not handed over to a process, options failed to parse or spawn was not attempted */
+void
+spawn_param_close_stdio(spawn_params* p) {
+    for (int i = STDIO_STDIN; i <= STDIO_STDERR; i++) {
+        stdio_channel* channel = p->stdio[i];
+        for (int j = i; j <= STDIO_STDERR; j++) {
+            if (p->stdio[j] == channel) { // output shares one channel
+                p->stdio[j] = NULL;
+            }
+        }
+        close_stdio_channel(channel);
+    }
+}
+
+static int
+spawn_param_gc(lua_State* L) {
+    spawn_param_close_stdio((spawn_params*)lua_touserdata(L, 1));
+    return 0;
+}
+
 spawn_params*
 spawn_param_init(lua_State* L) {
-    spawn_params* p = lua_newuserdatauv(L, sizeof *p, 0);
+    spawn_params* p = lua_newuserdatauv(L, sizeof *p, SPAWN_PARAM_USERVALUES);
     memset(p, 0, sizeof *p);
+    if (luaL_newmetatable(L, SPAWN_PARAM_METATABLE)) {
+        lua_pushcfunction(L, spawn_param_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+    p->stack_index = lua_gettop(L);
 #ifdef _WIN32
     static const STARTUPINFO si = {sizeof si};
     p->cmdline = p->environment = 0;
@@ -52,12 +104,21 @@ spawn_param_init(lua_State* L) {
     p->command = 0;
     p->argv = p->envp = 0;
     p->redirect[0] = p->redirect[1] = p->redirect[2] = -1;
+    p->sched_policy = -1;
+    p->ioprio = -1;
+    p->cwd_fd = -1;
+    p->exec_fd = -1;
+    p->umask = (mode_t)-1;
+    p->use_spawn_server = 1;
+    p->kill_signal = SIGTERM;
 #endif
+    p->cwd = NULL;
     p->username = NULL;
     p->password = NULL;
     p->stdio[STDIO_STDIN] = NULL;
     p->stdio[STDIO_STDOUT] = NULL;
     p->stdio[STDIO_STDERR] = NULL;
+    spawn_timing_start(&p->timing, L);
     return p;
 }
 
@@ -78,7 +139,7 @@ spawn_param_filename(spawn_params* p, const char* filename) {
  * Therefore, any function which calls this must make sure that these strings
  * remain available until the userdatum is thrown away.
  */
-/* ... array -- ... vector */
+/* ... array -- ... array vector */
 static const char**
 get_argv(lua_State* L) {
     size_t i;
@@ -96,7 +157,6 @@ get_argv(lua_State* L) {
         lua_pop(L, 1); /* ... argt argv */
     }
     argv[n + 1] = 0;
-    lua_pop(L, 1); /* ... argt */
 
     return argv;
 }
@@ -123,55 +183,82 @@ to_win_argv(lua_State* L, const char** argv) {
 #endif
 
 /* ... argtab -- ... argtab vector */
+/* vector (command line on windows) has to stay on the stack as long as params are in use */
 void
-spawn_param_args(lua_State* L, spawn_params* p) {
-    const char** argv = get_argv(L); // cmd opts argv
+spawn_param_args_pinned(lua_State* L, spawn_params* p) {
+    const char** argv = get_argv(L); // argtab argv
 #ifdef _WIN32
     argv[0] = lua_tostring(L, 1);
     // build_cmdline(L, argv); // cmdline opts
-    p->cmdline = to_win_argv(L, argv);
+    lua_pushstring(L, to_win_argv(L, argv)); // argtab argv cmdline
+    lua_replace(L, -2);                      // argtab cmdline
+    p->cmdline = lua_tostring(L, -1);
 #else
     argv[0] = p->command;
     p->argv = argv;
 #endif
 }
 
+/* ... argtab -- ... argtab */
+void
+spawn_param_args(lua_State* L, spawn_params* p) {
+    spawn_param_args_pinned(L, p);
+    lua_setiuservalue(L, p->stack_index, SPAWN_PARAM_ARGV); // keep vector alive with params
+}
+
+/* env = { inherit = false, ... } is plain env table */
+static int
+is_inherit_flag(lua_State* L, int k, int v) {
+    return lua_type(L, k) == LUA_TSTRING && strcmp(lua_tostring(L, k), "inherit") == 0 && lua_isboolean(L, v);
+}
+
 /* ... envtab -- ... envtab vector */
+/* pointers and "name=value" strings share one userdatum, nothing has to be freed */
 static const char**
 get_env(lua_State* L) {
-    size_t i = 0;
+    size_t n = 0, size = 0;
     lua_pushnil(L); /* ... envtab nil */
-    size_t n = 0;
-    for (i = 1; lua_next(L, -2); i++) { // envtab k v
-        lua_pop(L, 1);                  // envtab k
-        n++;
-    } // envtab
-
-    const char** env = lua_newuserdatauv(L, (n + 1) * sizeof *env, 0); // envtab env
-    lua_pushnil(L);                                                    // envtab env nil
-
-    for (i = 0; lua_next(L, -3); i++) { /* ... envtab env k v */
-        size_t klen, vlen;
-        const char* k = lua_tolstring(L, -2, &klen);
-        if (!k) {
+    while (lua_next(L, -2)) { /* ... envtab k v */
+        if (is_inherit_flag(L, -2, -1)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        if (lua_type(L, -2) != LUA_TSTRING) {
             luaL_error(L, "expected string for environment variable name, got %s", lua_typename(L, lua_type(L, -2)));
             return NULL;
         }
-        const char* v = lua_tolstring(L, -1, &vlen);
-        if (!v) {
+        size_t klen, vlen;
+        lua_tolstring(L, -2, &klen);
+        if (!lua_tolstring(L, -1, &vlen)) {
             luaL_error(L, "expected string for environment variable value, got %s", lua_typename(L, lua_type(L, -1)));
             return NULL;
         }
-        lua_pop(L, 1); // envtab env k
+        size += klen + vlen + 2;
+        n++;
+        lua_pop(L, 1); /* ... envtab k */
+    } /* ... envtab */
+
+    const char** env = lua_newuserdatauv(L, (n + 1) * sizeof *env + size, 0); /* ... envtab env */
+    char* t = (char*)(env + n + 1);
+    size_t i = 0;
+    lua_pushnil(L); /* ... envtab env nil */
+    while (lua_next(L, -3)) { /* ... envtab env k v */
+        if (is_inherit_flag(L, -2, -1)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        size_t klen, vlen;
+        const char* k = lua_tolstring(L, -2, &klen);
+        const char* v = lua_tolstring(L, -1, &vlen);
+        lua_pop(L, 1); /* ... envtab env k */
 
-        char* t = malloc((klen + vlen + 2) * sizeof(char));
         memcpy(t, k, klen);
         t[klen] = '=';
         memcpy(t + klen + 1, v, vlen + 1);
-        env[i] = t;
+        env[i++] = t;
+        t += klen + vlen + 2;
     } /* ... envtab env */
     env[n] = 0;
-    lua_pop(L, 1); // ... envtab
     return env;
 }
 
@@ -185,24 +272,213 @@ to_win_env(lua_State* L, const char** env) {
         luaL_addlstring(&b, s, strlen(s) + 1); // add string including '\0'
     }
     luaL_addchar(&b, '\0'); // final '\0'
-    luaL_pushresult(&b);
-
-    const char* winEnv = luaL_tolstring(L, -1, NULL);
-    lua_pop(L, 2); // luaL_tolstring pushes a copy of the string so we have to pop twice
-    return winEnv;
+    luaL_pushresult(&b);     // ... env winEnv
+    return lua_tostring(L, -1);
 }
 #endif
 
+/* ... envtab -- ... envtab */
 void
 spawn_param_env(lua_State* L, spawn_params* p) {
-    const char** env = get_env(L);
+    const char** env = get_env(L); // envtab env
 #ifdef _WIN32
-    p->environment = to_win_env(L, env);
+    p->environment = to_win_env(L, env);                   // envtab env winEnv
+    lua_setiuservalue(L, p->stack_index, SPAWN_PARAM_ENV); // envtab env
+    lua_pop(L, 1);                                         // envtab
 #else
     p->envp = env;
+    lua_setiuservalue(L, p->stack_index, SPAWN_PARAM_ENV); // envtab
 #endif
 }
 
+#ifndef _WIN32
+#define ENV_OVERLAY_METATABLE "ELI_PROCESS_ENV_OVERLAY"
+
+/*
+** Merged environment vector, holds reference to environment snapshot its inherited entries point into.
+** Overrides, vector and strings live in the user value, sized once the snapshot is known.
+*/
+typedef struct env_overlay {
+    env_snapshot* snapshot;
+    const char** envp;
+} env_overlay;
+
+static int
+env_overlay_gc(lua_State* L) {
+    env_overlay* overlay = lua_touserdata(L, 1);
+    env_snapshot_release(overlay->snapshot);
+    overlay->snapshot = NULL;
+    return 0;
+}
+
+/* ... k v -- ... k v; checks one override, returns size of its "NAME=value" entry (0 - removal) */
+static size_t
+env_override_size(lua_State* L, int removal_allowed) {
+    if (lua_type(L, -2) != LUA_TSTRING) {
+        luaL_error(L, "expected string for environment variable name, got %s", luaL_typename(L, -2));
+    }
+    if (removal_allowed && lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+        return 0;
+    }
+    size_t klen, vlen;
+    lua_tolstring(L, -2, &klen);
+    if (lua_type(L, -1) != LUA_TSTRING && lua_type(L, -1) != LUA_TNUMBER) {
+        luaL_error(L, "expected string for environment variable value, got %s", luaL_typename(L, -1));
+    }
+    lua_tolstring(L, -1, &vlen);
+    return klen + vlen + 2;
+}
+
+/* ... k v -- ... k v */
+static void
+env_add_override(lua_State* L, env_override* o, char** strings, size_t order) {
+    size_t klen, vlen;
+    const char* k = lua_tolstring(L, -2, &klen);
+    o->name_len = klen;
+    o->order = order;
+    if (lua_isboolean(L, -1)) { // false - remove
+        o->name = k; // anchored by options table
+        o->entry = NULL;
+        return;
+    }
+    lua_pushvalue(L, -1); // ... k v v, tolstring would convert number value in table in place
+    const char* v = lua_tolstring(L, -1, &vlen);
+    char* t = *strings;
+    memcpy(t, k, klen);
+    t[klen] = '=';
+    memcpy(t + klen + 1, v, vlen + 1);
+    lua_pop(L, 1);
+    o->name = t;
+    o->entry = t;
+    *strings += klen + vlen + 2;
+}
+
+/*
+** Parent environment with changes applied in C: envtab { inherit = true, NAME = value | false },
+** addtab { NAME = value }, removetab { NAME, ... } (0 - not given). Later sources win.
+*/
+void
+spawn_param_env_overlay(lua_State* L, spawn_params* p, int envtab, int addtab, int removetab) {
+    size_t count = 0, size = 0;
+    int tabs[2] = {envtab, addtab};
+    for (int t = 0; t < 2; t++) {
+        if (tabs[t] == 0) {
+            continue;
+        }
+        lua_pushnil(L);
+        while (lua_next(L, tabs[t])) { /* ... k v */
+            if (!(tabs[t] == envtab && is_inherit_flag(L, -2, -1))) {
+                size += env_override_size(L, tabs[t] == envtab);
+                count++;
+            }
+            lua_pop(L, 1);
+        }
+    }
+    size_t removals = removetab != 0 ? lua_rawlen(L, removetab) : 0;
+    for (size_t i = 1; i <= removals; i++) {
+        if (lua_rawgeti(L, removetab, (lua_Integer)i) != LUA_TSTRING) {
+            luaL_error(L, "expected string for environment variable name, got %s", luaL_typename(L, -1));
+        }
+        lua_pop(L, 1);
+    }
+    count += removals;
+
+    // snapshot is acquired only once its holder is collectable, errors below release it
+    env_overlay* overlay = lua_newuserdatauv(L, sizeof(env_overlay), 1);
+    overlay->snapshot = NULL;
+    overlay->envp = NULL;
+    if (luaL_newmetatable(L, ENV_OVERLAY_METATABLE)) {
+        lua_pushcfunction(L, env_overlay_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2); /* ... overlay */
+    env_snapshot* snapshot = overlay->snapshot = env_snapshot_acquire();
+    if (snapshot == NULL) {
+        luaL_error(L, "failed to snapshot environment");
+    }
+    size_t inherited = env_snapshot_count(snapshot);
+    env_override* overrides =
+        lua_newuserdatauv(L, count * sizeof(env_override) + (inherited + count + 1) * sizeof(char*) + size, 0);
+    lua_setiuservalue(L, -2, 1); /* ... overlay */
+    overlay->envp = (const char**)(overrides + count);
+    char* strings = (char*)(overlay->envp + inherited + count + 1);
+    size_t n = 0;
+    for (int t = 0; t < 2; t++) {
+        if (tabs[t] == 0) {
+            continue;
+        }
+        lua_pushnil(L);
+        while (lua_next(L, tabs[t])) { /* ... overlay k v */
+            if (!(tabs[t] == envtab && is_inherit_flag(L, -2, -1))) {
+                env_add_override(L, &overrides[n], &strings, n);
+                n++;
+            }
+            lua_pop(L, 1);
+        }
+    }
+    for (size_t i = 1; i <= removals; i++) {
+        lua_rawgeti(L, removetab, (lua_Integer)i);
+        overrides[n].name = lua_tolstring(L, -1, &overrides[n].name_len); // anchored by removetab
+        overrides[n].entry = NULL;
+        overrides[n].order = n;
+        n++;
+        lua_pop(L, 1);
+    }
+    env_snapshot_merge(snapshot, overrides, count, overlay->envp);
+    p->envp = overlay->envp;
+    lua_setiuservalue(L, p->stack_index, SPAWN_PARAM_ENV); /* ... */
+}
+
+static int
+is_listen_variable(const char* s) {
+    return strncmp(s, "LISTEN_FDS=", 11) == 0 || strncmp(s, LISTEN_PID_PREFIX, sizeof(LISTEN_PID_PREFIX) - 1) == 0
+        || strncmp(s, "LISTEN_FDNAMES=", 15) == 0;
+}
+
+/*
+** Adds LISTEN_FDS (number of passed fds) and LISTEN_PID to child environment. Pid of the child is not known
+** before fork, so LISTEN_PID carries a placeholder child overwrites in place.
+*/
+void
+spawn_param_listen_env(lua_State* L, spawn_params* p) {
+    const char** base = p->envp != NULL ? p->envp : (const char**)environ;
+    size_t n = 0;
+    for (const char** e = base; *e != NULL; e++) {
+        n += !is_listen_variable(*e);
+    }
+    const char** env = lua_newuserdatauv(L, (n + 3) * sizeof *env + 64, 0);
+    char* strings = (char*)(env + n + 3);
+    size_t i = 0;
+    for (const char** e = base; *e != NULL; e++) {
+        if (!is_listen_variable(*e)) {
+            env[i++] = *e; // strings stay anchored by params
+        }
+    }
+    env[i++] = strings;
+    strings += sprintf(strings, "LISTEN_FDS=%d", p->fd_count) + 1;
+    env[i++] = strings;
+    sprintf(strings, LISTEN_PID_PREFIX "%s", "0000000000"); // room for any pid
+    env[i] = NULL;
+    p->envp = env;
+    lua_setiuservalue(L, p->stack_index, SPAWN_PARAM_LISTEN_ENV);
+}
+
+/* executable -- ; command is pinned executable, its path and fd stay valid as long as params */
+void
+spawn_param_command_pinned(lua_State* L, spawn_params* p, const char* path, int fd) {
+    spawn_param_filename(p, path);
+    p->exec_fd = fd;
+    lua_setiuservalue(L, p->stack_index, SPAWN_PARAM_COMMAND);
+}
+
+/* executable -- ; pinned executable run in place of command, its fd stays valid as long as params */
+void
+spawn_param_executable(lua_State* L, spawn_params* p, int fd) {
+    p->exec_fd = fd;
+    lua_setiuservalue(L, p->stack_index, SPAWN_PARAM_EXECUTABLE);
+}
+#endif
+
 #ifdef _WIN32
 void
 spawn_param_redirect(spawn_params* p, int d, HANDLE h) {
@@ -280,49 +556,373 @@ close_proc_stdio_channel(process* p, int stdKind) {
 
 #ifndef _WIN32
 
+/* reports failing stage and errno to parent, single write below PIPE_BUF is atomic */
 static void
-child_finalize_error(int error_pipe) {
-    int err = errno;
-    write(error_pipe, &err, sizeof(err));
+child_finalize_error(int error_pipe, int stage, int candidate) {
+    spawn_error error = {stage, errno, candidate};
+    write(error_pipe, &error, sizeof(error));
     close(error_pipe);
     _exit(EXIT_FAILURE);
 }
 
+/* resource limits and scheduling have to be applied before privileges are dropped */
+static int
+child_apply_limits(spawn_params* p) {
+    for (int i = 0; i < p->rlimit_count; i++) {
+        if (setrlimit(p->rlimits[i].resource, &p->rlimits[i].limit) != 0) {
+            return -1;
+        }
+    }
+#ifdef __linux__
+    if (p->has_cpu_affinity && sched_setaffinity(0, sizeof(p->cpu_affinity), (cpu_set_t*)p->cpu_affinity) != 0) {
+        return -1;
+    }
+    if (p->ioprio != -1 && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, p->ioprio) != 0) {
+        return -1;
+    }
+    if (p->sched_policy != -1) {
+        struct sched_param param = {.sched_priority = p->sched_priority};
+        if (sched_setscheduler(0, p->sched_policy, &param) != 0) {
+            return -1;
+        }
+    }
+#endif
+    if (p->has_nice) {
+        errno = 0;
+        if (nice(p->nice) == -1 && errno != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+** Extra fds are first duplicated above every target, so no source is overwritten by other's target
+** (handles overlaps and cycles), then moved to targets once stdio is in place.
+*/
+static int
+child_stash_fds(spawn_params* p, int* stashed, int* error_pipe, int* exec_fd) {
+    int base = 3;
+    for (int i = 0; i < p->fd_count; i++) {
+        if (p->fds[i].target >= base) {
+            base = p->fds[i].target + 1;
+        }
+    }
+    // fds the child still uses after placement must not be overwritten by targets either
+    int pipe_fd = fcntl(*error_pipe, F_DUPFD_CLOEXEC, base);
+    if (pipe_fd == -1) {
+        return -1;
+    }
+    *error_pipe = pipe_fd;
+    if (*exec_fd != -1) {
+        *exec_fd = fcntl(*exec_fd, F_DUPFD_CLOEXEC, base);
+        if (*exec_fd == -1) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < p->fd_count; i++) {
+        stashed[i] = fcntl(p->fds[i].fd, F_DUPFD_CLOEXEC, base);
+        if (stashed[i] == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static int
-child_init(int error_pipe, int uid, int gid, pid_t pgid, spawn_params* p) {
-    int flags = fcntl(error_pipe, F_GETFD);
-    if (flags == -1) {
-        child_finalize_error(error_pipe);
+child_place_fds(spawn_params* p, int* stashed) {
+    for (int i = 0; i < p->fd_count; i++) {
+        if (dup2(stashed[i], p->fds[i].target) == -1) { // dup2 clears FD_CLOEXEC of target
+            return -1;
+        }
     }
+    return 0;
+}
 
-    flags |= FD_CLOEXEC;
-    if (fcntl(error_pipe, F_SETFD, flags) == -1) {
-        child_finalize_error(error_pipe);
+/* fills LISTEN_PID placeholder, no allocation after fork */
+static void
+child_set_listen_pid(spawn_params* p) {
+    for (const char** e = p->envp; *e != NULL; e++) {
+        if (strncmp(*e, LISTEN_PID_PREFIX, sizeof(LISTEN_PID_PREFIX) - 1) == 0) {
+            char* digits = (char*)*e + sizeof(LISTEN_PID_PREFIX) - 1;
+            char buf[16];
+            int len = 0;
+            for (pid_t pid = getpid(); pid > 0 && len < (int)sizeof(buf); pid /= 10) {
+                buf[len++] = (char)('0' + pid % 10);
+            }
+            for (int i = 0; i < len; i++) {
+                digits[i] = buf[len - 1 - i];
+            }
+            digits[len] = '\0';
+            return;
+        }
     }
+}
+
+/*
+** Everything child needs which takes allocation or lookups (not async signal safe) is resolved before fork,
+** other threads may hold malloc/nss locks at the time of fork.
+*/
+typedef struct spawn_prepared {
+    execve_path path;
+    int own_path;  // path was resolved here (not passed in params)
+    gid_t* groups; // supplementary groups of username, NULL - keep inherited
+    int group_count;
+} spawn_prepared;
 
-    if (p->username != NULL && uid != getuid() && gid != -1 && initgroups(p->username, gid) != 0) {
-        child_finalize_error(error_pipe);
+static int
+spawn_prepare(spawn_prepared* prep, spawn_params* p, int uid, int gid) {
+    prep->groups = NULL;
+    prep->group_count = 0;
+    prep->own_path = p->path == NULL;
+    if (p->path != NULL) {
+        prep->path = *p->path;
+    } else if (execve_path_prepare(&prep->path, p->command) == -1) {
+        return -1;
+    }
+    if (p->username != NULL && uid != (int)getuid() && gid != -1) {
+        int count = 32;
+        for (;;) {
+            gid_t* groups = spawn_realloc(prep->groups, count * sizeof(gid_t));
+            if (groups == NULL) {
+                free(prep->groups);
+                if (prep->own_path) {
+                    execve_path_free(&prep->path);
+                }
+                return -1;
+            }
+            prep->groups = groups;
+            int found = count;
+            if (getgrouplist(p->username, gid, groups, &found) != -1) {
+                prep->group_count = found;
+                break;
+            }
+            count = found > count ? found : count * 2;
+        }
     }
+    return 0;
+}
 
-    if ((gid != -1 && getgid() != gid && setgid(gid) != 0) || (uid != -1 && getuid() != uid && setuid(uid) != 0)) {
-        child_finalize_error(error_pipe);
+static void
+spawn_prepared_free(spawn_prepared* prep) {
+    if (prep->own_path) {
+        execve_path_free(&prep->path);
+    }
+    free(prep->groups);
+}
+
+/* cloexec from the start, so concurrent forks in other threads do not inherit the pipe */
+int
+spawn_pipe_cloexec(int fds[2]) {
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__)
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) == -1) {
+        return -1;
+    }
+    if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1 || fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1) {
+        int err = errno;
+        close(fds[0]);
+        close(fds[1]);
+        errno = err;
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+static int
+child_init(int error_pipe, int uid, int gid, pid_t pgid, spawn_params* p, const spawn_prepared* prep) {
+#ifdef __linux__
+    if (p->death_signal != 0) {
+        if (prctl(PR_SET_PDEATHSIG, p->death_signal) != 0) {
+            child_finalize_error(error_pipe, SPAWN_STAGE_SETUP, -1);
+        }
+        if (getppid() != p->parent_pid) { // parent died before prctl took effect
+            _exit(EXIT_FAILURE);
+        }
+    }
+#endif
+
+    if (child_apply_limits(p) != 0) {
+        child_finalize_error(error_pipe, SPAWN_STAGE_LIMITS, -1);
+    }
+
+    if (prep->groups != NULL && setgroups((size_t)prep->group_count, prep->groups) != 0) {
+        child_finalize_error(error_pipe, SPAWN_STAGE_INITGROUPS, -1);
+    }
+
+    if (gid != -1 && getgid() != gid && setgid(gid) != 0) {
+        child_finalize_error(error_pipe, SPAWN_STAGE_SETGID, -1);
+    }
+
+    if (uid != -1 && getuid() != uid && setuid(uid) != 0) {
+        child_finalize_error(error_pipe, SPAWN_STAGE_SETUID, -1);
     }
 
     if (pgid != -1 && setpgid(0, pgid) != 0) {
-        child_finalize_error(error_pipe);
+        child_finalize_error(error_pipe, SPAWN_STAGE_SETPGID, -1);
+    }
+
+    if ((p->cwd_fd != -1 && fchdir(p->cwd_fd) != 0) || (p->cwd_fd == -1 && p->cwd != NULL && chdir(p->cwd) != 0)) {
+        child_finalize_error(error_pipe, SPAWN_STAGE_CHDIR, -1);
+    }
+
+    if (p->umask != (mode_t)-1) {
+        umask(p->umask);
+    }
+
+    int stashed[SPAWN_MAX_FDS];
+    int exec_fd = p->exec_fd;
+    if (child_stash_fds(p, stashed, &error_pipe, &exec_fd) == -1) {
+        child_finalize_error(error_pipe, SPAWN_STAGE_DUP2, -1);
     }
 
     for (int i = 0; i < 3; i++) {
-        if (p->redirect[i] != -1) {
-            dup2(p->redirect[i], i);
+        if (p->redirect[i] != -1 && dup2(p->redirect[i], i) == -1) {
+            child_finalize_error(error_pipe, SPAWN_STAGE_DUP2, -1);
+        }
+    }
+
+    if (child_place_fds(p, stashed) == -1) {
+        child_finalize_error(error_pipe, SPAWN_STAGE_DUP2, -1);
+    }
+
+    if (p->listen_fds) {
+        child_set_listen_pid(p);
+    }
+
+#ifdef __linux__
+    if (exec_fd != -1) {
+        syscall(SYS_execveat, exec_fd, "", (char* const*)p->argv, (char* const*)p->envp, AT_EMPTY_PATH);
+        if (errno != ENOENT) {
+            child_finalize_error(error_pipe, SPAWN_STAGE_EXEC, -1);
         }
+        // ENOENT - script, its interpreter cannot reopen close-on-exec fd through /proc/self/fd, run it by path
     }
+#endif
 
-    execve_spawnp(p->command, (char* const*)p->argv, (char* const*)p->envp);
-    child_finalize_error(error_pipe);
+    int candidate;
+    execve_spawnp(&prep->path, p->command, (char* const*)p->argv, (char* const*)p->envp, &candidate);
+    child_finalize_error(error_pipe, SPAWN_STAGE_EXEC, candidate);
     return 0;
 }
 
+#ifdef __linux__
+/* fork which makes the new process child of our parent (spawn server -> host) */
+static pid_t
+clone_sibling(void) {
+#if defined(__s390__) || defined(__CRIS__)
+    return (pid_t)syscall(SYS_clone, 0, CLONE_PARENT | SIGCHLD);
+#else
+    return (pid_t)syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+#endif
+}
+#endif
+
+/*
+** Forks and executes the child and waits until exec succeeds (error pipe is closed on exec).
+** Returns 0 on success, -1 with errno and p->error set otherwise. With SPAWN_AS_SIBLING failed child
+** is left for the real parent to reap and its pid is stored in pid, otherwise pid is -1 on failure.
+*/
+int
+spawn_fork_exec(spawn_params* p, int uid, int gid, pid_t pgid, int flags, pid_t* pid) {
+    *pid = -1;
+    spawn_prepared prep;
+    if (spawn_prepare(&prep, p, uid, gid) == -1) {
+        p->error = (spawn_error){SPAWN_STAGE_SETUP, errno, -1};
+        return -1;
+    }
+    int pipefd[2];
+    if (spawn_pipe_cloexec(pipefd) == -1) {
+        p->error = (spawn_error){SPAWN_STAGE_PIPE, errno, -1};
+        spawn_prepared_free(&prep);
+        return -1;
+    }
+#ifdef __linux__
+    pid_t child = flags & SPAWN_AS_SIBLING ? clone_sibling() : fork();
+#else
+    pid_t child = fork();
+#endif
+    SPAWN_TIMING_MARK(p, SPAWN_PHASE_FORK);
+    if (child == -1) {
+        p->error = (spawn_error){SPAWN_STAGE_FORK, errno, -1};
+        close(pipefd[0]);
+        close(pipefd[1]);
+        spawn_prepared_free(&prep);
+        errno = p->error.err;
+        return -1;
+    }
+    if (child == 0) {
+        close(pipefd[0]); // Close read end of the pipe
+        if (flags & SPAWN_AS_SIBLING) {
+            spawn_server_child_reset();
+        }
+        child_init(pipefd[1], uid, gid, pgid, p, &prep);
+    }
+
+    spawn_prepared_free(&prep);
+    close(pipefd[1]); // Close write end of the pipe
+    spawn_error error;
+    ssize_t n;
+    do {
+        n = read(pipefd[0], &error, sizeof(error));
+    } while (n == -1 && errno == EINTR);
+    close(pipefd[0]);
+    SPAWN_TIMING_MARK(p, SPAWN_PHASE_EXEC);
+    if (n > 0) {
+        if (flags & SPAWN_AS_SIBLING) {
+            *pid = child;
+        } else {
+            waitpid(child, NULL, 0); // Clean up the child process
+        }
+        if (n != sizeof(error)) {
+            error = (spawn_error){SPAWN_STAGE_SETUP, EIO, -1};
+        }
+        p->error = error;
+        errno = error.err;
+        return -1;
+    }
+    *pid = child;
+    return 0;
+}
+
+static const char* spawnStageNames[SPAWN_STAGE_COUNT] = {
+    "none",   "pipe",    "fork",  "user", "server", "setup", "limits", "initgroups", "setgid",
+    "setuid", "setpgid", "chdir", "dup2", "exec",
+};
+
+/* transient failures (resource exhaustion, busy executable), everything else fails again on retry */
+int
+spawn_error_retryable(const spawn_error* e) {
+    switch (e->err) {
+        case EAGAIN:
+        case EINTR:
+        case ENOMEM:
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ETXTBSY: return 1;
+        default: return 0;
+    }
+}
+
+/* -- { stage, errno, candidate, retryable } */
+void
+spawn_error_push(lua_State* L, const spawn_error* e) {
+    lua_createtable(L, 0, 4);
+    lua_pushstring(L, e->stage >= 0 && e->stage < SPAWN_STAGE_COUNT ? spawnStageNames[e->stage] : "unknown");
+    lua_setfield(L, -2, "stage");
+    lua_pushinteger(L, e->err);
+    lua_setfield(L, -2, "errno");
+    if (e->candidate >= 0) {
+        lua_pushinteger(L, e->candidate + 1); // 1-based index of PATH entry
+        lua_setfield(L, -2, "candidate");
+    }
+    lua_pushboolean(L, spawn_error_retryable(e));
+    lua_setfield(L, -2, "retryable");
+}
+
 #endif
 
 int
@@ -338,7 +938,7 @@ spawn_param_execute(lua_State* L) {
         p->argv = lua_newuserdatauv(L, 2 * sizeof *p->argv, 0);
         p->argv[0] = p->command;
         p->argv[1] = 0;
-        lua_pop(L, 1); // pop argv
+        lua_setiuservalue(L, 1, SPAWN_PARAM_ARGV);
     }
     if (p->envp == 0) {
         p->envp = (const char**)environ;
@@ -347,20 +947,27 @@ spawn_param_execute(lua_State* L) {
     process* proc = lua_newuserdatauv(L, sizeof *proc, 1); // params process_group proc
     luaL_getmetatable(L, PROCESS_METATABLE);
     lua_setmetatable(L, -2);
+    memset(&proc->timing, 0, sizeof(proc->timing));
     proc->status = -1;
     proc->signal = 0;
-    proc->stdio[STDIO_STDIN] = p->stdio[STDIO_STDIN];
-    proc->stdio[STDIO_STDOUT] = p->stdio[STDIO_STDOUT];
-    proc->stdio[STDIO_STDERR] = p->stdio[STDIO_STDERR];
+    proc->isChild = 1;
+#ifndef _WIN32
+    proc->pidfd = -1;
+    process_deadline_init(proc);
+#endif
+    for (int i = STDIO_STDIN; i <= STDIO_STDERR; i++) { // process owns channels from now on
+        proc->stdio[i] = p->stdio[i];
+        p->stdio[i] = NULL;
+    }
 #ifdef _WIN32
     c = strdup(p->cmdline);
     e = (char*)p->environment; /* strdup(p->environment); */
-    proc->isChild = 1;         // if we decide to use different creation flags we may have to adjust
     DWORD creationFlags =
         CREATE_NEW_PROCESS_GROUP
         | (p->create_process_group || luaL_testudata(L, 2, PROCESS_GROUP_METATABLE) != NULL ? CREATE_NEW_CONSOLE : 0);
-    success = CreateProcess(0, c, 0, 0, TRUE, creationFlags, e, 0, &p->si, &pi) != 0;
+    success = CreateProcess(0, c, 0, 0, TRUE, creationFlags, e, p->cwd, &p->si, &pi) != 0;
     free(c);
+    SPAWN_TIMING_MARK(p, SPAWN_PHASE_FORK);
 
     if (success == 1) {
         proc->hProcess = pi.hProcess;
@@ -403,13 +1010,33 @@ spawn_param_execute(lua_State* L) {
     // impersonation
     int uid = -1, gid = -1;
     if (success == 1 && p->username != NULL) {
-        struct passwd* pwd = getpwnam(p->username);
-        if (pwd == NULL) {
+        struct passwd pwd;
+        struct passwd* found = NULL;
+        char small[1024];
+        char* buf = small;
+        size_t size = sizeof(small);
+        int err;
+        while ((err = getpwnam_r(p->username, &pwd, buf, size, &found)) == ERANGE && size < (1 << 20)) {
+            size *= 2;
+            char* bigger = buf == small ? spawn_malloc(size) : spawn_realloc(buf, size);
+            if (bigger == NULL) {
+                err = ENOMEM;
+                break;
+            }
+            buf = bigger;
+        }
+        if (found == NULL) {
+            p->error = (spawn_error){SPAWN_STAGE_USER, err != 0 ? err : ENOENT, -1}; // ENOENT - no such user
+            errno = p->error.err;
             success = 0;
         } else {
-            uid = pwd->pw_uid;
-            gid = pwd->pw_gid;
+            uid = pwd.pw_uid;
+            gid = pwd.pw_gid;
+        }
+        if (buf != small) {
+            free(buf);
         }
+        SPAWN_TIMING_MARK(p, SPAWN_PHASE_USER);
     }
 
     // process group
@@ -425,44 +1052,33 @@ spawn_param_execute(lua_State* L) {
         lua_pushvalue(L, 2);         // params process_group proc process_group
         lua_setiuservalue(L, -2, 1); // params process_group proc
     }
-    int pipefd[2];
-    if (success == 1 && pipe(pipefd) == -1) {
-        success = 0;
-    }
-
     if (success == 1) {
-        pid = fork();
-        if (pid == -1) {
-            close(pipefd[0]);
-            close(pipefd[1]);
-            success = 0;
+        int res = -1;
+        p->parent_pid = getpid(); // spawn server children are ours as well
+        if (p->use_spawn_server) {
+            res = spawn_server_spawn(p, uid, gid, pgid, &pid);
+            SPAWN_TIMING_MARK(p, SPAWN_PHASE_SERVER);
         }
-    }
-
-    if (success == 1) {
-        if (pid == 0) {
-            // child
-            close(pipefd[0]); // Close read end of the pipe
-
-            child_init(pipefd[1], uid, gid, pgid, p);
-        } else {
-            // parent
-            close(pipefd[1]); // Close write end of the pipe
-            int err;
-            if (read(pipefd[0], &err, sizeof(err)) > 0) {
-                waitpid(pid, NULL, 0); // Clean up the child process
-                errno = err;
-                success = 0;
-            }
-
-            close(pipefd[0]);
+        if (res == -1) { // spawn server not running
+            res = spawn_fork_exec(p, uid, gid, pgid, 0, &pid);
+        }
+        if (res != 0) {
+            success = 0;
         }
     }
 
     if (success == 1) {
         proc->pid = pid;
+        proc->pidfd = process_open_pidfd(pid);
+        process_track(pid);
+        if (p->timeout > 0) {
+            process_deadline_arm(proc, p->timeout, p->kill_signal, p->kill_grace);
+        }
 
         if (p->create_process_group) {
+#ifdef __linux__
+            proc_orphan_group_record(proc->pid);
+#endif
             new_process_group(L, proc->pid); // params process_group proc process_group
             lua_copy(L, -1, -3);             // params process_group proc process_group
             lua_setiuservalue(L, -2, 1);     // params process_group proc
@@ -478,15 +1094,24 @@ spawn_param_execute(lua_State* L) {
     }
 
 #endif
-    close_stdio_channel_to_close(p->stdio[STDIO_STDIN]);
-    close_stdio_channel_to_close(p->stdio[STDIO_STDOUT]);
-    close_stdio_channel_to_close(p->stdio[STDIO_STDERR]);
+    close_stdio_channel_to_close(proc->stdio[STDIO_STDIN]);
+    close_stdio_channel_to_close(proc->stdio[STDIO_STDOUT]);
+    close_stdio_channel_to_close(proc->stdio[STDIO_STDERR]);
 
     if (success != 1) {
         close_proc_stdio_channel(proc, STDIO_STDIN);
         close_proc_stdio_channel(proc, STDIO_STDOUT);
         close_proc_stdio_channel(proc, STDIO_STDERR);
+#ifdef _WIN32
         return push_error(L, NULL);
+#else
+        errno = p->error.err;
+        int n = push_error(L, NULL); // nil error
+        spawn_error_push(L, &p->error);
+        return n + 1; // nil error details
+#endif
     }
+    spawn_stats_record(&p->timing, L);
+    proc->timing = p->timing;
     return 1;
 }
@@ -10,12 +10,15 @@
 #ifdef _WIN32
 #include <windows.h>
 #else
+#include "env_snapshot.h"
 #include "environ.h"
 
 #include <fcntl.h>
 #include <grp.h>
 #include <pwd.h>
 #include <spawn.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -23,8 +26,51 @@
 
 #endif
 
+#ifndef _WIN32
+#define SPAWN_MAX_RLIMITS 16
+#define SPAWN_MAX_CPUS    1024
+#define SPAWN_MAX_FDS     16   // extra fds passed to child besides stdio
+#define SPAWN_MAX_FD      1024 // highest allowed target of extra fd
+
+typedef struct spawn_rlimit {
+    int resource;
+    struct rlimit limit;
+} spawn_rlimit;
+
+typedef struct spawn_fd {
+    int fd;     // in parent
+    int target; // number in child, >= 3
+} spawn_fd;
+
+/* where spawn failed, child stages are reported over the error pipe */
+typedef enum spawn_stage {
+    SPAWN_STAGE_NONE,
+    SPAWN_STAGE_PIPE, // parent
+    SPAWN_STAGE_FORK,
+    SPAWN_STAGE_USER,
+    SPAWN_STAGE_SERVER,
+    SPAWN_STAGE_SETUP, // child
+    SPAWN_STAGE_LIMITS,
+    SPAWN_STAGE_INITGROUPS,
+    SPAWN_STAGE_SETGID,
+    SPAWN_STAGE_SETUID,
+    SPAWN_STAGE_SETPGID,
+    SPAWN_STAGE_CHDIR,
+    SPAWN_STAGE_DUP2,
+    SPAWN_STAGE_EXEC,
+    SPAWN_STAGE_COUNT
+} spawn_stage;
+
+typedef struct spawn_error {
+    int stage;
+    int err;
+    int candidate; // PATH entry which failed exec, -1 if not searched or none was found
+} spawn_error;
+#endif
+
 typedef struct spawn_params {
     lua_State* L;
+    int stack_index; // of params userdata while options are being set up
 #ifdef _WIN32
     const char* cmdline;
     const char* environment;
@@ -34,18 +80,48 @@ typedef struct spawn_params {
     // posix_spawn_file_actions_t redirect;
     // posix_spawnattr_t attr;
     int redirect[3];
+    spawn_rlimit rlimits[SPAWN_MAX_RLIMITS];
+    int rlimit_count;
+    int nice, has_nice;
+    int sched_policy, sched_priority; // sched_policy -1 - keep inherited
+    int ioprio;                       // -1 - keep inherited
+    int has_cpu_affinity;
+    unsigned long cpu_affinity[SPAWN_MAX_CPUS / (8 * sizeof(unsigned long))]; // cpu_set_t compatible mask
+    int cwd_fd;   // -1 - use cwd path
+    int exec_fd;  // pinned executable (O_PATH), -1 - search command in PATH
+    mode_t umask; // (mode_t)-1 - keep inherited
+    int use_spawn_server;
+    const execve_path* path;       // PATH candidates resolved by spawn server host, NULL - search PATH here
+    long long timeout, kill_grace; // ns, 0 - no deadline/no SIGKILL escalation
+    int kill_signal;
+    spawn_fd fds[SPAWN_MAX_FDS];
+    int fd_count;
+    int listen_fds;   // LISTEN_FDS/LISTEN_PID are set for child (socket activation protocol)
+    int death_signal; // sent to child when spawning thread dies (linux), 0 - none
+    pid_t parent_pid; // expected parent of the child, detects parent death before prctl
+    spawn_error error; // set when spawn fails
 #endif
     const char *username, *password;
+    const char* cwd;
     stdio_channel* stdio[3];
     int create_process_group;
+    spawn_timing timing;
 } spawn_params;
 
 int proc_create_meta(lua_State* L);
 
 spawn_params* spawn_param_init(lua_State* L);
+void spawn_param_close_stdio(spawn_params* p);
 void spawn_param_filename(spawn_params* p, const char* filename);
 void spawn_param_args(lua_State* L, spawn_params* p);
+void spawn_param_args_pinned(lua_State* L, spawn_params* p);
 void spawn_param_env(lua_State* L, spawn_params* p);
+#ifndef _WIN32
+void spawn_param_env_overlay(lua_State* L, spawn_params* p, int envtab, int addtab, int removetab);
+void spawn_param_listen_env(lua_State* L, spawn_params* p);
+void spawn_param_command_pinned(lua_State* L, spawn_params* p, const char* path, int fd);
+void spawn_param_executable(lua_State* L, spawn_params* p, int fd);
+#endif
 #ifdef _WIN32
 void spawn_param_redirect(spawn_params* p, int d, HANDLE h);
 void spawn_param_redirect_inherit(spawn_params* p, int d);
@@ -54,6 +130,14 @@ void spawn_param_redirect(spawn_params* p, int d, int fd);
 void spawn_param_redirect_inherit(spawn_params* p, int d);
 #endif
 int spawn_param_execute(lua_State* L);
+#ifndef _WIN32
+#define SPAWN_AS_SIBLING 0x1 // child of our parent, used by spawn server
+
+int spawn_fork_exec(spawn_params* p, int uid, int gid, pid_t pgid, int flags, pid_t* pid);
+int spawn_pipe_cloexec(int fds[2]);
+int spawn_error_retryable(const spawn_error* e);
+void spawn_error_push(lua_State* L, const spawn_error* e);
+#endif
 
 void close_proc_stdio_channel(process* p, int stdKind);
 #endif
\ No newline at end of file
@@ -0,0 +1,428 @@
+#ifndef ELI_PROC_CHANNEL_H_
+#define ELI_PROC_CHANNEL_H_
+
+/*
+** Shared memory channel between a process and its child. Self contained (no lua), child programs include
+** this header and attach to the fds passed by the parent:
+**
+**     proc_channel ch;
+**     proc_channel_attach(&ch, 3, 4, 5, PROC_CHANNEL_CHILD); // fds as returned by channel:fds(3)
+**
+** Layout of memfd: header page with control blocks of two single producer single consumer rings followed
+** by data of ring 0 (parent -> child) and ring 1 (child -> parent). Messages are stored as 32bit length
+** followed by payload and may wrap around the end of ring data.
+**
+** Each side has its own eventfd it sleeps on. Peer is woken only when the side announced it waits
+** (reader_waiting/writer_waiting), so a steady stream of messages costs no syscalls. A side yields a few times
+** before announcing it, a producer sending one message at a time then does not wake the consumer per message.
+**
+** Writes and reads are batched - proc_channel_write/proc_channel_read move private cursors, changes are
+** published to peer by proc_channel_flush/proc_channel_release.
+**
+** Both sides record their pid in the header, a side waiting for its peer also wakes up once the peer process
+** exits without closing the channel (pidfd, polled on kernels without it).
+*/
+
+#ifdef __linux__
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef SYS_memfd_create
+#define SYS_memfd_create 319
+#endif
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#define PROC_CHANNEL_MAGIC       0x454c4943 // "ELIC"
+#define PROC_CHANNEL_HEADER_SIZE 4096
+#define PROC_CHANNEL_MIN_CAPACITY 4096
+#define PROC_CHANNEL_MAX_CAPACITY (1U << 30)
+#define PROC_CHANNEL_CORRUPT      (-2) // peer wrote malformed message, channel is unusable
+#define PROC_CHANNEL_PEER_POLL_MS 100  // peer liveness check interval without pidfd
+#define PROC_CHANNEL_SPIN_YIELDS  16   // yields before sleeping, peer usually publishes more right away
+#define PROC_CHANNEL_PARENT      0
+#define PROC_CHANNEL_CHILD       1
+
+typedef struct proc_channel_ring {
+    _Atomic uint32_t head; // consumer position
+    char head_pad[60];
+    _Atomic uint32_t tail; // producer position
+    char tail_pad[60];
+    _Atomic uint32_t reader_waiting, writer_waiting;
+    char wait_pad[56];
+} proc_channel_ring;
+
+typedef struct proc_channel_shared {
+    uint32_t magic;
+    uint32_t capacity; // of each ring, power of 2
+    _Atomic uint32_t closed[2];
+    _Atomic int32_t pids[2]; // of each side, 0 - not attached yet
+    char pad[40];
+    proc_channel_ring rings[2];
+} proc_channel_shared;
+
+typedef struct proc_channel {
+    proc_channel_shared* shared;
+    size_t size;
+    int side;
+    int memfd;
+    int wake_fd;      // this side sleeps on
+    int peer_wake_fd; // wakes peer
+    proc_channel_ring *in, *out;
+    unsigned char *in_data, *out_data;
+    uint32_t mask;
+    uint32_t read_pos;  // private head of in, published by proc_channel_release
+    uint32_t write_pos; // private tail of out, published by proc_channel_flush
+    int peer_pidfd;     // -1 - not opened (yet)
+    int peer_exited;
+} proc_channel;
+
+static inline void
+proc_channel_setup(proc_channel* ch, int side) {
+    proc_channel_shared* s = ch->shared;
+    unsigned char* data = (unsigned char*)s + PROC_CHANNEL_HEADER_SIZE;
+    ch->side = side;
+    ch->mask = s->capacity - 1;
+    ch->out = &s->rings[side];
+    ch->in = &s->rings[!side];
+    ch->out_data = data + (size_t)side * s->capacity;
+    ch->in_data = data + (size_t)!side * s->capacity;
+    ch->read_pos = atomic_load_explicit(&ch->in->head, memory_order_relaxed);
+    ch->write_pos = atomic_load_explicit(&ch->out->tail, memory_order_relaxed);
+    ch->peer_pidfd = -1;
+    ch->peer_exited = 0;
+    atomic_store_explicit(&s->pids[side], (int32_t)getpid(), memory_order_release);
+}
+
+static inline void
+proc_channel_close_fds(proc_channel* ch) {
+    int err = errno;
+    int fds[4] = {ch->memfd, ch->wake_fd, ch->peer_wake_fd, ch->peer_pidfd};
+    for (int i = 0; i < 4; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+    ch->memfd = ch->wake_fd = ch->peer_wake_fd = ch->peer_pidfd = -1;
+    errno = err;
+}
+
+/*
+** Creates channel with rings of at least capacity bytes, wake fds of both sides are kept by creator
+** (peer_wake_fd is the child's one). Returns 0 or -1 with errno set.
+*/
+static inline int
+proc_channel_create(proc_channel* ch, uint32_t capacity) {
+    uint32_t cap = PROC_CHANNEL_MIN_CAPACITY;
+    while (cap < capacity && cap < PROC_CHANNEL_MAX_CAPACITY) {
+        cap <<= 1;
+    }
+    memset(ch, 0, sizeof(*ch));
+    ch->memfd = ch->wake_fd = ch->peer_wake_fd = ch->peer_pidfd = -1;
+    ch->size = PROC_CHANNEL_HEADER_SIZE + 2 * (size_t)cap;
+    ch->memfd = (int)syscall(SYS_memfd_create, "eli-proc-channel", MFD_CLOEXEC);
+    if (ch->memfd == -1 || ftruncate(ch->memfd, (off_t)ch->size) == -1) {
+        goto fail;
+    }
+    ch->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ch->peer_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (ch->wake_fd == -1 || ch->peer_wake_fd == -1) {
+        goto fail;
+    }
+    void* mem = mmap(NULL, ch->size, PROT_READ | PROT_WRITE, MAP_SHARED, ch->memfd, 0);
+    if (mem == MAP_FAILED) {
+        goto fail;
+    }
+    ch->shared = mem;
+    ch->shared->magic = PROC_CHANNEL_MAGIC;
+    ch->shared->capacity = cap;
+    proc_channel_setup(ch, PROC_CHANNEL_PARENT);
+    return 0;
+fail:
+    proc_channel_close_fds(ch);
+    return -1;
+}
+
+static inline void
+proc_channel_wake(int fd) {
+    uint64_t one = 1;
+    ssize_t n = write(fd, &one, sizeof(one)); // EAGAIN means peer is already due to wake up
+    (void)n;
+}
+
+/* attaches to channel created by peer, returns 0 or -1 with errno set */
+static inline int
+proc_channel_attach(proc_channel* ch, int memfd, int wake_fd, int peer_wake_fd, int side) {
+    struct stat st;
+    memset(ch, 0, sizeof(*ch));
+    if (fstat(memfd, &st) == -1) {
+        return -1;
+    }
+    if (st.st_size < PROC_CHANNEL_HEADER_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    void* mem = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (mem == MAP_FAILED) {
+        return -1;
+    }
+    proc_channel_shared* s = mem;
+    // capacity is read once, a peer changing it later does not affect bounds of this side
+    if (s->magic != PROC_CHANNEL_MAGIC || s->capacity < PROC_CHANNEL_MIN_CAPACITY
+        || s->capacity > PROC_CHANNEL_MAX_CAPACITY || (s->capacity & (s->capacity - 1)) != 0
+        || PROC_CHANNEL_HEADER_SIZE + 2 * (size_t)s->capacity > (size_t)st.st_size) {
+        munmap(mem, (size_t)st.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    ch->shared = s;
+    ch->size = (size_t)st.st_size;
+    ch->memfd = memfd;
+    ch->wake_fd = wake_fd;
+    ch->peer_wake_fd = peer_wake_fd;
+    proc_channel_setup(ch, side);
+    proc_channel_wake(peer_wake_fd); // peer waiting already starts watching our pid
+    return 0;
+}
+
+static inline void
+proc_channel_copy_in(unsigned char* data, uint32_t mask, uint32_t pos, const void* src, uint32_t len) {
+    uint32_t off = pos & mask;
+    uint32_t first = len < mask + 1 - off ? len : mask + 1 - off;
+    memcpy(data + off, src, first);
+    memcpy(data, (const unsigned char*)src + first, len - first);
+}
+
+static inline void
+proc_channel_copy_out(const unsigned char* data, uint32_t mask, uint32_t pos, void* dst, uint32_t len) {
+    uint32_t off = pos & mask;
+    uint32_t first = len < mask + 1 - off ? len : mask + 1 - off;
+    memcpy(dst, data + off, first);
+    memcpy((unsigned char*)dst + first, data, len - first);
+}
+
+/* largest message channel can carry */
+static inline uint32_t
+proc_channel_max_message(const proc_channel* ch) {
+    return ch->mask + 1 - sizeof(uint32_t);
+}
+
+/* queues message, returns 1 if written, 0 if ring is full, -1 if message can never fit (EMSGSIZE) */
+static inline int
+proc_channel_write(proc_channel* ch, const void* data, uint32_t len) {
+    if (len > proc_channel_max_message(ch)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    uint32_t head = atomic_load_explicit(&ch->out->head, memory_order_acquire);
+    if (ch->mask + 1 - (ch->write_pos - head) < len + sizeof(uint32_t)) {
+        return 0;
+    }
+    proc_channel_copy_in(ch->out_data, ch->mask, ch->write_pos, &len, sizeof(uint32_t));
+    proc_channel_copy_in(ch->out_data, ch->mask, ch->write_pos + sizeof(uint32_t), data, len);
+    ch->write_pos += len + sizeof(uint32_t);
+    return 1;
+}
+
+/* publishes queued messages, wakes reader if it sleeps */
+static inline void
+proc_channel_flush(proc_channel* ch) {
+    if (atomic_load_explicit(&ch->out->tail, memory_order_relaxed) == ch->write_pos) {
+        return;
+    }
+    atomic_store_explicit(&ch->out->tail, ch->write_pos, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ch->out->reader_waiting, memory_order_relaxed)) {
+        proc_channel_wake(ch->peer_wake_fd);
+    }
+}
+
+/*
+** Length of next message, -1 if there is none or PROC_CHANNEL_CORRUPT (errno EPROTO) if the peer published
+** a length the ring cannot hold.
+*/
+static inline int64_t
+proc_channel_next_size(proc_channel* ch) {
+    uint32_t tail = atomic_load_explicit(&ch->in->tail, memory_order_acquire);
+    if (tail == ch->read_pos) {
+        return -1;
+    }
+    uint32_t available = tail - ch->read_pos;
+    if (available < sizeof(uint32_t) || available > ch->mask + 1) {
+        errno = EPROTO;
+        return PROC_CHANNEL_CORRUPT;
+    }
+    uint32_t len;
+    proc_channel_copy_out(ch->in_data, ch->mask, ch->read_pos, &len, sizeof(uint32_t));
+    if (len > proc_channel_max_message(ch) || len + sizeof(uint32_t) > available) {
+        errno = EPROTO;
+        return PROC_CHANNEL_CORRUPT;
+    }
+    return len;
+}
+
+/* copies next message of proc_channel_next_size bytes to buf and moves to the one after */
+static inline void
+proc_channel_read(proc_channel* ch, void* buf, uint32_t len) {
+    proc_channel_copy_out(ch->in_data, ch->mask, ch->read_pos + sizeof(uint32_t), buf, len);
+    ch->read_pos += len + sizeof(uint32_t);
+}
+
+/* returns space of read messages to writer, wakes writer if it waits for space */
+static inline void
+proc_channel_release(proc_channel* ch) {
+    if (atomic_load_explicit(&ch->in->head, memory_order_relaxed) == ch->read_pos) {
+        return;
+    }
+    atomic_store_explicit(&ch->in->head, ch->read_pos, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ch->in->writer_waiting, memory_order_relaxed)) {
+        proc_channel_wake(ch->peer_wake_fd);
+    }
+}
+
+/* peer closed channel or its process exited */
+static inline int
+proc_channel_peer_closed(const proc_channel* ch) {
+    return ch->peer_exited || atomic_load_explicit(&ch->shared->closed[!ch->side], memory_order_acquire) != 0;
+}
+
+/*
+** Opens pidfd of peer once it attached. Returns 1 if peer process is known to have exited, 0 otherwise
+** (alive, not attached yet or no pidfd support).
+*/
+static inline int
+proc_channel_watch_peer(proc_channel* ch) {
+    if (ch->peer_exited) {
+        return 1;
+    }
+    pid_t pid = (pid_t)atomic_load_explicit(&ch->shared->pids[!ch->side], memory_order_acquire);
+    if (pid <= 0) {
+        return 0;
+    }
+    if (ch->peer_pidfd == -1) {
+        ch->peer_pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+        if (ch->peer_pidfd == -1 && errno == ESRCH) {
+            ch->peer_exited = 1;
+        }
+        if (ch->peer_pidfd != -1) {
+            return 0;
+        }
+    }
+    if (ch->peer_pidfd == -1 && !ch->peer_exited) { // no pidfd, exited child of ours is a zombie until reaped
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_PID, (id_t)pid, &info, WEXITED | WNOHANG | WNOWAIT) == 0) {
+            ch->peer_exited = info.si_pid == pid;
+        } else if (errno == ECHILD) {
+            ch->peer_exited = kill(pid, 0) == -1 && errno == ESRCH;
+        }
+    }
+    return ch->peer_exited;
+}
+
+static inline int64_t
+proc_channel_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* message to read (for_write 0) or space for len bytes message (for_write 1) */
+static inline int
+proc_channel_ready(proc_channel* ch, int for_write, uint32_t len) {
+    return for_write ? ch->mask + 1 - (ch->write_pos - atomic_load(&ch->out->head)) >= len + sizeof(uint32_t)
+                     : atomic_load(&ch->in->tail) != ch->read_pos;
+}
+
+/*
+** Sleeps until there is a message to read (for_write 0) or space for len bytes message (for_write 1),
+** peer closes channel (or exits) or timeout_ms passes (-1 - no timeout). Returns 1 if ready, 0 on timeout/peer
+** close, -1 on error.
+*/
+static inline int
+proc_channel_wait(proc_channel* ch, int for_write, uint32_t len, int timeout_ms) {
+    for (int i = 0; i < PROC_CHANNEL_SPIN_YIELDS; i++) { // no wake up syscalls while peer keeps up
+        if (proc_channel_ready(ch, for_write, len)) {
+            return 1;
+        }
+        sched_yield();
+    }
+    _Atomic uint32_t* waiting = for_write ? &ch->out->writer_waiting : &ch->in->reader_waiting;
+    atomic_store_explicit(waiting, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t deadline = timeout_ms >= 0 ? proc_channel_now_ms() + timeout_ms : -1;
+    int res;
+    for (;;) {
+        if (proc_channel_ready(ch, for_write, len)) {
+            res = 1;
+            break;
+        }
+        if (proc_channel_watch_peer(ch) || proc_channel_peer_closed(ch)) {
+            res = 0;
+            break;
+        }
+        int remaining = -1;
+        if (deadline != -1) {
+            int64_t left = deadline - proc_channel_now_ms();
+            remaining = left > 0 ? (int)left : 0;
+        }
+        int slice = remaining;
+        if (ch->peer_pidfd == -1 && atomic_load(&ch->shared->pids[!ch->side]) > 0
+            && (slice == -1 || slice > PROC_CHANNEL_PEER_POLL_MS)) {
+            slice = PROC_CHANNEL_PEER_POLL_MS; // nothing to sleep on for peer exit
+        }
+        struct pollfd pfds[2] = {{ch->wake_fd, POLLIN, 0}, {ch->peer_pidfd, POLLIN, 0}}; // -1 is ignored
+        int n = poll(pfds, 2, slice);
+        if (n == -1 && errno != EINTR) {
+            res = -1;
+            break;
+        }
+        if (n == 0 && slice == remaining) {
+            res = 0;
+            break;
+        }
+        if (n > 0 && (pfds[1].revents & POLLIN)) {
+            ch->peer_exited = 1; // messages it published before exit are still read first
+        }
+        if (n > 0 && (pfds[0].revents & POLLIN)) {
+            uint64_t count;
+            ssize_t r = read(ch->wake_fd, &count, sizeof(count));
+            (void)r;
+        }
+    }
+    atomic_store_explicit(waiting, 0, memory_order_relaxed);
+    return res;
+}
+
+/* flushes pending writes, marks side closed, wakes peer and releases resources */
+static inline void
+proc_channel_close(proc_channel* ch) {
+    if (ch->shared == NULL) {
+        return;
+    }
+    proc_channel_flush(ch);
+    atomic_store_explicit(&ch->shared->closed[ch->side], 1, memory_order_release);
+    proc_channel_wake(ch->peer_wake_fd);
+    munmap(ch->shared, ch->size);
+    ch->shared = NULL;
+    proc_channel_close_fds(ch);
+}
+#endif
+#endif
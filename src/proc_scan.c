@@ -0,0 +1,251 @@
+#ifdef __linux__
+#include "proc_scan.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct proc_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+int
+proc_scan_init(proc_scan* scan) {
+    memset(scan, 0, sizeof(proc_scan));
+    scan->dirents = malloc(PROC_SCAN_DIRENTS_SIZE);
+    if (scan->dirents == NULL) {
+        return -1;
+    }
+    scan->capacity = 1024;
+    scan->entries = malloc(scan->capacity * sizeof(proc_entry));
+    if (scan->entries == NULL) {
+        free(scan->dirents);
+        scan->dirents = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void
+proc_scan_free(proc_scan* scan) {
+    free(scan->dirents);
+    free(scan->entries);
+    memset(scan, 0, sizeof(proc_scan));
+}
+
+/* parses (optionally negative) decimal number, returns pointer past it and the following space */
+static const char*
+scan_number(const char* s, const char* end, long long* value) {
+    int negative = 0;
+    if (s < end && *s == '-') {
+        negative = 1;
+        s++;
+    }
+    long long v = 0;
+    while (s < end && *s >= '0' && *s <= '9') {
+        v = v * 10 + (*s - '0');
+        s++;
+    }
+    *value = negative ? -v : v;
+    while (s < end && *s == ' ') {
+        s++;
+    }
+    return s;
+}
+
+/* /proc/<pid>/stat: pid (comm) state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt
+ * utime stime cutime cstime priority nice num_threads itrealvalue starttime vsize rss ... */
+static int
+read_stat(int procfd, const char* name, size_t name_len, proc_entry* entry) {
+    char path[32];
+    if (name_len + sizeof("/stat") > sizeof(path)) {
+        return -1;
+    }
+    memcpy(path, name, name_len);
+    memcpy(path + name_len, "/stat", sizeof("/stat"));
+
+    int fd = openat(procfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1; // process exited meanwhile
+    }
+    char buf[1024];
+    ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (len <= 0) {
+        return -1;
+    }
+    const char* end = buf + len;
+    const char* open_paren = memchr(buf, '(', len);
+    const char* close_paren = NULL;
+    for (const char* c = end - 1; c > buf; c--) { // comm may contain ')'
+        if (*c == ')') {
+            close_paren = c;
+            break;
+        }
+    }
+    if (open_paren == NULL || close_paren == NULL || close_paren < open_paren || close_paren + 4 > end) {
+        return -1;
+    }
+    size_t comm_len = close_paren - open_paren - 1;
+    if (comm_len >= PROC_SCAN_COMM_SIZE) {
+        comm_len = PROC_SCAN_COMM_SIZE - 1;
+    }
+    memcpy(entry->comm, open_paren + 1, comm_len);
+    entry->comm[comm_len] = '\0';
+    entry->state = close_paren[2];
+
+    const char* s = close_paren + 4;
+    unsigned long long cpu_time = 0;
+    for (int field = 4; field <= 24 && s < end; field++) {
+        long long value;
+        s = scan_number(s, end, &value);
+        switch (field) {
+            case 4: entry->ppid = (pid_t)value; break;
+            case 5: entry->pgid = (pid_t)value; break;
+            case 14:
+            case 15: cpu_time += (unsigned long long)value; break;
+            case 22: entry->start_time = (unsigned long long)value; break;
+            case 24: entry->rss = (long)value; break;
+            default: break;
+        }
+    }
+    entry->cpu_time = cpu_time;
+    return 0;
+}
+
+static int
+compare_entries_by_pid(const void* a, const void* b) {
+    pid_t pa = ((const proc_entry*)a)->pid;
+    pid_t pb = ((const proc_entry*)b)->pid;
+    return (pa > pb) - (pa < pb);
+}
+
+int
+proc_scan_run(proc_scan* scan) {
+    int procfd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (procfd == -1) {
+        return -1;
+    }
+    scan->count = 0;
+    int sorted = 1;
+    for (;;) {
+        long n = syscall(SYS_getdents64, procfd, scan->dirents, PROC_SCAN_DIRENTS_SIZE);
+        if (n == -1) {
+            int err = errno;
+            close(procfd);
+            errno = err;
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        for (long offset = 0; offset < n;) {
+            struct proc_dirent64* d = (struct proc_dirent64*)(scan->dirents + offset);
+            offset += d->d_reclen;
+
+            pid_t pid = 0;
+            size_t name_len = 0;
+            for (; d->d_name[name_len] >= '0' && d->d_name[name_len] <= '9'; name_len++) {
+                pid = pid * 10 + (d->d_name[name_len] - '0');
+            }
+            if (name_len == 0 || d->d_name[name_len] != '\0') {
+                continue; // not a process directory
+            }
+
+            if (scan->count == scan->capacity) {
+                proc_entry* entries = realloc(scan->entries, scan->capacity * 2 * sizeof(proc_entry));
+                if (entries == NULL) {
+                    close(procfd);
+                    errno = ENOMEM;
+                    return -1;
+                }
+                scan->entries = entries;
+                scan->capacity *= 2;
+            }
+            proc_entry* entry = &scan->entries[scan->count];
+            entry->pid = pid;
+            if (read_stat(procfd, d->d_name, name_len, entry) == -1) {
+                continue;
+            }
+            if (scan->count > 0 && scan->entries[scan->count - 1].pid > pid) {
+                sorted = 0;
+            }
+            scan->count++;
+        }
+    }
+    close(procfd);
+    if (!sorted) {
+        qsort(scan->entries, scan->count, sizeof(proc_entry), compare_entries_by_pid);
+    }
+    return 0;
+}
+
+proc_entry*
+proc_scan_find(proc_scan* scan, pid_t pid) {
+    proc_entry key = {.pid = pid};
+    return bsearch(&key, scan->entries, scan->count, sizeof(proc_entry), compare_entries_by_pid);
+}
+
+typedef struct proc_parent_link {
+    pid_t ppid;
+    size_t index;
+} proc_parent_link;
+
+static int
+compare_links_by_ppid(const void* a, const void* b) {
+    pid_t pa = ((const proc_parent_link*)a)->ppid;
+    pid_t pb = ((const proc_parent_link*)b)->ppid;
+    return (pa > pb) - (pa < pb);
+}
+
+/*
+** Fills result (scan->count + 1 entries) with indexes into scan->entries of children (or all descendants) of pid.
+** Returns 0 or -1 (ENOMEM).
+*/
+int
+proc_scan_descendants(proc_scan* scan, pid_t pid, int recursive, size_t* result, size_t* count) {
+    *count = 0;
+    proc_parent_link* links = malloc((scan->count + 1) * sizeof(proc_parent_link));
+    if (links == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (size_t i = 0; i < scan->count; i++) {
+        links[i].ppid = scan->entries[i].ppid;
+        links[i].index = i;
+    }
+    qsort(links, scan->count, sizeof(proc_parent_link), compare_links_by_ppid);
+
+    // result doubles as bfs queue - every found process is expanded once
+    pid_t parent = pid;
+    for (size_t visited = 0;; visited++) {
+        size_t lo = 0, hi = scan->count;
+        while (lo < hi) { // first link with ppid >= parent
+            size_t mid = lo + (hi - lo) / 2;
+            if (links[mid].ppid < parent) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (; lo < scan->count && links[lo].ppid == parent; lo++) {
+            if (scan->entries[links[lo].index].pid != parent) {
+                result[(*count)++] = links[lo].index;
+            }
+        }
+        if (!recursive || visited >= *count) {
+            break;
+        }
+        parent = scan->entries[result[visited]].pid;
+    }
+    free(links);
+    return 0;
+}
+
+#endif
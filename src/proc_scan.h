@@ -0,0 +1,35 @@
+#ifndef ELI_PROC_SCAN_H_
+#define ELI_PROC_SCAN_H_
+#ifdef __linux__
+#include <stddef.h>
+#include <sys/types.h>
+
+#define PROC_SCAN_COMM_SIZE    16
+#define PROC_SCAN_DIRENTS_SIZE (64 * 1024)
+
+typedef struct proc_entry {
+    pid_t pid;
+    pid_t ppid;
+    pid_t pgid;
+    char state;
+    char comm[PROC_SCAN_COMM_SIZE];
+    unsigned long long cpu_time;   // utime + stime in clock ticks
+    unsigned long long start_time; // clock ticks after boot, tells reused pids apart
+    long rss;                      // resident set size in pages
+} proc_entry;
+
+typedef struct proc_scan {
+    proc_entry* entries; // sorted by pid
+    size_t count;
+    size_t capacity;
+    char* dirents; // getdents64 buffer, PROC_SCAN_DIRENTS_SIZE bytes
+} proc_scan;
+
+int proc_scan_init(proc_scan* scan);
+int proc_scan_run(proc_scan* scan);
+void proc_scan_free(proc_scan* scan);
+proc_entry* proc_scan_find(proc_scan* scan, pid_t pid);
+int proc_scan_descendants(proc_scan* scan, pid_t pid, int recursive, size_t* result, size_t* count);
+
+#endif
+#endif
@@ -0,0 +1,742 @@
+#ifndef _WIN32
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // MSG_CMSG_CLOEXEC
+#endif
+#include "spawn_server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+/*
+** Spawn server is a small helper forked early (while the host is small) which forks children on behalf
+** of the host. Children are created with CLONE_PARENT so they are ordinary children of the host and
+** all process apis (wait, exit codes, pidfd) work as with directly spawned processes.
+**
+** request:  spawn_request header (with fds in SCM_RIGHTS) followed by strings_size bytes of strings
+**           (command, argv, envp, username, cwd, PATH candidates - NUL terminated, optional ones only if set)
+** response: spawn_response
+**
+** Server keeps environment and cwd of the host at the time it was forked. Host resolves PATH candidates
+** of the command itself and passes its cwd with requests which depend on it (no cwd or relative one).
+**
+** Several servers are forked, each with its own connection and lock, so spawns from different threads do not
+** wait for each other. A spawn takes the first idle server, starting from a rotating index.
+**
+** Parent death signal follows the thread which forked, not the process. Server is therefore forked by a keeper
+** thread which lives as long as the host, so neither the server nor its die_with_parent children (whose parent
+** is that thread as well) are killed when the thread which started the server exits.
+*/
+
+#define SPAWN_SERVER_FD       3
+#define SPAWN_SERVER_FD_CWD   3 // fd slots 0-2 are redirects
+#define SPAWN_SERVER_FD_EXEC  4
+#define SPAWN_SERVER_FD_HOST  5 // cwd of host
+#define SPAWN_SERVER_FD_EXTRA 6 // slot 6 + i is params.fds[i]
+#define SPAWN_SERVER_MAX_FDS  (SPAWN_SERVER_FD_EXTRA + SPAWN_MAX_FDS)
+#define SPAWN_SERVER_SIGNALS  3
+#define SPAWN_SERVER_MAX      64
+#define SPAWN_SERVER_DEFAULT  8 // at most this many by default, one per core up to it
+
+typedef struct spawn_request {
+    spawn_params params; // pointers are only used as "is set" flags and rebuilt by server
+    int uid, gid;
+    pid_t pgid;
+    uint32_t argc, envc;
+    uint32_t pathc;  // PATH candidates
+    int path_search; // 0 - command is executed as is
+    int path_error;  // of execve_path
+    uint32_t strings_size;
+    uint32_t fd_count;
+    int fd_slots[SPAWN_SERVER_MAX_FDS];
+} spawn_request;
+
+typedef struct spawn_response {
+    pid_t pid;
+    spawn_error error; // error.err is 0 on success
+} spawn_response;
+
+typedef struct spawn_server_slot {
+    pthread_mutex_t lock; // held for a whole request, fd is guarded by it
+    int fd;
+    pid_t pid; // changed with both serverLock and lock held
+} spawn_server_slot;
+
+/* lock order: serverLock, then slot locks */
+static pthread_mutex_t serverLock = PTHREAD_MUTEX_INITIALIZER;
+static spawn_server_slot servers[SPAWN_SERVER_MAX];
+static int serverSlotsReady = 0;    // guarded by serverLock
+static int serverCount = 0;         // slots in use, atomic
+static unsigned int serverNext = 0; // rotating start of idle server search, atomic
+static int serverAlive = 0;         // connections open, atomic, changed with a slot lock held
+static int serverLostError = 0;     // errno of the request which found the last server gone, atomic
+
+/* keeper thread forks servers on request, guarded by keeperLock */
+static pthread_mutex_t keeperLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t keeperCond = PTHREAD_COND_INITIALIZER;
+static int keeperStarted = 0;
+static int keeperRequest = 0; // servers to fork
+static int keeperError = 0;
+static sigset_t hostSignalMask; // keeper blocks all signals, server restores the mask of the host
+
+/* signals ignored by server so terminal interrupts do not take it down, restored for children */
+static const int serverSignals[SPAWN_SERVER_SIGNALS] = {SIGINT, SIGQUIT, SIGTSTP};
+static struct sigaction hostSignalActions[SPAWN_SERVER_SIGNALS];
+
+void
+spawn_server_child_reset(void) {
+    for (int i = 0; i < SPAWN_SERVER_SIGNALS; i++) {
+        sigaction(serverSignals[i], &hostSignalActions[i], NULL);
+    }
+}
+
+static int
+send_all(int fd, const void* buf, size_t len) {
+    const char* data = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+recv_all(int fd, void* buf, size_t len) {
+    char* data = buf;
+    while (len > 0) {
+        ssize_t n = recv(fd, data, len, 0);
+        if (n == 0) {
+            errno = EPIPE;
+            return -1;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* receives header together with passed fds */
+static int
+recv_request(int fd, spawn_request* req, int* fds) {
+    char control[CMSG_SPACE(sizeof(int) * SPAWN_SERVER_MAX_FDS)];
+    struct iovec iov = {req, sizeof(spawn_request)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0) {
+        return -1;
+    }
+    int received = 0;
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+            received = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(c), received * sizeof(int));
+        }
+    }
+    if (recv_all(fd, (char*)req + n, sizeof(spawn_request) - n) == -1 || received != (int)req->fd_count) {
+        for (int i = 0; i < received; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static const char*
+next_string(const char** cursor) {
+    const char* s = *cursor;
+    *cursor += strlen(s) + 1;
+    return s;
+}
+
+/* reads and drops len bytes of request */
+static int
+skip_all(int fd, size_t len) {
+    char buf[4096];
+    while (len > 0) {
+        size_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+        if (recv_all(fd, buf, chunk) == -1) {
+            return -1;
+        }
+        len -= chunk;
+    }
+    return 0;
+}
+
+static void
+serve_request(int fd) {
+    spawn_request req;
+    int fds[SPAWN_SERVER_MAX_FDS];
+    if (recv_request(fd, &req, fds) == -1) {
+        _exit(0); // host went away
+    }
+    spawn_response res = {-1, {SPAWN_STAGE_NONE, 0, -1}};
+    char* strings = malloc(req.strings_size);
+    const char** argv = malloc((req.argc + 1) * sizeof(char*));
+    const char** envp = malloc((req.envc + 1) * sizeof(char*));
+    char** candidates = malloc((req.pathc + 1) * sizeof(char*));
+    if (strings == NULL || argv == NULL || envp == NULL || candidates == NULL) {
+        // report and keep serving, the request has to be consumed to stay in sync with host
+        if (skip_all(fd, req.strings_size) == -1) {
+            _exit(0);
+        }
+        res.error = (spawn_error){SPAWN_STAGE_SERVER, ENOMEM, -1};
+        goto done;
+    }
+    if (recv_all(fd, strings, req.strings_size) == -1) {
+        _exit(0);
+    }
+
+    spawn_params* p = &req.params;
+    const char* next = strings;
+    p->command = next_string(&next);
+    for (uint32_t i = 0; i < req.argc; i++) {
+        argv[i] = next_string(&next);
+    }
+    argv[req.argc] = NULL;
+    for (uint32_t i = 0; i < req.envc; i++) {
+        envp[i] = next_string(&next);
+    }
+    envp[req.envc] = NULL;
+    p->username = p->username != NULL ? next_string(&next) : NULL;
+    p->cwd = p->cwd != NULL ? next_string(&next) : NULL;
+    for (uint32_t i = 0; i < req.pathc; i++) {
+        candidates[i] = (char*)next_string(&next);
+    }
+    candidates[req.pathc] = NULL;
+    execve_path path = {req.path_search ? candidates : NULL, req.path_error};
+    p->path = &path;
+    p->argv = argv;
+    p->envp = envp;
+    p->L = NULL;
+    p->password = NULL;
+    p->stdio[0] = p->stdio[1] = p->stdio[2] = NULL;
+    int host_cwd = -1;
+    for (uint32_t i = 0; i < req.fd_count; i++) {
+        int slot = req.fd_slots[i];
+        if (slot < 3) {
+            p->redirect[slot] = fds[i];
+        } else if (slot == SPAWN_SERVER_FD_CWD) {
+            p->cwd_fd = fds[i];
+        } else if (slot == SPAWN_SERVER_FD_EXEC) {
+            p->exec_fd = fds[i];
+        } else if (slot == SPAWN_SERVER_FD_HOST) {
+            host_cwd = fds[i];
+        } else if (slot - SPAWN_SERVER_FD_EXTRA < p->fd_count) {
+            p->fds[slot - SPAWN_SERVER_FD_EXTRA].fd = fds[i];
+        }
+    }
+
+    if (host_cwd != -1 && fchdir(host_cwd) == -1) { // children inherit it, relative cwd resolves against it
+        res.error = (spawn_error){SPAWN_STAGE_CHDIR, errno, -1};
+    } else if (spawn_fork_exec(p, req.uid, req.gid, req.pgid, SPAWN_AS_SIBLING, &res.pid) != 0) {
+        res.error = p->error;
+    }
+done:
+    for (uint32_t i = 0; i < req.fd_count; i++) {
+        close(fds[i]);
+    }
+    free(strings);
+    free(argv);
+    free(envp);
+    free(candidates);
+    if (send_all(fd, &res, sizeof(res)) == -1) {
+        _exit(0);
+    }
+}
+
+static void
+spawn_server_main(int fd, pid_t host) {
+    // die together with host
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != host) {
+        _exit(0);
+    }
+    pthread_sigmask(SIG_SETMASK, &hostSignalMask, NULL);
+    for (int i = 0; i < SPAWN_SERVER_SIGNALS; i++) {
+        struct sigaction ignore;
+        memset(&ignore, 0, sizeof(ignore));
+        ignore.sa_handler = SIG_IGN;
+        sigaction(serverSignals[i], &ignore, &hostSignalActions[i]);
+    }
+    // keep only stdio and our socket
+    if (fd != SPAWN_SERVER_FD) {
+        if (dup3(fd, SPAWN_SERVER_FD, O_CLOEXEC) == -1) {
+            _exit(1);
+        }
+        close(fd);
+    }
+    if (syscall(SYS_close_range, SPAWN_SERVER_FD + 1, ~0U, 0) == -1) {
+        long max = sysconf(_SC_OPEN_MAX);
+        for (long i = SPAWN_SERVER_FD + 1; i < max && i < 65536; i++) {
+            close((int)i);
+        }
+    }
+    for (;;) {
+        serve_request(SPAWN_SERVER_FD);
+    }
+}
+
+/* returns 0 or errno */
+static int
+fork_server(int* fd, pid_t* pid) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        return errno;
+    }
+    pid_t host = getpid();
+    pid_t child = fork();
+    if (child == -1) {
+        int err = errno;
+        close(sv[0]);
+        close(sv[1]);
+        return err;
+    }
+    if (child == 0) {
+        close(sv[0]);
+        spawn_server_main(sv[1], host);
+    }
+    close(sv[1]);
+    *fd = sv[0];
+    *pid = child;
+    return 0;
+}
+
+/* expects serverLock held, closes connections and reaps servers of slots from index on */
+static void
+shutdown_servers(int from) {
+    for (int i = from; i < SPAWN_SERVER_MAX; i++) {
+        spawn_server_slot* slot = &servers[i];
+        pthread_mutex_lock(&slot->lock); // waits for request in flight
+        if (slot->fd != -1) {
+            close(slot->fd); // server exits on EOF
+            slot->fd = -1;
+            __atomic_sub_fetch(&serverAlive, 1, __ATOMIC_RELAXED);
+        }
+        if (slot->pid != -1) {
+            waitpid(slot->pid, NULL, 0);
+            slot->pid = -1;
+        }
+        pthread_mutex_unlock(&slot->lock);
+    }
+}
+
+static void*
+keeper_run(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&keeperLock);
+    for (;;) {
+        while (keeperRequest == 0) {
+            pthread_cond_wait(&keeperCond, &keeperLock);
+        }
+        keeperError = 0;
+        for (int i = 0; i < keeperRequest && keeperError == 0; i++) {
+            spawn_server_slot* slot = &servers[i];
+            pthread_mutex_lock(&slot->lock);
+            keeperError = fork_server(&slot->fd, &slot->pid);
+            if (keeperError == 0) {
+                __atomic_add_fetch(&serverAlive, 1, __ATOMIC_RELAXED);
+            }
+            pthread_mutex_unlock(&slot->lock);
+        }
+        keeperRequest = 0;
+        pthread_cond_broadcast(&keeperCond);
+    }
+    return NULL;
+}
+
+/* expects serverLock held; forks count servers from keeper thread, started on first use and never stopped */
+static int
+keeper_fork_servers(int count) {
+    pthread_mutex_lock(&keeperLock);
+    if (!keeperStarted) {
+        // signals are for the Lua thread
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &hostSignalMask);
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_t thread;
+        int res = pthread_create(&thread, &attr, keeper_run, NULL);
+        pthread_attr_destroy(&attr);
+        pthread_sigmask(SIG_SETMASK, &hostSignalMask, NULL);
+        if (res != 0) {
+            pthread_mutex_unlock(&keeperLock);
+            errno = res;
+            return -1;
+        }
+        keeperStarted = 1;
+    }
+    keeperRequest = count;
+    pthread_cond_broadcast(&keeperCond);
+    while (keeperRequest != 0) {
+        pthread_cond_wait(&keeperCond, &keeperLock);
+    }
+    int err = keeperError;
+    pthread_mutex_unlock(&keeperLock);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/* count <= 0 - one server per core up to SPAWN_SERVER_DEFAULT */
+int
+spawn_server_start(int count) {
+    if (count <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cores < 1 ? 1 : cores > SPAWN_SERVER_DEFAULT ? SPAWN_SERVER_DEFAULT : (int)cores;
+    }
+    if (count > SPAWN_SERVER_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&serverLock);
+    if (__atomic_load_n(&serverAlive, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_unlock(&serverLock);
+        return 0;
+    }
+    if (!serverSlotsReady) {
+        for (int i = 0; i < SPAWN_SERVER_MAX; i++) {
+            pthread_mutex_init(&servers[i].lock, NULL);
+            servers[i].fd = -1;
+            servers[i].pid = -1;
+        }
+        serverSlotsReady = 1;
+    }
+    shutdown_servers(0); // reaps servers lost earlier
+    if (keeper_fork_servers(count) == -1) {
+        int err = errno;
+        shutdown_servers(0);
+        pthread_mutex_unlock(&serverLock);
+        errno = err;
+        return -1;
+    }
+    __atomic_store_n(&serverLostError, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&serverCount, count, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&serverLock);
+    return 0;
+}
+
+int
+spawn_server_stop(void) {
+    pthread_mutex_lock(&serverLock);
+    __atomic_store_n(&serverCount, 0, __ATOMIC_RELEASE);
+    if (serverSlotsReady) {
+        shutdown_servers(0);
+    }
+    __atomic_store_n(&serverLostError, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&serverLock);
+    return 0;
+}
+
+int
+spawn_server_running(void) {
+    return __atomic_load_n(&serverAlive, __ATOMIC_RELAXED) > 0;
+}
+
+/*
+** SPAWN_SERVER_RUNNING while any server is, SPAWN_SERVER_STOPPED or SPAWN_SERVER_LOST (err set to errno of
+** the request which found the last one gone).
+*/
+int
+spawn_server_status(int* err) {
+    pthread_mutex_lock(&serverLock);
+    int status = SPAWN_SERVER_STOPPED;
+    *err = __atomic_load_n(&serverLostError, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&serverAlive, __ATOMIC_RELAXED) > 0) {
+        status = SPAWN_SERVER_RUNNING;
+    } else if (*err != 0) {
+        status = SPAWN_SERVER_LOST;
+    }
+    pthread_mutex_unlock(&serverLock);
+    return status;
+}
+
+int
+spawn_server_is_server(pid_t pid) {
+    pthread_mutex_lock(&serverLock);
+    int found = 0;
+    for (int i = 0; i < SPAWN_SERVER_MAX && serverSlotsReady && !found; i++) {
+        found = servers[i].pid == pid;
+    }
+    pthread_mutex_unlock(&serverLock);
+    return found;
+}
+
+static size_t
+count_strings(const char** list, uint32_t* count, size_t size) {
+    *count = 0;
+    for (; list != NULL && list[*count] != NULL; (*count)++) {
+        size += strlen(list[*count]) + 1;
+    }
+    return size;
+}
+
+static char*
+append_string(char* dst, const char* s) {
+    size_t len = strlen(s) + 1;
+    memcpy(dst, s, len);
+    return dst + len;
+}
+
+#define SPAWN_SERVER_TRANSPORT_FAILED -1 // server is unusable
+#define SPAWN_SERVER_REQUEST_FAILED   -2 // request could not be built (errno set), server is fine
+
+/* expects lock of the server connection fd held; 0, SPAWN_SERVER_TRANSPORT_FAILED, SPAWN_SERVER_REQUEST_FAILED */
+static int
+spawn_server_request(int fd, spawn_params* p, int uid, int gid, pid_t pgid, spawn_response* res) {
+    execve_path path;
+    if (execve_path_prepare(&path, p->command) == -1) { // with PATH of host, not the one server inherited
+        return SPAWN_SERVER_REQUEST_FAILED;
+    }
+    int host_cwd = -1;
+    if (p->cwd_fd == -1 && (p->cwd == NULL || p->cwd[0] != '/')) {
+        host_cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (host_cwd == -1) {
+            execve_path_free(&path);
+            return SPAWN_SERVER_REQUEST_FAILED;
+        }
+    }
+
+    spawn_request req;
+    memset(&req, 0, sizeof(req));
+    req.params = *p;
+    req.uid = uid;
+    req.gid = gid;
+    req.pgid = pgid;
+
+    int fds[SPAWN_SERVER_MAX_FDS];
+    for (int i = 0; i < 3; i++) {
+        if (p->redirect[i] != -1) {
+            req.fd_slots[req.fd_count] = i;
+            fds[req.fd_count++] = p->redirect[i];
+        }
+    }
+    if (p->cwd_fd != -1) {
+        req.fd_slots[req.fd_count] = SPAWN_SERVER_FD_CWD;
+        fds[req.fd_count++] = p->cwd_fd;
+    }
+    if (p->exec_fd != -1) {
+        req.fd_slots[req.fd_count] = SPAWN_SERVER_FD_EXEC;
+        fds[req.fd_count++] = p->exec_fd;
+    }
+    if (host_cwd != -1) {
+        req.fd_slots[req.fd_count] = SPAWN_SERVER_FD_HOST;
+        fds[req.fd_count++] = host_cwd;
+    }
+    for (int i = 0; i < p->fd_count; i++) {
+        req.fd_slots[req.fd_count] = SPAWN_SERVER_FD_EXTRA + i;
+        fds[req.fd_count++] = p->fds[i].fd;
+    }
+
+    size_t size = strlen(p->command) + 1;
+    size = count_strings(p->argv, &req.argc, size);
+    size = count_strings(p->envp, &req.envc, size);
+    size += p->username != NULL ? strlen(p->username) + 1 : 0;
+    size += p->cwd != NULL ? strlen(p->cwd) + 1 : 0;
+    size = count_strings((const char**)path.candidates, &req.pathc, size);
+    req.path_search = path.candidates != NULL;
+    req.path_error = path.error;
+    req.strings_size = (uint32_t)size;
+    char* strings = spawn_malloc(size);
+    if (strings == NULL) {
+        int err = errno;
+        execve_path_free(&path);
+        if (host_cwd != -1) {
+            close(host_cwd);
+        }
+        errno = err;
+        return SPAWN_SERVER_REQUEST_FAILED;
+    }
+    char* next = append_string(strings, p->command);
+    for (uint32_t i = 0; i < req.argc; i++) {
+        next = append_string(next, p->argv[i]);
+    }
+    for (uint32_t i = 0; i < req.envc; i++) {
+        next = append_string(next, p->envp[i]);
+    }
+    if (p->username != NULL) {
+        next = append_string(next, p->username);
+    }
+    if (p->cwd != NULL) {
+        next = append_string(next, p->cwd);
+    }
+    for (uint32_t i = 0; i < req.pathc; i++) {
+        next = append_string(next, path.candidates[i]);
+    }
+    execve_path_free(&path);
+
+    char control[CMSG_SPACE(sizeof(int) * SPAWN_SERVER_MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {&req, sizeof(req)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (req.fd_count > 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * req.fd_count);
+        struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * req.fd_count);
+        memcpy(CMSG_DATA(c), fds, sizeof(int) * req.fd_count);
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+    int failed = n == -1 || send_all(fd, (char*)&req + n, sizeof(req) - n) == -1 || send_all(fd, strings, size) == -1
+              || recv_all(fd, res, sizeof(*res)) == -1;
+    int err = errno;
+    free(strings);
+    if (host_cwd != -1) {
+        close(host_cwd);
+    }
+    errno = err;
+    return failed ? SPAWN_SERVER_TRANSPORT_FAILED : 0;
+}
+
+/*
+** Spawns through the spawn server.
+** Returns -1 when server is not available (caller falls back to fork), 0 on success
+** and 1 when spawn failed (errno and p->error set).
+*/
+/* returns locked idle server, waits for a busy one when all are busy; NULL when none is running */
+static spawn_server_slot*
+acquire_server(void) {
+    int count = __atomic_load_n(&serverCount, __ATOMIC_ACQUIRE);
+    if (count == 0) {
+        return NULL;
+    }
+    unsigned int start = __atomic_fetch_add(&serverNext, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < count; i++) {
+        spawn_server_slot* slot = &servers[(start + i) % count];
+        if (pthread_mutex_trylock(&slot->lock) == 0) {
+            if (slot->fd != -1) {
+                return slot;
+            }
+            pthread_mutex_unlock(&slot->lock);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        spawn_server_slot* slot = &servers[(start + i) % count];
+        pthread_mutex_lock(&slot->lock);
+        if (slot->fd != -1) {
+            return slot;
+        }
+        pthread_mutex_unlock(&slot->lock);
+    }
+    return NULL;
+}
+
+int
+spawn_server_spawn(spawn_params* p, int uid, int gid, pid_t pgid, pid_t* pid) {
+    *pid = -1;
+    spawn_server_slot* slot = acquire_server();
+    if (slot == NULL) {
+        return -1;
+    }
+    spawn_response res;
+    int status = spawn_server_request(slot->fd, p, uid, gid, pgid, &res);
+    if (status == SPAWN_SERVER_TRANSPORT_FAILED) {
+        // broken server, others take over, with the last one gone spawns fork directly (see spawn_server_status)
+        int err = errno != 0 ? errno : EPIPE;
+        close(slot->fd);
+        slot->fd = -1; // reaped by next start or stop
+        if (__atomic_sub_fetch(&serverAlive, 1, __ATOMIC_RELAXED) == 0) {
+            __atomic_store_n(&serverLostError, err, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&slot->lock);
+    if (status != 0) {
+        return -1;
+    }
+    if (res.error.err != 0) {
+        if (res.pid > 0) {
+            waitpid(res.pid, NULL, 0); // failed child is ours to reap
+        }
+        p->error = res.error;
+        errno = res.error.err;
+        return 1;
+    }
+    *pid = res.pid;
+    return 0;
+}
+
+#else
+
+int
+spawn_server_start(int count) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int
+spawn_server_stop(void) {
+    return 0;
+}
+
+int
+spawn_server_running(void) {
+    return 0;
+}
+
+int
+spawn_server_status(int* err) {
+    *err = 0;
+    return SPAWN_SERVER_STOPPED;
+}
+
+int
+spawn_server_is_server(pid_t pid) {
+    return 0;
+}
+
+int
+spawn_server_spawn(spawn_params* p, int uid, int gid, pid_t pgid, pid_t* pid) {
+    *pid = -1;
+    return -1;
+}
+
+void
+spawn_server_child_reset(void) {
+}
+
+#endif
+#endif
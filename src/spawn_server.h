@@ -0,0 +1,19 @@
+#ifndef ELI_SPAWN_SERVER_H_
+#define ELI_SPAWN_SERVER_H_
+#ifndef _WIN32
+#include "lspawn.h"
+
+#define SPAWN_SERVER_RUNNING 0
+#define SPAWN_SERVER_STOPPED 1
+#define SPAWN_SERVER_LOST    2 // stopped after a request found it gone, spawns fall back to fork
+
+int spawn_server_start(int count);
+int spawn_server_stop(void);
+int spawn_server_running(void);
+int spawn_server_status(int* err);
+int spawn_server_is_server(pid_t pid);
+int spawn_server_spawn(spawn_params* p, int uid, int gid, pid_t pgid, pid_t* pid);
+void spawn_server_child_reset(void);
+
+#endif
+#endif
@@ -0,0 +1,331 @@
+#include "spawn_stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include "lauxlib.h"
+#include "stdio_channel.h"
+
+#ifdef _WIN32
+#include <windows.h>
+
+static SRWLOCK statsLock = SRWLOCK_INIT;
+#define STATS_LOCK()   AcquireSRWLockExclusive(&statsLock)
+#define STATS_UNLOCK() ReleaseSRWLockExclusive(&statsLock)
+
+#define STATS_ENABLED_GET()        InterlockedCompareExchange(&statsEnabled, 0, 0)
+#define STATS_ENABLED_EXCHANGE(on) InterlockedExchange(&statsEnabled, (on))
+static volatile LONG statsEnabled = 0;
+
+#ifdef _MSC_VER
+#define STATS_THREAD_LOCAL __declspec(thread)
+#else
+#define STATS_THREAD_LOCAL _Thread_local
+#endif
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+#define STATS_LOCK()   pthread_mutex_lock(&statsLock)
+#define STATS_UNLOCK() pthread_mutex_unlock(&statsLock)
+
+#define STATS_ENABLED_GET()        __atomic_load_n(&statsEnabled, __ATOMIC_RELAXED)
+#define STATS_ENABLED_EXCHANGE(on) __atomic_exchange_n(&statsEnabled, (on), __ATOMIC_RELAXED)
+static int statsEnabled = 0; // toggled and read by any thread spawning
+
+#define STATS_THREAD_LOCAL _Thread_local
+#endif
+
+/* allocations of the spawn path made by this thread, a spawn runs on one thread from start to record */
+static STATS_THREAD_LOCAL uint64_t threadAllocs = 0;
+static STATS_THREAD_LOCAL uint64_t threadAllocBytes = 0;
+
+typedef struct spawn_phase_stats {
+    uint64_t count, total, max;
+    uint64_t buckets[SPAWN_STATS_BUCKETS];
+} spawn_phase_stats;
+
+static const char* phaseNames[SPAWN_PHASE_COUNT] = {"options", "redirects", "user", "fork", "exec", "server", "total"};
+
+static spawn_phase_stats stats[SPAWN_PHASE_COUNT]; // guarded by statsLock, spawns may run on several threads
+
+typedef struct spawn_alloc_stats {
+    uint64_t allocs, alloc_bytes, max_allocs, max_alloc_bytes;
+    int64_t lua_bytes, max_lua_bytes;
+} spawn_alloc_stats;
+
+static spawn_alloc_stats allocStats; // guarded by statsLock
+
+void*
+spawn_malloc(size_t size) {
+    void* ptr = malloc(size);
+    if (ptr != NULL) {
+        threadAllocs++;
+        threadAllocBytes += size;
+    }
+    return ptr;
+}
+
+void*
+spawn_calloc(size_t count, size_t size) {
+    void* ptr = calloc(count, size);
+    if (ptr != NULL) {
+        threadAllocs++;
+        threadAllocBytes += count * size;
+    }
+    return ptr;
+}
+
+/* counted as a new allocation of size bytes */
+void*
+spawn_realloc(void* ptr, size_t size) {
+    void* grown = realloc(ptr, size);
+    if (grown != NULL) {
+        threadAllocs++;
+        threadAllocBytes += size;
+    }
+    return grown;
+}
+
+static int64_t
+lua_heap_bytes(lua_State* L) {
+    return L == NULL ? 0 : (int64_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+uint64_t
+spawn_stats_now(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000ULL
+           + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* starts timing when stats are enabled, otherwise leaves it zeroed (SPAWN_TIMING_MARK is no-op then) */
+void
+spawn_timing_start(spawn_timing* t, lua_State* L) {
+    memset(t, 0, sizeof(spawn_timing));
+    if (STATS_ENABLED_GET()) {
+        t->start = t->last = spawn_stats_now();
+        t->allocs = threadAllocs;
+        t->alloc_bytes = threadAllocBytes;
+        t->lua_bytes = lua_heap_bytes(L);
+    }
+}
+
+/* accounts time since previous mark to phase */
+void
+spawn_timing_mark(spawn_timing* t, spawn_phase phase) {
+    uint64_t now = spawn_stats_now();
+    t->phase[phase] += now - t->last;
+    t->last = now;
+}
+
+void
+spawn_stats_record(spawn_timing* t, lua_State* L) {
+    if (t->start == 0) {
+        return;
+    }
+    t->phase[SPAWN_PHASE_TOTAL] = t->last - t->start;
+    t->allocs = threadAllocs - t->allocs;
+    t->alloc_bytes = threadAllocBytes - t->alloc_bytes;
+    t->lua_bytes = lua_heap_bytes(L) - t->lua_bytes; // net, a collection step during the spawn lowers it
+    STATS_LOCK();
+    allocStats.allocs += t->allocs;
+    allocStats.alloc_bytes += t->alloc_bytes;
+    allocStats.lua_bytes += t->lua_bytes;
+    allocStats.max_allocs = t->allocs > allocStats.max_allocs ? t->allocs : allocStats.max_allocs;
+    allocStats.max_alloc_bytes =
+        t->alloc_bytes > allocStats.max_alloc_bytes ? t->alloc_bytes : allocStats.max_alloc_bytes;
+    allocStats.max_lua_bytes = t->lua_bytes > allocStats.max_lua_bytes ? t->lua_bytes : allocStats.max_lua_bytes;
+    for (int i = 0; i < SPAWN_PHASE_COUNT; i++) {
+        uint64_t us = t->phase[i] / 1000;
+        int bucket = 0;
+        while (bucket < SPAWN_STATS_BUCKETS - 1 && us >= (1ULL << bucket)) {
+            bucket++;
+        }
+        stats[i].count++;
+        stats[i].total += t->phase[i];
+        if (t->phase[i] > stats[i].max) {
+            stats[i].max = t->phase[i];
+        }
+        stats[i].buckets[bucket]++;
+    }
+    STATS_UNLOCK();
+}
+
+/* -- { phase = ns, ..., allocs, alloc_bytes, lua_bytes } */
+void
+spawn_timing_push(lua_State* L, const spawn_timing* t) {
+    lua_createtable(L, 0, SPAWN_PHASE_COUNT + 3);
+    for (int i = 0; i < SPAWN_PHASE_COUNT; i++) {
+        lua_pushinteger(L, (lua_Integer)t->phase[i]);
+        lua_setfield(L, -2, phaseNames[i]);
+    }
+    lua_pushinteger(L, (lua_Integer)t->allocs);
+    lua_setfield(L, -2, "allocs");
+    lua_pushinteger(L, (lua_Integer)t->alloc_bytes);
+    lua_setfield(L, -2, "alloc_bytes");
+    lua_pushinteger(L, (lua_Integer)t->lua_bytes);
+    lua_setfield(L, -2, "lua_bytes");
+}
+
+/*
+** -- { enabled, spawns, phases = { phase = { count, total, max, histogram } },
+**      allocations = { allocs, alloc_bytes, lua_bytes, max_allocs, max_alloc_bytes, max_lua_bytes } }
+*/
+int
+proc_stats(lua_State* L) {
+    spawn_phase_stats snapshot[SPAWN_PHASE_COUNT];
+    STATS_LOCK();
+    memcpy(snapshot, stats, sizeof(stats));
+    spawn_alloc_stats allocs = allocStats;
+    STATS_UNLOCK();
+
+    lua_createtable(L, 0, 4);
+    lua_pushboolean(L, STATS_ENABLED_GET());
+    lua_setfield(L, -2, "enabled");
+    lua_pushinteger(L, (lua_Integer)snapshot[SPAWN_PHASE_TOTAL].count);
+    lua_setfield(L, -2, "spawns");
+
+    lua_createtable(L, 0, SPAWN_PHASE_COUNT);
+    for (int i = 0; i < SPAWN_PHASE_COUNT; i++) {
+        lua_createtable(L, 0, 4);
+        lua_pushinteger(L, (lua_Integer)snapshot[i].count);
+        lua_setfield(L, -2, "count");
+        lua_pushinteger(L, (lua_Integer)snapshot[i].total);
+        lua_setfield(L, -2, "total");
+        lua_pushinteger(L, (lua_Integer)snapshot[i].max);
+        lua_setfield(L, -2, "max");
+        lua_createtable(L, SPAWN_STATS_BUCKETS, 0);
+        for (int b = 0; b < SPAWN_STATS_BUCKETS; b++) {
+            lua_pushinteger(L, (lua_Integer)snapshot[i].buckets[b]);
+            lua_rawseti(L, -2, b + 1);
+        }
+        lua_setfield(L, -2, "histogram");
+        lua_setfield(L, -2, phaseNames[i]);
+    }
+    lua_setfield(L, -2, "phases");
+
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, (lua_Integer)allocs.allocs);
+    lua_setfield(L, -2, "allocs");
+    lua_pushinteger(L, (lua_Integer)allocs.alloc_bytes);
+    lua_setfield(L, -2, "alloc_bytes");
+    lua_pushinteger(L, (lua_Integer)allocs.lua_bytes);
+    lua_setfield(L, -2, "lua_bytes");
+    lua_pushinteger(L, (lua_Integer)allocs.max_allocs);
+    lua_setfield(L, -2, "max_allocs");
+    lua_pushinteger(L, (lua_Integer)allocs.max_alloc_bytes);
+    lua_setfield(L, -2, "max_alloc_bytes");
+    lua_pushinteger(L, (lua_Integer)allocs.max_lua_bytes);
+    lua_setfield(L, -2, "max_lua_bytes");
+    lua_setfield(L, -2, "allocations");
+    return 1;
+}
+
+int
+proc_stats_reset(lua_State* L) {
+    STATS_LOCK();
+    memset(stats, 0, sizeof(stats));
+    memset(&allocStats, 0, sizeof(allocStats));
+    STATS_UNLOCK();
+    return 0;
+}
+
+/* enabled -- previous */
+int
+proc_stats_enable(lua_State* L) {
+    lua_pushboolean(L, STATS_ENABLED_EXCHANGE(lua_toboolean(L, 1)) != 0);
+    return 1;
+}
+
+#ifndef _WIN32
+/* number of open descriptors of this process, -1 if unknown */
+static lua_Integer
+count_open_fds(void) {
+    lua_Integer count = -1;
+#ifdef __linux__
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return -1;
+    }
+    count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            count++;
+        }
+    }
+    closedir(dir);
+    count--; // opendir's own descriptor
+#endif
+    return count;
+}
+
+/* resident set size in bytes, -1 if unknown */
+static lua_Integer
+current_rss(void) {
+    lua_Integer rss = -1;
+#ifdef __linux__
+    FILE* f = fopen("/proc/self/statm", "re");
+    if (f == NULL) {
+        return -1;
+    }
+    long size, resident;
+    if (fscanf(f, "%ld %ld", &size, &resident) == 2) {
+        rss = (lua_Integer)resident * sysconf(_SC_PAGESIZE);
+    }
+    fclose(f);
+#endif
+    return rss;
+}
+#endif
+
+/* -- { fds, channels, rss, max_rss, children_user, children_system } */
+/* resource usage of the host process, meant for tracking fd and memory growth across spawns */
+int
+proc_usage(lua_State* L) {
+    lua_createtable(L, 0, 6);
+    lua_pushinteger(L, stdio_channel_live_count());
+    lua_setfield(L, -2, "channels");
+#ifdef _WIN32
+    DWORD handles = 0;
+    lua_pushinteger(L, GetProcessHandleCount(GetCurrentProcess(), &handles) ? (lua_Integer)handles : -1);
+    lua_setfield(L, -2, "fds");
+#else
+    lua_pushinteger(L, count_open_fds());
+    lua_setfield(L, -2, "fds");
+    lua_pushinteger(L, current_rss());
+    lua_setfield(L, -2, "rss");
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        lua_pushinteger(L, (lua_Integer)usage.ru_maxrss); // bytes
+#else
+        lua_pushinteger(L, (lua_Integer)usage.ru_maxrss * 1024); // KiB
+#endif
+        lua_setfield(L, -2, "max_rss");
+    }
+    if (getrusage(RUSAGE_CHILDREN, &usage) == 0) { // reaped children only
+        lua_pushnumber(L, usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6);
+        lua_setfield(L, -2, "children_user");
+        lua_pushnumber(L, usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+        lua_setfield(L, -2, "children_system");
+    }
+#endif
+    return 1;
+}
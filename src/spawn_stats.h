@@ -0,0 +1,56 @@
+#ifndef ELI_SPAWN_STATS_H_
+#define ELI_SPAWN_STATS_H_
+#include <stddef.h>
+#include <stdint.h>
+#include "lua.h"
+
+/*
+** Optional per-spawn phase timing. Disabled by default, when disabled spawn only checks a flag.
+** Durations are in nanoseconds, module wide histograms use log2 buckets of microseconds
+** (bucket i counts durations below 2^i us, last bucket counts everything above).
+** Timed spawns also count C heap allocations of the spawn path (made through spawn_malloc and friends on the
+** spawning thread) and the net growth of the Lua heap of the spawning state.
+*/
+
+typedef enum spawn_phase {
+    SPAWN_PHASE_OPTIONS,   // option parsing in eli_spawn
+    SPAWN_PHASE_REDIRECTS, // stdio setup (pipes, files)
+    SPAWN_PHASE_USER,      // username lookup
+    SPAWN_PHASE_FORK,      // fork/clone in parent
+    SPAWN_PHASE_EXEC,      // exec handshake over error pipe, includes PATH search in child
+    SPAWN_PHASE_SERVER,    // round trip to spawn server
+    SPAWN_PHASE_TOTAL,
+    SPAWN_PHASE_COUNT
+} spawn_phase;
+
+#define SPAWN_STATS_BUCKETS 24
+
+typedef struct spawn_timing {
+    uint64_t start, last;
+    uint64_t phase[SPAWN_PHASE_COUNT];
+    uint64_t allocs, alloc_bytes; // counters of the thread at start, allocations of the spawn once recorded
+    int64_t lua_bytes;            // Lua heap size at start, its growth once recorded
+} spawn_timing;
+
+void* spawn_malloc(size_t size);
+void* spawn_calloc(size_t count, size_t size);
+void* spawn_realloc(void* ptr, size_t size);
+
+uint64_t spawn_stats_now(void);
+void spawn_timing_start(spawn_timing* t, lua_State* L);
+void spawn_timing_mark(spawn_timing* t, spawn_phase phase);
+void spawn_stats_record(spawn_timing* t, lua_State* L);
+void spawn_timing_push(lua_State* L, const spawn_timing* t);
+
+int proc_stats(lua_State* L);
+int proc_stats_reset(lua_State* L);
+int proc_stats_enable(lua_State* L);
+int proc_usage(lua_State* L);
+
+#define SPAWN_TIMING_MARK(p, ph)                                                                                       \
+    do {                                                                                                               \
+        if ((p)->timing.start != 0) {                                                                                  \
+            spawn_timing_mark(&(p)->timing, ph);                                                                       \
+        }                                                                                                              \
+    } while (0)
+#endif
@@ -1,14 +1,43 @@
 #include <stdlib.h>
+#include "spawn_stats.h"
 #include "stdio_channel.h"
+#include "stdio_pump.h"
 
 #ifdef _WIN32
 #include <stdio.h>
 #include <windows.h>
+
+#define LIVE_CHANNELS_ADD(n) InterlockedExchangeAdd(&liveChannels, (n))
+#define LIVE_CHANNELS_GET()  InterlockedCompareExchange(&liveChannels, 0, 0)
+static volatile LONG liveChannels = 0;
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define LIVE_CHANNELS_ADD(n) __atomic_fetch_add(&liveChannels, (n), __ATOMIC_RELAXED)
+#define LIVE_CHANNELS_GET()  __atomic_load_n(&liveChannels, __ATOMIC_RELAXED)
+static int liveChannels = 0; // channels are created from any thread spawning
+
+#ifdef __linux__
+#include <stdio.h>
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+#ifndef F_GETPIPE_SZ
+#define F_GETPIPE_SZ 1032
+#endif
+#endif
 #endif
 
 stdio_channel*
 new_stdio_channel() {
-    stdio_channel* channel = calloc(1, sizeof(stdio_channel));
+    stdio_channel* channel = spawn_calloc(1, sizeof(stdio_channel));
+    if (channel == NULL) {
+        return NULL;
+    }
+    LIVE_CHANNELS_ADD(1);
 #ifdef _WIN32
     channel->fd_to_close = INVALID_HANDLE_VALUE;
 #else
@@ -19,6 +48,9 @@ new_stdio_channel() {
 
 static void
 free_attached_stream(stdio_channel* channel) {
+    if (channel->stream == NULL) { // setup failed before the pipe was created
+        return;
+    }
 #ifdef _WIN32
     if (channel->stream->fd != INVALID_HANDLE_VALUE) {
         CloseHandle(channel->stream->fd);
@@ -56,9 +88,72 @@ close_stdio_channel(stdio_channel* channel) {
         return;
     }
     switch (channel->kind) {
-        case STDIO_CHANNEL_STREAM_KIND: free_attached_stream(channel); break;
+        case STDIO_CHANNEL_STREAM_KIND:
+            free_attached_stream(channel);
+#ifndef _WIN32
+            stdio_pump_cancel(channel->pump); // relay, if any
+#endif
+            break;
+#ifndef _WIN32
+        case STDIO_CHANNEL_TAIL_KIND: stdio_pump_cancel(channel->pump); break;
+        case STDIO_CHANNEL_ROTATE_KIND: stdio_pump_release(channel->pump); break; // logs outlive the handle
+#endif
         default: break;
     }
+    close_stdio_channel_to_close(channel);
+    free(channel);
+    LIVE_CHANNELS_ADD(-1);
+}
+
+/* number of channels not closed yet, each spawn allocates up to 3 */
+int
+stdio_channel_live_count() {
+    return (int)LIVE_CHANNELS_GET();
+}
+
+#ifdef __linux__
+static int
+pipe_max_size() {
+    FILE* f = fopen("/proc/sys/fs/pipe-max-size", "re");
+    if (f == NULL) {
+        return -1;
+    }
+    int size = -1;
+    if (fscanf(f, "%d", &size) != 1) {
+        size = -1;
+    }
+    fclose(f);
+    return size;
+}
+
+/* resizes pipe, capped to system limit for unprivileged processes; effective size or -1 with errno */
+int
+stdio_pipe_set_size(int fd, int size) {
+    int res = fcntl(fd, F_SETPIPE_SZ, size);
+    if (res == -1 && errno == EPERM) {
+        int max = pipe_max_size();
+        if (max > 0 && max < size) {
+            res = fcntl(fd, F_SETPIPE_SZ, max);
+        } else {
+            errno = EPERM;
+        }
+    }
+    return res;
+}
+#endif
+
+/* capacity of pipe created for the channel, -1 if it is not one or it is not known on this platform */
+int
+stdio_channel_pipe_size(stdio_channel* channel) {
+#ifdef __linux__
+    if (channel == NULL || channel->kind != STDIO_CHANNEL_STREAM_KIND || channel->stream->fd < 0) {
+        return -1;
+    }
+    return fcntl(channel->stream->fd, F_GETPIPE_SZ);
+#else
+    (void)channel;
+    return -1;
+#endif
 }
 
 int
@@ -71,7 +166,7 @@ stdio_channel_clone_into_stream(stdio_channel* channel, ELI_STREAM* stream) {
         return 0;
     }
 #else
-    stream->fd = dup(channel->stream->fd);
+    stream->fd = fcntl(channel->stream->fd, F_DUPFD_CLOEXEC, 0);
     if (stream->fd < 0) {
         return 0;
     }
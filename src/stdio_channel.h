@@ -15,7 +15,9 @@ typedef enum stdio_channelKind {
     STDIO_CHANNEL_EXTERNAL_STREAM_KIND,
     STDIO_CHANNEL_EXTERNAL_FILE_KIND,
     STDIO_CHANNEL_EXTERNAL_PATH_KIND,
-    STDIO_CHANNEL_IGNORE_KIND
+    STDIO_CHANNEL_IGNORE_KIND,
+    STDIO_CHANNEL_TAIL_KIND,
+    STDIO_CHANNEL_ROTATE_KIND
 } stdio_channelKind;
 
 typedef struct stdio_channel {
@@ -28,10 +30,16 @@ typedef struct stdio_channel {
 #endif
     luaL_Stream* file;
     const char* path;
+    struct stdio_pump_target* pump; // sink drained by background pump
 } stdio_channel;
 
 stdio_channel* new_stdio_channel();
 void close_stdio_channel_to_close(stdio_channel* channel);
 void close_stdio_channel(stdio_channel* channel);
+int stdio_channel_live_count();
 int stdio_channel_clone_into_stream(stdio_channel* channel, ELI_STREAM* stream);
+int stdio_channel_pipe_size(stdio_channel* channel);
+#ifdef __linux__
+int stdio_pipe_set_size(int fd, int size);
+#endif
 #endif
\ No newline at end of file
@@ -0,0 +1,651 @@
+#ifndef _WIN32
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // splice
+#endif
+#include "stdio_pump.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+#include "event_engine.h"
+#include "lspawn.h"
+#include "spawn_stats.h"
+
+#define PUMP_MAX_EVENTS    64
+#define PUMP_READ_CHUNK    16384
+#define PUMP_READS_PER_RUN 16 // fairness between busy targets, readiness is level triggered
+#define PUMP_SPLICE_MAX    (1 << 20)
+
+/* changes to the registered set, applied by pump thread in order */
+typedef struct pump_op {
+    stdio_pump_target* target;
+    int add; // 0 - cancel
+    struct pump_op* next;
+} pump_op;
+
+static pthread_mutex_t pumpStartLock = PTHREAD_MUTEX_INITIALIZER; // start and stop of pump thread
+static int pumpUsers = 0;                                          // guarded by pumpStartLock
+static int pumpRunning = 0;                                        // guarded by pumpStartLock
+static pthread_t pumpThread;
+static pthread_mutex_t pumpLock = PTHREAD_MUTEX_INITIALIZER;
+static event_engine* pumpEngine = NULL;
+static int pumpWake[2] = {-1, -1};
+static pump_op* pumpOpsHead = NULL; // guarded by pumpLock
+static pump_op* pumpOpsTail = NULL;
+static int pumpStopping = 0;                  // guarded by pumpLock
+static stdio_pump_target* pumpTargets = NULL; // registered, pump thread only
+
+int
+stdio_pump_target_init(stdio_pump_target* t, int fd, int (*drain)(stdio_pump_target*),
+                       void (*destroy)(stdio_pump_target*)) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return -1;
+    }
+    int res = pthread_mutex_init(&t->lock, NULL);
+    if (res != 0) {
+        errno = res;
+        return -1;
+    }
+    t->fd = fd;
+    t->out_fd = -1;
+    t->eof = 0;
+    t->blocked = 0;
+    t->refs = 1;
+    t->prev = t->next = NULL;
+    t->drain = drain;
+    t->destroy = destroy;
+    return 0;
+}
+
+void
+stdio_pump_release(stdio_pump_target* t) {
+    if (t == NULL || __atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    if (t->fd != -1) { // never pumped
+        close(t->fd);
+        if (t->out_fd != -1) {
+            close(t->out_fd);
+        }
+    }
+    pthread_mutex_destroy(&t->lock);
+    t->destroy(t);
+}
+
+/* pump thread; stops watching target and drops pump reference */
+static void
+pump_finish(stdio_pump_target* t) {
+    if (t->prev != NULL) {
+        t->prev->next = t->next;
+    } else if (pumpTargets == t) {
+        pumpTargets = t->next;
+    }
+    if (t->next != NULL) {
+        t->next->prev = t->prev;
+    }
+    t->prev = t->next = NULL;
+    pthread_mutex_lock(&t->lock);
+    event_engine_remove(pumpEngine, t->blocked ? t->out_fd : t->fd);
+    close(t->fd);
+    t->fd = -1;
+    if (t->out_fd != -1) {
+        close(t->out_fd); // reader sees eof
+        t->out_fd = -1;
+    }
+    t->eof = 1;
+    pthread_mutex_unlock(&t->lock);
+    stdio_pump_release(t);
+}
+
+/* returns 1 once pump is asked to stop, all targets are finished then */
+static int
+pump_apply_ops(void) {
+    char buf[64];
+    while (read(pumpWake[0], buf, sizeof(buf)) > 0) {
+    }
+    pthread_mutex_lock(&pumpLock);
+    pump_op* op = pumpOpsHead;
+    pumpOpsHead = pumpOpsTail = NULL;
+    int stop = pumpStopping;
+    pthread_mutex_unlock(&pumpLock);
+
+    while (op != NULL) {
+        stdio_pump_target* t = op->target;
+        if (op->add) {
+            if (event_engine_add(pumpEngine, t->fd, EVENT_ENGINE_READ, (uint64_t)(uintptr_t)t) == -1) {
+                pump_finish(t);
+            } else {
+                t->next = pumpTargets;
+                if (pumpTargets != NULL) {
+                    pumpTargets->prev = t;
+                }
+                pumpTargets = t;
+            }
+        } else {
+            if (t->fd != -1) {
+                pump_finish(t);
+            }
+            stdio_pump_release(t); // reference of canceling channel
+        }
+        pump_op* next = op->next;
+        free(op);
+        op = next;
+    }
+    if (stop) {
+        while (pumpTargets != NULL) {
+            pump_finish(pumpTargets);
+        }
+    }
+    return stop;
+}
+
+/* switches target between waiting for input and waiting for room in out_fd */
+static int
+pump_watch(stdio_pump_target* t, int blocked) {
+    uint64_t token = (uint64_t)(uintptr_t)t;
+    event_engine_remove(pumpEngine, t->blocked ? t->out_fd : t->fd);
+    t->blocked = blocked;
+    return blocked ? event_engine_add(pumpEngine, t->out_fd, EVENT_ENGINE_WRITE, token)
+                   : event_engine_add(pumpEngine, t->fd, EVENT_ENGINE_READ, token);
+}
+
+static void*
+pump_run(void* arg) {
+    (void)arg;
+    event_engine_event events[PUMP_MAX_EVENTS];
+    for (;;) {
+        int n = event_engine_wait(pumpEngine, events, PUMP_MAX_EVENTS, -1);
+        int woken = 0;
+        for (int i = 0; i < n; i++) {
+            if (events[i].token == 0) {
+                woken = 1;
+                continue;
+            }
+            stdio_pump_target* t = (stdio_pump_target*)(uintptr_t)events[i].token;
+            if (t->blocked && pump_watch(t, 0) == -1) { // out_fd has room again
+                pump_finish(t);
+                continue;
+            }
+            pthread_mutex_lock(&t->lock);
+            int res = t->eof ? -1 : t->drain(t);
+            pthread_mutex_unlock(&t->lock);
+            if (res == -1 || (res == STDIO_PUMP_BLOCKED && pump_watch(t, 1) == -1)) {
+                pump_finish(t);
+            }
+        }
+        if (woken && pump_apply_ops()) { // after the batch, canceled targets may be freed
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void
+pump_free(void) {
+    event_engine_free(pumpEngine);
+    pumpEngine = NULL;
+    for (int i = 0; i < 2; i++) {
+        if (pumpWake[i] != -1) {
+            close(pumpWake[i]);
+            pumpWake[i] = -1;
+        }
+    }
+}
+
+/* expects pumpStartLock held */
+static int
+pump_start(void) {
+    pumpEngine = event_engine_new();
+    if (pumpEngine == NULL) {
+        return -1;
+    }
+    if (spawn_pipe_cloexec(pumpWake) == -1 || fcntl(pumpWake[0], F_SETFL, O_NONBLOCK) == -1
+        || fcntl(pumpWake[1], F_SETFL, O_NONBLOCK) == -1
+        || event_engine_add(pumpEngine, pumpWake[0], EVENT_ENGINE_READ, 0) == -1) {
+        int err = errno;
+        pump_free();
+        errno = err;
+        return -1;
+    }
+
+    // signals are for the Lua thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int res = pthread_create(&pumpThread, NULL, pump_run, NULL); // joined by stdio_pump_close
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (res != 0) {
+        pump_free();
+        errno = res;
+        return -1;
+    }
+    pumpRunning = 1;
+    return 0;
+}
+
+/* expects pumpStartLock held */
+static void
+pump_stop(void) {
+    pthread_mutex_lock(&pumpLock);
+    pumpStopping = 1;
+    pthread_mutex_unlock(&pumpLock);
+    char c = 1;
+    ssize_t n = write(pumpWake[1], &c, 1); // full pipe means wake up is pending already
+    (void)n;
+    pthread_join(pumpThread, NULL);
+    pumpStopping = 0;
+    pumpRunning = 0;
+    pump_free();
+}
+
+void
+stdio_pump_open(void) {
+    pthread_mutex_lock(&pumpStartLock);
+    pumpUsers++;
+    pthread_mutex_unlock(&pumpStartLock);
+}
+
+void
+stdio_pump_close(void) {
+    pthread_mutex_lock(&pumpStartLock);
+    if (--pumpUsers == 0 && pumpRunning) {
+        pump_stop();
+    }
+    pthread_mutex_unlock(&pumpStartLock);
+}
+
+static int
+pump_queue(stdio_pump_target* t, int add) {
+    pump_op* op = spawn_malloc(sizeof(pump_op));
+    if (op == NULL) {
+        return -1;
+    }
+    op->target = t;
+    op->add = add;
+    op->next = NULL;
+    pthread_mutex_lock(&pumpLock);
+    if (pumpOpsTail != NULL) {
+        pumpOpsTail->next = op;
+    } else {
+        pumpOpsHead = op;
+    }
+    pumpOpsTail = op;
+    pthread_mutex_unlock(&pumpLock);
+    char c = 1;
+    write(pumpWake[1], &c, 1); // full pipe means wake up is pending already
+    return 0;
+}
+
+int
+stdio_pump_add(stdio_pump_target* t) {
+    pthread_mutex_lock(&pumpStartLock);
+    int res = pumpRunning ? 0 : pump_start();
+    pthread_mutex_unlock(&pumpStartLock);
+    if (res == -1) {
+        return -1;
+    }
+    __atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+    if (pump_queue(t, 1) == -1) {
+        __atomic_sub_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+void
+stdio_pump_cancel(stdio_pump_target* t) {
+    if (t == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&t->lock);
+    int pumped = t->fd != -1 && !t->eof;
+    pthread_mutex_unlock(&t->lock);
+    if (!pumped || pump_queue(t, 0) == -1) {
+        stdio_pump_release(t); // pump lets go of it on its own
+    }
+}
+
+/* TAIL */
+
+typedef struct stdio_tail {
+    stdio_pump_target target;
+    size_t capacity;
+    size_t size;    // bytes kept
+    size_t head;    // next write position
+    uint64_t total; // bytes seen
+    char data[];
+} stdio_tail;
+
+static void
+tail_append(stdio_tail* tail, const char* buf, size_t n) {
+    tail->total += n;
+    if (n > tail->capacity) { // only the end survives
+        buf += n - tail->capacity;
+        n = tail->capacity;
+    }
+    size_t first = tail->capacity - tail->head < n ? tail->capacity - tail->head : n;
+    memcpy(tail->data + tail->head, buf, first);
+    memcpy(tail->data, buf + first, n - first);
+    tail->head = (tail->head + n) % tail->capacity;
+    tail->size = tail->size + n > tail->capacity ? tail->capacity : tail->size + n;
+}
+
+static int
+tail_drain(stdio_pump_target* t) {
+    char buf[PUMP_READ_CHUNK];
+    for (int i = 0; i < PUMP_READS_PER_RUN; i++) {
+        ssize_t n = read(t->fd, buf, sizeof(buf));
+        if (n > 0) {
+            tail_append((stdio_tail*)t, buf, (size_t)n);
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    return 0;
+}
+
+static void
+tail_destroy(stdio_pump_target* t) {
+    free(t);
+}
+
+stdio_pump_target*
+stdio_tail_new(int fd, size_t capacity) {
+    stdio_tail* tail = spawn_malloc(sizeof(stdio_tail) + capacity);
+    if (tail == NULL) {
+        return NULL;
+    }
+    if (stdio_pump_target_init(&tail->target, fd, tail_drain, tail_destroy) == -1) {
+        int err = errno;
+        free(tail);
+        errno = err;
+        return NULL;
+    }
+    tail->capacity = capacity;
+    tail->size = 0;
+    tail->head = 0;
+    tail->total = 0;
+    return &tail->target;
+}
+
+size_t
+stdio_tail_capacity(stdio_pump_target* t) {
+    return ((stdio_tail*)t)->capacity;
+}
+
+size_t
+stdio_tail_read(stdio_pump_target* t, char* out, uint64_t* total) {
+    stdio_tail* tail = (stdio_tail*)t;
+    pthread_mutex_lock(&t->lock);
+    if (t->fd != -1 && !t->eof && t->drain(t) == -1) { // output written before exit may still be in the pipe
+        t->eof = 1; // pump closes it on next readiness
+    }
+    size_t start = (tail->head + tail->capacity - tail->size) % tail->capacity;
+    size_t first = tail->capacity - start < tail->size ? tail->capacity - start : tail->size;
+    memcpy(out, tail->data + start, first);
+    memcpy(out + first, tail->data, tail->size - first);
+    size_t n = tail->size;
+    *total = tail->total;
+    pthread_mutex_unlock(&t->lock);
+    return n;
+}
+
+/* ROTATE */
+
+typedef struct stdio_rotate {
+    stdio_pump_target target;
+    int out;          // current file, -1 if it could not be reopened
+    int no_splice;    // file system without splice support
+    uint64_t size;    // bytes in current file
+    uint64_t max_bytes;
+    int keep;         // rotated files kept as path.1 ... path.keep
+    char path[];
+} stdio_rotate;
+
+static int
+rotate_open(stdio_rotate* r, int truncate) {
+    // no O_APPEND, splice refuses append mode files
+    r->out = open(r->path, O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+    if (r->out == -1) {
+        r->size = 0; // output is dropped, next attempt after another max_bytes
+        return -1;
+    }
+    off_t end = lseek(r->out, 0, SEEK_END);
+    r->size = end > 0 ? (uint64_t)end : 0;
+    return 0;
+}
+
+/* path.keep-1 -> path.keep, ..., path -> path.1, then starts new file; oldest one is replaced */
+static void
+rotate_files(stdio_rotate* r) {
+    if (r->out != -1) {
+        close(r->out);
+        r->out = -1;
+    }
+    size_t len = strlen(r->path) + 24;
+    char from[len], to[len];
+    for (int i = r->keep - 1; i >= 1; i--) {
+        snprintf(from, len, "%s.%d", r->path, i);
+        snprintf(to, len, "%s.%d", r->path, i + 1);
+        rename(from, to); // gaps are fine
+    }
+    if (r->keep > 0) {
+        snprintf(to, len, "%s.1", r->path);
+        rename(r->path, to);
+    }
+    rotate_open(r, 1);
+}
+
+/* moves up to len bytes from pipe to current file; bytes consumed, 0 at eof, -1 with errno */
+static ssize_t
+rotate_move(stdio_rotate* r, size_t len) {
+#ifdef __linux__
+    if (!r->no_splice && r->out != -1) {
+        ssize_t n = splice(r->target.fd, NULL, r->out, NULL, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n >= 0 || errno == EAGAIN || errno == EINTR) {
+            return n;
+        }
+        if (errno == EINVAL) {
+            r->no_splice = 1;
+        }
+        // write failed (ENOSPC, ...), data is still in the pipe and falls through to be copied or dropped
+    }
+#endif
+    char buf[PUMP_READ_CHUNK];
+    ssize_t n = read(r->target.fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+    if (n <= 0) {
+        return n;
+    }
+    for (ssize_t off = 0; r->out != -1 && off < n;) {
+        ssize_t w = write(r->out, buf + off, (size_t)(n - off));
+        if (w == -1 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            break; // dropped, child must not block on our disk
+        }
+        off += w;
+    }
+    return n;
+}
+
+/* full file is rotated only once there is more to write; 0 - nothing pending, -1 - eof */
+static int
+rotate_pending(stdio_rotate* r) {
+    int avail = 0;
+    if (ioctl(r->target.fd, FIONREAD, &avail) == -1 || avail > 0) {
+        return 1;
+    }
+    struct pollfd pfd = {r->target.fd, POLLIN, 0};
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLHUP) ? -1 : 0;
+}
+
+static int
+rotate_drain(stdio_pump_target* t) {
+    stdio_rotate* r = (stdio_rotate*)t;
+    for (int i = 0; i < PUMP_READS_PER_RUN; i++) {
+        if (r->size >= r->max_bytes) {
+            int pending = rotate_pending(r);
+            if (pending <= 0) {
+                return pending;
+            }
+            rotate_files(r);
+        }
+        uint64_t room = r->max_bytes - r->size;
+        ssize_t n = rotate_move(r, room < PUMP_SPLICE_MAX ? (size_t)room : PUMP_SPLICE_MAX);
+        if (n > 0) {
+            r->size += (uint64_t)n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        return n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    return 0;
+}
+
+static void
+rotate_destroy(stdio_pump_target* t) {
+    stdio_rotate* r = (stdio_rotate*)t;
+    if (r->out != -1) {
+        close(r->out);
+    }
+    free(r);
+}
+
+stdio_pump_target*
+stdio_rotate_new(int fd, const char* path, uint64_t max_bytes, int keep) {
+    size_t len = strlen(path);
+    stdio_rotate* r = spawn_malloc(sizeof(stdio_rotate) + len + 1);
+    if (r == NULL) {
+        return NULL;
+    }
+    memcpy(r->path, path, len + 1);
+    r->no_splice = 0;
+    r->max_bytes = max_bytes;
+    r->keep = keep;
+    if (rotate_open(r, 0) == -1) { // continues existing file, rotates once it is full
+        int err = errno;
+        free(r);
+        errno = err;
+        return NULL;
+    }
+    if (stdio_pump_target_init(&r->target, fd, rotate_drain, rotate_destroy) == -1) {
+        int err = errno;
+        close(r->out);
+        free(r);
+        errno = err;
+        return NULL;
+    }
+    return &r->target;
+}
+
+const char*
+stdio_rotate_path(stdio_pump_target* t) {
+    return ((stdio_rotate*)t)->path;
+}
+
+/* RELAY */
+
+#ifdef __linux__
+typedef struct stdio_relay {
+    stdio_pump_target target;
+    uint64_t offset; // bytes relayed
+    size_t capacity;
+    size_t head; // next stamp position
+    size_t count;
+    stdio_chunk_stamp stamps[];
+} stdio_relay;
+
+static int
+relay_drain(stdio_pump_target* t) {
+    stdio_relay* r = (stdio_relay*)t;
+    for (int i = 0; i < PUMP_READS_PER_RUN; i++) {
+        ssize_t n = splice(t->fd, NULL, t->out_fd, NULL, PUMP_SPLICE_MAX, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            stdio_chunk_stamp* s = &r->stamps[r->head];
+            s->offset = r->offset;
+            s->time_ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+            r->head = (r->head + 1) % r->capacity;
+            r->count += r->count < r->capacity;
+            r->offset += (uint64_t)n;
+            continue;
+        }
+        if (n == 0) {
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN) {
+            return -1; // reader closed its end
+        }
+        int avail = 0; // nothing to move or nowhere to put it
+        return ioctl(t->fd, FIONREAD, &avail) == 0 && avail > 0 ? STDIO_PUMP_BLOCKED : 0;
+    }
+    return 0;
+}
+
+static void
+relay_destroy(stdio_pump_target* t) {
+    free(t);
+}
+
+stdio_pump_target*
+stdio_relay_new(int fd, int out_fd, size_t entries) {
+    stdio_relay* r = spawn_malloc(sizeof(stdio_relay) + entries * sizeof(stdio_chunk_stamp));
+    if (r == NULL) {
+        return NULL;
+    }
+    int flags = fcntl(out_fd, F_GETFL);
+    if (flags == -1 || fcntl(out_fd, F_SETFL, flags | O_NONBLOCK) == -1
+        || stdio_pump_target_init(&r->target, fd, relay_drain, relay_destroy) == -1) {
+        int err = errno;
+        free(r);
+        errno = err;
+        return NULL;
+    }
+    r->target.out_fd = out_fd;
+    r->offset = 0;
+    r->capacity = entries;
+    r->head = 0;
+    r->count = 0;
+    return &r->target;
+}
+
+size_t
+stdio_relay_capacity(stdio_pump_target* t) {
+    return ((stdio_relay*)t)->capacity;
+}
+
+size_t
+stdio_relay_stamps(stdio_pump_target* t, uint64_t from, stdio_chunk_stamp* out) {
+    stdio_relay* r = (stdio_relay*)t;
+    pthread_mutex_lock(&t->lock);
+    size_t n = 0;
+    size_t start = (r->head + r->capacity - r->count) % r->capacity;
+    for (size_t i = 0; i < r->count; i++) {
+        size_t k = (start + i) % r->capacity;
+        uint64_t end = i + 1 < r->count ? r->stamps[(k + 1) % r->capacity].offset : r->offset;
+        if (end > from) {
+            out[n++] = r->stamps[k];
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    return n;
+}
+#endif
+#endif
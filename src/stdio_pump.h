@@ -0,0 +1,66 @@
+#ifndef ELI_STDIO_PUMP_H_
+#define ELI_STDIO_PUMP_H_
+#ifndef _WIN32
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** Background thread draining output pipes of children into C side sinks, so their memory and disk use
+** does not depend on Lua reading them. Targets are shared by the pump and the channel which created them.
+*/
+#define STDIO_PUMP_BLOCKED 1 // out_fd is full
+
+typedef struct stdio_pump_target stdio_pump_target;
+struct stdio_pump_target {
+    int fd;               // nonblocking read end, closed by pump once finished (-1)
+    int out_fd;           // nonblocking relay write end (-1 - none), closed with fd
+    int eof;              // nothing more to drain, guarded by lock
+    int blocked;          // waiting for out_fd to accept more, pump thread only
+    int refs;             // pump and channel
+    pthread_mutex_t lock; // guards fd reads and sink state
+    /* drains what is readable, called with lock held; -1 once fd is exhausted or failed, STDIO_PUMP_BLOCKED */
+    int (*drain)(stdio_pump_target* t);
+    void (*destroy)(stdio_pump_target* t);
+    stdio_pump_target *prev, *next; // registered targets, pump thread only
+};
+
+int stdio_pump_target_init(stdio_pump_target* t, int fd, int (*drain)(stdio_pump_target*),
+                           void (*destroy)(stdio_pump_target*));
+void stdio_pump_release(stdio_pump_target* t);
+/* starts pumping target, pump takes its own reference */
+int stdio_pump_add(stdio_pump_target* t);
+/* stops pumping target and drops caller reference */
+void stdio_pump_cancel(stdio_pump_target* t);
+/*
+** Library instance (Lua state) references. Pump thread is started on first use and stopped and joined when
+** the last reference is dropped, targets still pumped at that point are finished (fds closed).
+*/
+void stdio_pump_open(void);
+void stdio_pump_close(void);
+
+/* last capacity bytes of output in a ring */
+stdio_pump_target* stdio_tail_new(int fd, size_t capacity);
+size_t stdio_tail_capacity(stdio_pump_target* t);
+/* drains pending output, copies kept bytes oldest first (capacity at most) */
+size_t stdio_tail_read(stdio_pump_target* t, char* out, uint64_t* total);
+
+/* output written to path, renamed to path.1 ... path.keep once it reaches max_bytes */
+stdio_pump_target* stdio_rotate_new(int fd, const char* path, uint64_t max_bytes, int keep);
+const char* stdio_rotate_path(stdio_pump_target* t);
+
+#ifdef __linux__
+typedef struct stdio_chunk_stamp {
+    uint64_t offset;  // of first byte in the stream
+    uint64_t time_ns; // CLOCK_MONOTONIC when chunk was moved
+} stdio_chunk_stamp;
+
+/* forwards output to out_fd chunk by chunk, keeping stamps of the last entries chunks */
+stdio_pump_target* stdio_relay_new(int fd, int out_fd, size_t entries);
+size_t stdio_relay_capacity(stdio_pump_target* t);
+/* stamps of chunks ending after from, oldest first (capacity at most) */
+size_t stdio_relay_stamps(stdio_pump_target* t, uint64_t from, stdio_chunk_stamp* out);
+#endif
+
+#endif
+#endif